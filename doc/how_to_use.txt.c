@@ -56,9 +56,11 @@ int main(void) {
 // larger than the circles), and then do some cool collision
 // response.
 // If you need to delete a colliding object in response to a
-// collision, just flag it for deletion and delete it later.
-// Never call Boxnet_delbox() or Boxnet_delbox_byusrdata() inside
-// the callback!
+// collision, use Boxnet_delbox_deferred(); it deletes the box
+// right after Boxnet_collide() is done with the net, and the box
+// is in no more pairs from then on. Boxnet_addbox_deferred() adds
+// boxes the same way. Never call Boxnet_delbox(), Boxnet_addbox()
+// or Boxnet_delbox_byusrdata() inside the callback!
 // The callback looks like this:
 
     void collision(void* obj1, void* obj2, void* data) {
@@ -8,24 +8,35 @@
 #ifndef INCLUDE_BOXNET_H
 #define INCLUDE_BOXNET_H
 
-// TODO: tune these numbers correctly, or replace the
-// simplistic memory allocation with something better.
-//
-// These are only numbers for incremental memory allocation
-// ("vector_append" macro in boxnet.c)
-// e.g. BOXES_SIZE_INIT 100 means initially there will be
-// 100 boxes and when they are used up, another 100 will be
-// allocated, and so on.
+#include <stddef.h>
+
+// Initial sizes of the growing arrays ("vector_append" macro
+// in boxnet.c). e.g. BOXES_SIZE_INIT 100 means initially there
+// is room for 100 boxes; when they are used up, the capacity
+// is doubled, and so on. See also Boxnet_reserve().
 #define BOXES_SIZE_INIT 100
 #define COLLISIONS_SIZE_INIT 200
 #define REPAIR_QUEUE_INIT 100
 #define BC_QUEUE_SIZE_INIT 40
+// number of collision candidates that are gathered before
+// they are tested for overlap together (at most 32)
+#define BC_BATCH_SIZE 16
+// most collision walks that are interleaved, see Boxnet_setwalks()
+// (at most 16, the bits of Box.walk_marks)
+#define BOXNET_WALKS 16
+// most threads a repair uses, see Boxnet_setthreads()
+#define BOXNET_THREADS 64
 
 
 
 struct Box;
 struct Junction;
 struct RepairQueue;
+struct Trace;
+struct Published;
+struct Pipeline;
+struct Sweep;
+struct Deferred;
 
 typedef struct Junction {
 	struct Junction*	nb[4];		// neighbors; can be Null
@@ -45,26 +56,275 @@ typedef struct Box {
 	double				top;		// and from posy to top
 	void*				usrdata;	// user pointer; normally points
 									// to user-defined object
-	struct Box*			marked;
+	unsigned int		marked;		// by the collision walks
+	unsigned short		walk_marks;	// by the interleaved walks, a bit
+									// per slot (see BOXNET_WALKS)
+	int					index;		// position in Boxnet.boxes
+	unsigned int		id;			// unique in its net, never reused
+	double				margin;		// see Boxnet_setmargin()
+	double				netx;		// the bounds the net is built on;
+	double				nety;		// they contain the bounds above
+	double				netright;
+	double				nettop;
+	unsigned char		dirty;		// has to be repaired
+	unsigned char		deleted;	// see Boxnet_delbox_deferred()
+	unsigned char		ghost;		// only set for the net's own copies,
+									// see Boxnet_setperiodic()
 } Box;
 
+/*
+	counters for finding out what a frame spent its time on.
+	They are only updated if the library was compiled with
+	BOXNET_STATS defined (cmake -DBOXNET_STATS=ON); otherwise
+	counting costs nothing and all values stay zero.
+*/
+typedef struct Boxnet_stats {
+	long				flips;		// Junction_flipone() calls in the repair
+	long				slides;		// Junction_slide() and Junction_slide_T()
+	long				solve_conn;	// connections checked by the repair
+	long				synced;		// boxes whose net bounds changed
+									// (see Boxnet_setmargin())
+	long				relocated;	// boxes moved by Boxnet_movebox()
+									// instead of being slid there
+	long				rebuilds;	// repairs given up for a rebuild
+									// (see Boxnet_setautorebuild())
+	long				repair_queue_peak;
+	long				prep_flips;	// Junction_flip() calls in the collision
+									// preparation
+	long				junctions;	// junctions traversed by boxcollisions()
+	long				candidates;	// boxes tested for overlap
+	long				pairs;		// overlapping pairs reported
+	double				time_repair;	// seconds
+	double				time_prepare;
+	double				time_collide;
+} Boxnet_stats;
+
+/*
+	structural quality of the net. Rays are the four beams that
+	start at the lower left corner of every box; the more junctions
+	a ray crosses and the longer it is compared to the boxes, the
+	slower repair and collision detection get.
+*/
+typedef struct Boxnet_quality {
+	double				junctions_mean;	// junctions crossed per ray
+	int					junctions_max;
+	double				length_mean;	// length of bounded rays in units of
+	double				length_max;		// the mean box size along the ray
+	int					rays;			// number of rays
+	int					rays_infinite;	// rays that are not bounded
+} Boxnet_quality;
+
+// what Boxnet_collide() does when the net quality gets too bad
+#define BOXNET_QUALITY_IGNORE	0
+#define BOXNET_QUALITY_OPTIMIZE	1	// flip long rays shorter
+#define BOXNET_QUALITY_REBUILD	2	// build the net from scratch
+
+/*
+	user-installable memory functions, see Boxnet_newalloc().
+	Every call gets the sizes involved and ctx, so frame or arena
+	allocators don't need to keep track of block sizes.
+	realloc is only called with ptr!=NULL and alloc/realloc
+	return NULL on failure, like their standard counterparts.
+*/
+typedef struct Boxnet_allocator {
+	void*	(*alloc)(size_t size, void* ctx);
+	void*	(*realloc)(void* ptr, size_t old_size, size_t size, void* ctx);
+	void	(*free)(void* ptr, size_t size, void* ctx);
+	void*	ctx;
+} Boxnet_allocator;
+
+/*
+	memory held by a net in bytes, see Boxnet_memory_usage().
+	The junctions are part of the Box structs, but are counted
+	separately; boxes also contains the net->boxes and
+	net->giants arrays.
+*/
+typedef struct Boxnet_memory {
+	size_t	boxes;
+	size_t	junctions;
+	size_t	ghosts;			// see Boxnet_setperiodic(), junctions included
+	size_t	queues;			// repair and collision queues
+	size_t	deferred;		// see Boxnet_delbox_deferred()
+	size_t	pipeline;		// see Boxnet_commit()
+	size_t	sweep;			// see Boxnet_sweep()
+	size_t	threads;		// see Boxnet_setthreads()
+	size_t	trace;			// see Boxnet_trace_start()
+	size_t	published;		// see Boxnet_publish(); shared with the views
+							// and not from the net's allocator
+	size_t	slack;			// allocated but unused part of all of
+							// these, see Boxnet_shrink()
+	size_t	total;			// all of the above and the net itself
+} Boxnet_memory;
+
 typedef struct Boxnet {
-	struct Box**		boxes;
-	int					boxes_size;
-	int					boxes_size_max;
+	struct Box**		boxes;				// all boxes except the giants;
+	int					boxes_size;			// the ghosts are kept behind
+	int					boxes_size_max;		// boxes_size, see Boxnet_setperiodic()
+	struct Box**		giants;				// see Boxnet_setgiantsize()
+	int					giants_size;
+	int					giants_size_max;
+	double				giant_size;
+	double				period_x;			// see Boxnet_setperiodic()
+	double				period_y;
+	double				period_width;		// 0 if not periodic
+	double				period_height;
+	int					ghosts_size;
+	struct RepairQueue*	repair_queue[2];	// per-net work space
+	int					repair_cursor;		// see Boxnet_repairsome()
+	unsigned char		repair_syncing;
+	unsigned char		repair_all;
+	int					repair_moved;
+	struct Box**		bc_queue[BOXNET_WALKS];	// for the collision walks
+	int					bc_queue_size_max[BOXNET_WALKS];
+	int					walks;				// see Boxnet_setwalks()
+	Boxnet_stats		stats;				// current frame
+	Boxnet_stats		stats_frame;		// last finished frame
+	Boxnet_stats		stats_total;		// since creation or reset
+	int					threads;			// see Boxnet_setthreads()
+	struct WorkerPool*	pool;
+	int					auto_rebuild;		// see Boxnet_setautorebuild()
+	long				rebuild_steps;		// repair steps of the last rebuild
+	int					rebuild_streak;		// frames rebuilt in a row
+	int					quality_action;		// see Boxnet_setqualitypolicy()
+	double				quality_threshold;
+	int					quality_interval;
+	int					quality_countdown;
+	int					optimize_cursor;	// see Boxnet_optimize()
+	int					optimize_boxes;
+	double				optimize_microseconds;
+	int					reorder_interval;	// see Boxnet_setreorderinterval()
+	int					reorder_countdown;
+	unsigned int		next_id;			// for Box.id
+	struct Trace*		trace;				// see Boxnet_trace_start()
+	struct Published*	published;			// see Boxnet_publish()
+	int					publish_lock;
+	struct Pipeline*	pipeline;			// see Boxnet_commit()
+	struct Sweep*		sweep;				// see Boxnet_collide_swept()
+	int					colliding;			// see Boxnet_delbox_deferred()
+	struct Deferred*	deferred;
+	int					deferred_size;
+	int					deferred_size_max;
+	int					deferred_adds;
+	Boxnet_allocator	allocator;
 } Boxnet;
 
 typedef void (*collisionCallback)(void* obj1, void* obj2, void* data);
+typedef void (*sweptCallback)(void* obj1, void* obj2, double toi, void* data);
+
+/*
+	Trace file format, written by Boxnet_trace_start() and read by
+	tools/replay.c: a header ("BOXTRACE", uint32 version, uint32
+	0x01020304 to detect the byte order) followed by records of a
+	one-byte opcode and its arguments, packed, in the byte order of
+	the writing machine. Boxes are identified by Box.id.
+	Changed bounds are written as MOVE records whenever the net
+	looks at them, i.e. before each recorded call.
+*/
+#define BOXNET_TRACE_MAGIC		"BOXTRACE"
+#define BOXNET_TRACE_VERSION	1
+enum {
+	BOXNET_TRACE_ADD = 'A',		// uint32 id, int32 near id or -1,
+								// double x, y, right, top
+	BOXNET_TRACE_DEL = 'D',		// uint32 id
+	BOXNET_TRACE_MOVE = 'M',	// uint32 id, double x, y, right, top
+	BOXNET_TRACE_REPAIR = 'R',
+	BOXNET_TRACE_COLLIDE = 'C',	// uint64 number of reported pairs
+	BOXNET_TRACE_REBUILD = 'B',
+	BOXNET_TRACE_REORDER = 'O',
+	BOXNET_TRACE_OPTIMIZE = 'P',	// int32 max_boxes, double max_microseconds
+	BOXNET_TRACE_OPTIMIZEBUDGET = 'U',	// same
+	BOXNET_TRACE_REORDERINTERVAL = 'I',	// int32 interval
+	BOXNET_TRACE_QUALITYPOLICY = 'Q',	// int32 action, int32 interval,
+									// double max_length_mean
+	BOXNET_TRACE_MARGIN = 'G',	// uint32 id, double margin
+	BOXNET_TRACE_MOVEBOX = 'V',	// uint32 id, double x, y, right, top
+	BOXNET_TRACE_REPAIRSOME = 'S',	// int32 steps, int32 start
+	BOXNET_TRACE_AUTOREBUILD = 'T',	// int32 enabled
+	BOXNET_TRACE_GIANTSIZE = 'Z',	// double size
+	BOXNET_TRACE_PERIODIC = 'W',	// double x, y, width, height
+	BOXNET_TRACE_SWEEP = 'X',	// uint32 id, double x, y, right, top
+								// (the end bounds)
+	BOXNET_TRACE_COLLIDESWEPT = 'Y'	// uint64 number of reported pairs
+};
+
+/*
+	read-only view on a snapshot, e.g. a file mapped into memory
+	by several processes; see Boxnet_view_open(), or a version of
+	a net published for other threads; see Boxnet_view_acquire().
+	Boxes are identified by their number in the snapshot.
+*/
+typedef struct Boxnet_view Boxnet_view;
+typedef void (*viewCallback)(int box1, int box2, void* data);
 
 
 Boxnet* Boxnet_new();
+Boxnet* Boxnet_newalloc(const Boxnet_allocator* allocator);
+int Boxnet_reserve(Boxnet* net, int n);
+void Boxnet_memory_usage(Boxnet* net, Boxnet_memory* report);
+void Boxnet_shrink(Boxnet* net);
 void Boxnet_free(Boxnet* net);
 Box* Boxnet_addbox(Boxnet* net, double x, double y,
 							double right, double top,
 							Box* near, void* usrdata);
 void Boxnet_delbox(Boxnet* net, Box* box);
+void Boxnet_movebox(Boxnet* net, Box* box, double x, double y,
+							double right, double top);
 void Boxnet_delbox_byusrdata(Boxnet* net, void* usrdata);
+Box* Boxnet_addbox_deferred(Boxnet* net, double x, double y,
+							double right, double top,
+							Box* near, void* usrdata);
+int Boxnet_delbox_deferred(Boxnet* net, Box* box);
+void Boxnet_setmargin(Boxnet* net, Box* box, double margin);
+void Boxnet_setgiantsize(Boxnet* net, double size);
+// a periodic world has no giants, Boxnet_setgiantsize() is ignored
+void Boxnet_setperiodic(Boxnet* net, double x, double y,
+							double width, double height);
+void Boxnet_repair(Boxnet* net);
+int Boxnet_repairsome(Boxnet* net, int max_steps, double max_microseconds);
+int Boxnet_repairresume(Boxnet* net, int max_steps, double max_microseconds);
+int Boxnet_repaired(const Boxnet* net);
 void Boxnet_collide(Boxnet* net, collisionCallback func, void* data);
+int Boxnet_trycollide(Boxnet* net, collisionCallback func, void* data);
+int Boxnet_stage(Boxnet* net, Box* box, double x, double y,
+							double right, double top);
+void Boxnet_commit(Boxnet* net, collisionCallback func, void* data);
+void Boxnet_wait(Boxnet* net);
+int Boxnet_sweep(Boxnet* net, Box* box, double x, double y,
+							double right, double top);
+int Boxnet_collide_swept(Boxnet* net, sweptCallback func, void* data);
+void Boxnet_rebuild(Boxnet* net);
+void Boxnet_setautorebuild(Boxnet* net, int enabled);
+void Boxnet_setthreads(Boxnet* net, int threads);
+void Boxnet_setwalks(Boxnet* net, int walks);
+void Boxnet_reorder(Boxnet* net);
+void Boxnet_setreorderinterval(Boxnet* net, int interval);
+void Boxnet_optimize(Boxnet* net, int max_boxes, double max_microseconds);
+void Boxnet_setoptimizebudget(Boxnet* net, int max_boxes, double max_microseconds);
+void Boxnet_getquality(Boxnet* net, Boxnet_quality* quality);
+void Boxnet_setqualitypolicy(Boxnet* net, int action,
+							double max_length_mean, int interval);
+size_t Boxnet_snapshotsize(Boxnet* net);
+void Boxnet_snapshot(Boxnet* net, void* buffer);
+Boxnet* Boxnet_restore(const void* buffer, size_t size);
+Boxnet* Boxnet_restorealloc(const void* buffer, size_t size, const Boxnet_allocator* allocator);
+int Boxnet_save(Boxnet* net, const char* filename);
+Boxnet* Boxnet_load(const char* filename);
+Boxnet* Boxnet_loadalloc(const char* filename, const Boxnet_allocator* allocator);
+Boxnet_view* Boxnet_view_new(const void* buffer, size_t size);
+Boxnet_view* Boxnet_view_open(const char* filename);
+void Boxnet_view_free(Boxnet_view* view);
+int Boxnet_view_size(Boxnet_view* view);
+void Boxnet_view_getbox(Boxnet_view* view, int box,
+						double* left, double* bottom, double* right, double* top);
+void Boxnet_view_collide(Boxnet_view* view, viewCallback func, void* data);
+int Boxnet_publish(Boxnet* net);
+Boxnet_view* Boxnet_view_acquire(Boxnet* net);
+int Boxnet_view_refresh(Boxnet_view* view, Boxnet* net);
+unsigned long Boxnet_view_version(Boxnet_view* view);
+int Boxnet_trace_start(Boxnet* net, const char* filename);
+int Boxnet_trace_stop(Boxnet* net);
+void Boxnet_getstats(Boxnet* net, Boxnet_stats* frame, Boxnet_stats* total);
+void Boxnet_resetstats(Boxnet* net);
 
 
 
@@ -0,0 +1,79 @@
+/*
+	Copyright 2012 Samuel Moll
+	License: AGPLv3
+
+	A world cut into a grid of tiles, each one a Boxnet of its own,
+	so that the tiles can be repaired and searched for collisions
+	in parallel. A box that straddles tile borders is put into every
+	tile it touches; an overlapping pair is only reported by the
+	tile that contains the lower left corner of the overlap region,
+	so every pair is still reported exactly once.
+*/
+
+#ifndef INCLUDE_BOXWORLD_H
+#define INCLUDE_BOXWORLD_H
+
+#include "boxnet.h"
+
+struct Boxworld;
+
+typedef struct Boxworld_box {
+	double				posx;		// the bounds; may be changed freely,
+	double				posy;		// the tiles are updated by
+	double				right;		// Boxworld_repair() and
+	double				top;		// Boxworld_collide()
+	void*				usrdata;
+	int					tiles[4];	// tiles it is in: x0, y0, x1, y1
+	struct Box**		parts;		// its boxes in those tiles, row by row
+	struct Box*			part;		// parts of a box in only one tile
+	int					index;		// position in Boxworld.boxes
+} Boxworld_box;
+
+typedef struct Boxworld_tile {
+	struct Boxnet*		net;
+	struct Boxworld*	world;
+	int					x;
+	int					y;
+	Boxworld_box**		pairs;		// found by the last collide, 2 per pair
+	int					pairs_size;
+	int					pairs_size_max;
+	Boxworld_box**		moved;		// boxes that change tiles
+	int					moved_size;
+	int					moved_size_max;
+	int					added;		// boxes that entered since the last repair
+} Boxworld_tile;
+
+typedef struct Boxworld {
+	double				x;			// the world; boxes outside of it
+	double				y;			// belong to the border tiles
+	double				tilewidth;
+	double				tileheight;
+	int					tiles_x;
+	int					tiles_y;
+	Boxworld_tile*		tiles;		// row by row
+	Boxworld_box**		boxes;
+	int					boxes_size;
+	int					boxes_size_max;
+	int					threads;	// see Boxworld_setthreads()
+	int					jobs_next;	// work distribution between threads
+	int					jobs_failed;	// a job ran out of memory
+	Boxnet_allocator	allocator;	// for the world and its tiles
+} Boxworld;
+
+
+Boxworld* Boxworld_new(double x, double y, double right, double top,
+								int tiles_x, int tiles_y);
+Boxworld* Boxworld_newalloc(double x, double y, double right, double top,
+								int tiles_x, int tiles_y,
+								const Boxnet_allocator* allocator);
+void Boxworld_free(Boxworld* world);
+void Boxworld_setthreads(Boxworld* world, int threads);
+Boxworld_box* Boxworld_addbox(Boxworld* world, double x, double y,
+								double right, double top, void* usrdata);
+void Boxworld_delbox(Boxworld* world, Boxworld_box* box);
+int Boxworld_repair(Boxworld* world);
+int Boxworld_collide(Boxworld* world, collisionCallback func, void* data);
+
+
+
+#endif
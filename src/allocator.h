@@ -0,0 +1,72 @@
+/*
+	Copyright 2012 Samuel Moll
+	License: AGPLv3
+
+	Memory handling shared by boxnet.c and boxworld.c, not part
+	of the API. All memory of a net or a world goes through its
+	Boxnet_allocator, see Boxnet_newalloc().
+*/
+
+#ifndef SRC_ALLOCATOR_H
+#define SRC_ALLOCATOR_H
+
+#include <stdlib.h>
+#include "boxnet.h"
+
+static inline void* default_alloc(size_t size, void* ctx) {
+	return malloc(size);
+}
+
+static inline void* default_realloc(void* ptr, size_t old_size, size_t size, void* ctx) {
+	return realloc(ptr, size);
+}
+
+static inline void default_free(void* ptr, size_t size, void* ctx) {
+	free(ptr);
+}
+
+static const Boxnet_allocator default_allocator = {
+	default_alloc, default_realloc, default_free, NULL
+};
+
+// a may be NULL for the default allocator
+static inline void* mem_alloc(const Boxnet_allocator* a, size_t size) {
+	if(a==NULL)
+		a = &default_allocator;
+	return a->alloc(size, a->ctx);
+}
+
+// like realloc(), ptr may be NULL
+static inline void* mem_realloc(const Boxnet_allocator* a, void* ptr,
+								size_t old_size, size_t size) {
+	if(a==NULL)
+		a = &default_allocator;
+	if(ptr==NULL)
+		return a->alloc(size, a->ctx);
+	return a->realloc(ptr, old_size, size, a->ctx);
+}
+
+static inline void mem_free(const Boxnet_allocator* a, void* ptr, size_t size) {
+	if(a==NULL)
+		a = &default_allocator;
+	if(ptr!=NULL)
+		a->free(ptr, size, a->ctx);
+}
+
+/*
+	grows the vector v of *v_size_max elements of elem_size bytes:
+	the capacity doubles, starting with v_init, so appending n
+	elements costs O(n) in total. Returns the new vector, or NULL
+	if there isn't enough memory; v and *v_size_max are still
+	valid then.
+*/
+static inline void* vector_grow(const Boxnet_allocator* a, void* v,
+								int* v_size_max, size_t elem_size, int v_init) {
+	int grown = *v_size_max>0 ? 2 * *v_size_max : v_init;
+	void* new = mem_realloc(a, v, *v_size_max * elem_size, grown * elem_size);
+	if(new!=NULL)
+		*v_size_max = grown;
+	return new;
+}
+
+#endif
@@ -18,8 +18,7 @@
 	that also adds the box to the repair queue or so.
 	
 	TODO: implement a segment query, a proper raycast and a BB query.
-	this might require reactivating (and probably rewriting) the
-	navigate() function :|
+	locate() can find the junction to start the walk from.
 	
 	TODO: devise a good solution for static geometry...
 	
@@ -45,11 +44,36 @@
 //#define NDEBUG
 #define NOTEST
 
+// for clock_gettime() and pthreads
+#define _POSIX_C_SOURCE 200112L
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
 #include <assert.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "boxnet.h"
+#include "allocator.h"
+
+/*
+	the x86 overlap kernels are compiled with per-function target
+	attributes and chosen at runtime, so the library itself can
+	still be built without -mavx. Define BOXNET_NO_SIMD to always
+	use the portable version.
+*/
+#if !defined(BOXNET_NO_SIMD) && defined(__GNUC__) && \
+		(defined(__x86_64__) || defined(__i386__))
+#define BOXNET_SIMD_X86
+#include <immintrin.h>
+#endif
 
 // debugging functions
 static void validate(Boxnet* net);
@@ -65,23 +89,96 @@ typedef struct RepairQueue {
 	struct Connection*	queue;
 	int					size;
 	int					size_max;
+	Boxnet*				net;		// owner; for its allocator
+	Boxnet_stats*		stats;		// counters of the owning net
 } RepairQueue;
 
 
+/*
+	statistics counting; STAT(...) compiles to nothing
+	unless BOXNET_STATS is defined.
+*/
+#ifdef BOXNET_STATS
+#define STAT(x) x
+#else
+#define STAT(x)
+#endif
+
+// monotonic time in seconds
+static double bn_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+
+
+// like collisionCallback, but with the boxes instead of their usrdata
+typedef void (*boxCallback)(Box* box1, Box* box2, void* data);
 
 static Junction* Junction_flip(Junction* jnc, struct RepairQueue* queue);
+static void seed_junction(Junction* jnc, struct RepairQueue* q);
+static void mark_dirty(Boxnet* net, Box* box);
+static void repair_seed(Boxnet* net, Box* box);
+static void repair_finish(Boxnet* net);
+static Junction* locate(Boxnet* net, Box* except, double x, double y);
 static void detach(Junction* jnc);
+static void published_release(struct Published* published);
+static int giant_leave(Boxnet* net, Box* box);
+static int giant_enter(Boxnet* net, Box* box);
+static void pipeline_drop(Boxnet* net, Box* box);
+static int is_giant(Boxnet* net, Box* box);
+static int giants_reserve(Boxnet* net);
+static void giant_add(Boxnet* net, Box* box);
+static void giant_remove(Boxnet* net, Box* box);
+static void pipeline_free(Boxnet* net);
+static size_t pipeline_memory(Boxnet* net, size_t* slack);
+static void pipeline_shrink(Boxnet* net);
+static void pool_free(Boxnet* net);
+static size_t pool_memory(Boxnet* net);
+static void sweep_drop(Boxnet* net, Box* box);
+static void sweep_free(Boxnet* net);
+static size_t sweep_memory(Boxnet* net, size_t* slack);
+static void sweep_shrink(Boxnet* net);
+static size_t published_memory(Boxnet* net);
+static void deferred_free(Boxnet* net);
+static void Box_remove(Boxnet* net, Box* box);
+static void ghosts_drop(Boxnet* net, Box* owner);
+static void periodic_sync(Boxnet* net);
+static int periodic_pair(Boxnet* net, Box** box1, Box** box2);
+
+
+/*
+	all memory of a net goes through its allocator, see
+	Boxnet_newalloc(). net may be NULL for memory that doesn't
+	belong to a net.
+*/
+static const Boxnet_allocator* bn_allocator(Boxnet* net) {
+	return net!=NULL ? &net->allocator : NULL;
+}
+
+static void* bn_alloc(Boxnet* net, size_t size) {
+	return mem_alloc(bn_allocator(net), size);
+}
+
+// like realloc(), ptr may be NULL
+static void* bn_realloc(Boxnet* net, void* ptr, size_t old_size, size_t size) {
+	return mem_realloc(bn_allocator(net), ptr, old_size, size);
+}
 
+static void bn_free(Boxnet* net, void* ptr, size_t size) {
+	mem_free(bn_allocator(net), ptr, size);
+}
 
 /*
-	vector handling function...
+	vector handling function, see vector_grow().
+	Running out of memory here, in the middle of a repair or
+	collision walk, can't be recovered from.
 */
-#define vector_append(v, append, v_size,\
-					 v_size_max, v_inc) {\
+#define vector_append(net, v, append, v_size,\
+					 v_size_max, v_init) {\
 	if((v_size) == (v_size_max)) {\
-		/* TODO: add error checking (NULL pointer)*/\
-		v_size_max+=v_inc;\
-		v = realloc(v, (v_size_max)*sizeof *(v));\
+		v = vector_grow(bn_allocator(net), v, &(v_size_max), sizeof *(v), v_init);\
 		assert((v)!=NULL);\
 	}\
 	(v)[v_size]=append;\
@@ -90,18 +187,27 @@ static void detach(Junction* jnc);
 
 
 
+// number of boxes linked into the net: the boxes and their ghosts
+static int linked(Boxnet* net) {
+	return net->boxes_size + net->ghosts_size;
+}
+
 // TODO: maybe allocate boxes in a continuous array for better
 //       cache coherence
 //       write a box relocation function (swap memory location
 //       of two boxes; all links to Junction members of the box
 //       must be changed too then
-static Box* Box_new() {
-	Box* new = malloc(sizeof *new);
-	assert(new!=NULL);
+static Box* Box_new(Boxnet* net) {
+	Box* new = bn_alloc(net, sizeof *new);
+	if(new==NULL)
+		return NULL;
 	new->jnc.dir = 4; // those never change...
 	new->jnc.pos[0] = new;
 	new->jnc.pos[1] = new;
 	new->jnc.enqueued = 0;
+	new->deleted = 0;
+	new->ghost = 0;
+	new->walk_marks = 0;
 	for(int d=0;d<4;d++) {
 		new->rayend[d].pos[d%2] = new;
 		new->rayend[d].enqueued = 0;
@@ -112,40 +218,84 @@ static Box* Box_new() {
 
 
 /*
-	removes all associated junctions from the net
-	and frees memory for box.
+	removes all associated junctions from the net. If queue
+	isn't NULL, the connections this changes are enqueued, for
+	a repair that is still pending.
 */
-static void Box_free(Box* box) {
+static void Box_detach(Box* box, RepairQueue* queue) {
 	assert(box!=NULL);
 	/* disconnect the associated junction from the net */
 	for(int d=0;d<4;d++) {
 		Junction* jnc = box->jnc.nb[d];
 		if(jnc!=NULL && jnc->dir!=(d^2))
-			Junction_flip(jnc,NULL);
+			Junction_flip(jnc,queue);
 	}
 	for(int d=0;d<4;d++) {
 		Junction* jnc = &box->rayend[d];
-		if(jnc->dir!=5)
-			detach(jnc);
+		if(jnc->dir==5)
+			continue;
+		Junction* prev = jnc->nb[jnc->beamdir^2];
+		Junction* next = jnc->nb[jnc->beamdir];
+		detach(jnc);
+		if(queue!=NULL) {
+			seed_junction(prev, queue);
+			if(next!=NULL)
+				seed_junction(next, queue);
+		}
+	}
+}
+
+/*
+	removes all associated junctions from the net
+	and frees memory for box.
+*/
+static void Box_free(Boxnet* net, Box* box) {
+	if(net->repair_cursor<0) {
+		Box_detach(box, NULL);
+	} else {
+		Box_detach(box, net->repair_queue[0]);
+		// forget the pending connections of box's own junctions
+		for(int k=0;k<2;k++) {
+			RepairQueue* q = net->repair_queue[k];
+			int j = 0;
+			for(int i=0;i<q->size;i++) {
+				Junction* jnc = q->queue[i].jnc;
+				if(jnc!=&box->jnc && jnc!=&box->rayend[0] && jnc!=&box->rayend[1] &&
+						jnc!=&box->rayend[2] && jnc!=&box->rayend[3])
+					q->queue[j++] = q->queue[i];
+			}
+			q->size = j;
+		}
 	}
-	free(box);
+	bn_free(net, box, sizeof *box);
 }
 
 
-static RepairQueue RepairQueue_new() {
-	RepairQueue	q;
-	q.queue = malloc(REPAIR_QUEUE_INIT * sizeof *q.queue);
-	assert(q.queue!=NULL);
-	q.size_max=REPAIR_QUEUE_INIT;
+static RepairQueue* RepairQueue_new(Boxnet* net) {
+	RepairQueue* q = bn_alloc(net, sizeof *q);
+	if(q==NULL)
+		return NULL;
+	q->queue = NULL;
+	q->size = 0;
+	q->size_max = 0;
+	q->net = net;
+	q->stats = &net->stats;
 	return q;
 }
 
+static void RepairQueue_free(RepairQueue* q) {
+	if(q==NULL)
+		return;
+	bn_free(q->net, q->queue, q->size_max * sizeof *q->queue);
+	bn_free(q->net, q, sizeof *q);
+}
+
 static void RepairQueue_append(Junction* jnc, unsigned char tdir, RepairQueue* q) {
 	if((jnc->enqueued & (1<<tdir)) == 0) {
 		struct Connection conn;
 		conn.jnc = jnc;
 		conn.tdir = tdir;
-		vector_append(q->queue, conn, q->size, q->size_max, REPAIR_QUEUE_INIT);
+		vector_append(q->net, q->queue, conn, q->size, q->size_max, REPAIR_QUEUE_INIT);
 		jnc->enqueued ^= (1<<tdir);
 	}
 }
@@ -153,12 +303,77 @@ static void RepairQueue_append(Junction* jnc, unsigned char tdir, RepairQueue* q
 
 
 Boxnet* Boxnet_new() {
-	Boxnet* new = malloc(sizeof *new);
-	assert(new!=NULL);
-	new->boxes = malloc(BOXES_SIZE_INIT * sizeof *new->boxes);
-	assert(new->boxes!=NULL);
-	new->boxes_size_max = BOXES_SIZE_INIT;
+	return Boxnet_newalloc(NULL);
+}
+
+/*
+	creates a net that gets all its memory from allocator, or
+	from malloc() if allocator is NULL. The allocator is copied.
+	Returns NULL if there isn't enough memory.
+*/
+Boxnet* Boxnet_newalloc(const Boxnet_allocator* allocator) {
+	if(allocator==NULL)
+		allocator = &default_allocator;
+	Boxnet* new = allocator->alloc(sizeof *new, allocator->ctx);
+	if(new==NULL)
+		return NULL;
+	new->allocator = *allocator;
+	new->boxes = bn_alloc(new, BOXES_SIZE_INIT * sizeof *new->boxes);
+	new->boxes_size_max = new->boxes!=NULL ? BOXES_SIZE_INIT : 0;
 	new->boxes_size = 0;
+	new->repair_queue[0] = RepairQueue_new(new);
+	new->repair_queue[1] = RepairQueue_new(new);
+	for(int slot=0;slot<BOXNET_WALKS;slot++) {
+		new->bc_queue[slot] = NULL;
+		new->bc_queue_size_max[slot] = 0;
+	}
+	new->walks = 1;
+	new->trace = NULL;
+	new->published = NULL;
+	new->publish_lock = 0;
+	new->pipeline = NULL;
+	new->pool = NULL;
+	new->sweep = NULL;
+	new->colliding = 0;
+	new->deferred = NULL;
+	new->deferred_size = 0;
+	new->deferred_size_max = 0;
+	new->deferred_adds = 0;
+	new->giants = NULL;
+	new->giants_size = 0;
+	new->giants_size_max = 0;
+	new->giant_size = 0;
+	new->period_x = 0;
+	new->period_y = 0;
+	new->period_width = 0;
+	new->period_height = 0;
+	new->ghosts_size = 0;
+	if(new->boxes==NULL || new->repair_queue[0]==NULL ||
+			new->repair_queue[1]==NULL) {
+		Boxnet_free(new);
+		return NULL;
+	}
+	memset(&new->stats, 0, sizeof new->stats);
+	memset(&new->stats_frame, 0, sizeof new->stats_frame);
+	memset(&new->stats_total, 0, sizeof new->stats_total);
+	new->threads = 1;
+	new->auto_rebuild = 0;
+	new->rebuild_steps = 0;
+	new->rebuild_streak = 0;
+	new->quality_action = BOXNET_QUALITY_IGNORE;
+	new->quality_threshold = 0;
+	new->quality_interval = 0;
+	new->quality_countdown = 0;
+	new->repair_cursor = -1;
+	new->repair_syncing = 0;
+	new->repair_all = 0;
+	new->repair_moved = 0;
+	new->optimize_cursor = 0;
+	new->optimize_boxes = 0;
+	new->optimize_microseconds = 0;
+	new->reorder_interval = 0;
+	new->reorder_countdown = 0;
+	new->next_id = 0;
 	return new;
 }
 
@@ -167,82 +382,262 @@ Boxnet* Boxnet_new() {
 	Box and Junction structures.
 */
 void Boxnet_free(Boxnet* net) {
-	for(int i=0;i<net->boxes_size;i++) {
-		Box_free(net->boxes[i]);
+	if(net->pipeline!=NULL)
+		pipeline_free(net);
+	if(net->sweep!=NULL)
+		sweep_free(net);
+	if(net->pool!=NULL)
+		pool_free(net);
+	Boxnet_trace_stop(net);
+	net->repair_cursor = -1;
+	for(int i=0;i<linked(net);i++) {
+		Box_free(net, net->boxes[i]);
 	}
-	free(net->boxes);
-	free(net);
+	bn_free(net, net->boxes, net->boxes_size_max * sizeof *net->boxes);
+	for(int i=0;i<net->giants_size;i++)
+		bn_free(net, net->giants[i], sizeof *net->giants[i]);
+	bn_free(net, net->giants, net->giants_size_max * sizeof *net->giants);
+	deferred_free(net);
+	RepairQueue_free(net->repair_queue[0]);
+	RepairQueue_free(net->repair_queue[1]);
+	for(int slot=0;slot<BOXNET_WALKS;slot++)
+		bn_free(net, net->bc_queue[slot], net->bc_queue_size_max[slot] * sizeof *net->bc_queue[slot]);
+	if(net->published!=NULL)
+		published_release(net->published);
+	Boxnet_allocator allocator = net->allocator;
+	allocator.free(net, sizeof *net, allocator.ctx);
 }
 
-#ifdef COMMENT_THIS_OUT
 /*
-	returns the direction of (px,py) in relation to jnc.
-	0=upper left, 1=lower left, 2=lower right, 3=upper right
-	(with positive x right, positive y up)
+	copies the counters of the last finished frame (the last
+	Boxnet_collide() and any Boxnet_repair() calls before it) and/or
+	the accumulated counters since Boxnet_new() or Boxnet_resetstats().
+	Either pointer may be NULL.
 */
-static unsigned char quadrant(Junction* jnc, double px, double py) {
-	return ((px > jnc->pos[0]->posx)<<1) ^ ((py < jnc->pos[1]->posy) ^
-	(px > jnc->pos[0]->posx));
+void Boxnet_getstats(Boxnet* net, Boxnet_stats* frame, Boxnet_stats* total) {
+	if(frame!=NULL)
+		*frame = net->stats_frame;
+	if(total!=NULL)
+		*total = net->stats_total;
 }
 
+void Boxnet_resetstats(Boxnet* net) {
+	memset(&net->stats, 0, sizeof net->stats);
+	memset(&net->stats_frame, 0, sizeof net->stats_frame);
+	memset(&net->stats_total, 0, sizeof net->stats_total);
+}
 
+#ifdef BOXNET_STATS
 /*
-	find a Junction that is guaranteed to be a neighbor of (x,y),
-	that is a junction that lies on the edges of the surronding
-	rectangle.
-	Is more or less only needed when inserting new Junctions.
-	
-	this function was deactivated and is not currently used;
-	new boxes are just inserted wherever and the boxnet repair
-	function takes care of the rest.
-	
-	TODO:
-	maybe rewrite this function and use it again as an
-	optimization for inserting points.
-	
-	this function has a bug (occuring rarely) that might have
-	something to do with junctions having the same coordinates.
+	ends the current frame: its counters become the "last frame"
+	and are added to the totals.
+*/
+static void stats_endframe(Boxnet* net) {
+	Boxnet_stats* s = &net->stats;
+	Boxnet_stats* t = &net->stats_total;
+	t->flips += s->flips;
+	t->slides += s->slides;
+	t->solve_conn += s->solve_conn;
+	t->synced += s->synced;
+	t->relocated += s->relocated;
+	t->rebuilds += s->rebuilds;
+	if(s->repair_queue_peak > t->repair_queue_peak)
+		t->repair_queue_peak = s->repair_queue_peak;
+	t->prep_flips += s->prep_flips;
+	t->junctions += s->junctions;
+	t->candidates += s->candidates;
+	t->pairs += s->pairs;
+	t->time_repair += s->time_repair;
+	t->time_prepare += s->time_prepare;
+	t->time_collide += s->time_collide;
+	net->stats_frame = *s;
+	memset(s, 0, sizeof *s);
+}
+#endif
+
+
+
+/*
+	Tracing
+	=======
 	
-	since "navigate" is currently not used, the bug is not showing.
-*/
-static Junction* navigate(Junction* start, double x, double y) {
-	Junction* cur = start;
-	// choose initial direction
-	unsigned char quadr = quadrant(cur,x,y);
-	unsigned char curdir = quadr;
-	if((curdir^2) == cur->dir)
-		curdir = (curdir+1)%4;
-	unsigned char found = 0; // 1=pass, 2=pass+change
-	while(1) {
-		Junction* next = cur->nb[curdir];
-		// are we going to infinity?
-		if(next==NULL) {
-			// counts as pass
-			if(found==2)
-				break;
-			found=1;
-			curdir=curdir^2; // backtrack...
-		} else {
-			cur = next;
-		}
-		// try to change direction
-		unsigned char quadrnew = quadrant(cur,x,y);
-		if(quadrnew!=quadr) {
-			if(found==2)
-				break;
-			found=1;
-			quadr = quadrnew;
-		}
-		// turn to point if possible
-		unsigned char newdir = (4+quadr-curdir)%4 < 2 ? (curdir+1)%4 : (curdir+3)%4;
-		if((newdir^2) != cur->dir) {
-			found = found==1 ? 2 : 0; // reset if change+change
-			curdir = newdir;
+	While a trace is running, every call that changes the net or
+	asks it for collisions is appended to a file, so that a real
+	workload can be replayed offline by tools/replay.c (see
+	boxnet.h for the format). Bounds are written directly into the
+	boxes by the user, so they are compared with the last recorded
+	ones whenever the net is about to look at them.
+	A recorded call detaches the trace from the net while it runs,
+	so the calls it makes itself (e.g. Boxnet_collide() calling
+	Boxnet_repair()) are not recorded again.
+*/
+
+typedef struct Trace {
+	FILE*				file;
+	Boxnet*				net;		// owns the memory of the trace
+	double*				bounds;		// last recorded bounds by Box.id
+	unsigned int		bounds_size_max;
+	int					failed;		// out of memory, nothing more is written
+	collisionCallback	func;		// wrapped by trace_count()
+	void*				data;
+	uint64_t			pairs;
+} Trace;
+
+static void trace_write(Trace* t, const void* arg, size_t size) {
+	if(size>0 && !t->failed)
+		fwrite(arg, size, 1, t->file);
+}
+
+static void trace_bounds(Trace* t, Box* box) {
+	if(box->id >= t->bounds_size_max) {
+		unsigned int size = 2*t->bounds_size_max;
+		while(box->id >= size)
+			size *= 2;
+		double* bounds = bn_realloc(t->net, t->bounds,
+						4*t->bounds_size_max * sizeof *bounds, 4*size * sizeof *bounds);
+		if(bounds==NULL) {
+			// the trace can't go on, Boxnet_trace_stop() reports it
+			t->failed = 1;
+			return;
 		}
+		t->bounds = bounds;
+		t->bounds_size_max = size;
 	}
-	return cur;
+	double* b = &t->bounds[4*box->id];
+	b[0] = box->posx;	b[1] = box->posy;
+	b[2] = box->right;	b[3] = box->top;
+	trace_write(t, b, 4*sizeof *b);
+}
+
+static void trace_op(Trace* t, unsigned char op) {
+	trace_write(t, &op, 1);
+}
+
+static void trace_add(Boxnet* net, Box* box, Box* near) {
+	Trace* t = net->trace;
+	uint32_t id = box->id;
+	int32_t near_id = near!=NULL ? (int32_t)near->id : -1;
+	trace_op(t, BOXNET_TRACE_ADD);
+	trace_write(t, &id, sizeof id);
+	trace_write(t, &near_id, sizeof near_id);
+	trace_bounds(t, box);
+}
+
+// records the bounds of box if they changed since the last time
+static void trace_moved(Trace* t, Box* box) {
+	if(t->failed)
+		return;
+	double* b = &t->bounds[4*box->id];
+	if(b[0]!=box->posx || b[1]!=box->posy || b[2]!=box->right || b[3]!=box->top) {
+		uint32_t id = box->id;
+		trace_op(t, BOXNET_TRACE_MOVE);
+		trace_write(t, &id, sizeof id);
+		trace_bounds(t, box);
+	}
+}
+
+/*
+	records the bounds that changed since they were last recorded,
+	then detaches the trace for the duration of a recorded call.
+	Returns NULL if the net isn't traced (or the call is nested).
+*/
+static Trace* trace_begin(Boxnet* net) {
+	Trace* t = net->trace;
+	if(t==NULL)
+		return NULL;
+	for(int i=0;!t->failed && i<net->boxes_size+net->giants_size;i++)
+		trace_moved(t, i<net->boxes_size ? net->boxes[i] : net->giants[i-net->boxes_size]);
+	net->trace = NULL;
+	return t;
+}
+
+/*
+	records a call with up to two arguments after it has run,
+	and attaches the trace again.
+*/
+static void trace_end(Boxnet* net, Trace* t, unsigned char op,
+				const void* arg1, size_t size1, const void* arg2, size_t size2) {
+	if(t==NULL)
+		return;
+	trace_op(t, op);
+	trace_write(t, arg1, size1);
+	trace_write(t, arg2, size2);
+	net->trace = t;
+}
+
+static void trace_count(void* obj1, void* obj2, void* data) {
+	Trace* t = data;
+	t->pairs++;
+	t->func(obj1, obj2, t->data);
+}
+
+/*
+	starts recording all calls on net to a new file, beginning
+	with its current boxes and settings. Returns 0 on success,
+	-1 if the file can't be created or there isn't enough memory.
+*/
+int Boxnet_trace_start(Boxnet* net, const char* filename) {
+	if(net->trace!=NULL)
+		Boxnet_trace_stop(net);
+	FILE* f = fopen(filename, "wb");
+	if(f==NULL)
+		return -1;
+	Trace* t = bn_alloc(net, sizeof *t);
+	unsigned int size = net->next_id > 0 ? net->next_id : 1;
+	double* bounds = bn_alloc(net, 4*size * sizeof *bounds);
+	if(t==NULL || bounds==NULL) {
+		bn_free(net, t, sizeof *t);
+		bn_free(net, bounds, 4*size * sizeof *bounds);
+		fclose(f);
+		remove(filename);
+		return -1;
+	}
+	t->file = f;
+	t->net = net;
+	t->bounds = bounds;
+	t->bounds_size_max = size;
+	t->failed = 0;
+	uint32_t header[2] = {BOXNET_TRACE_VERSION, 0x01020304};
+	trace_write(t, BOXNET_TRACE_MAGIC, 8);
+	trace_write(t, header, sizeof header);
+	net->trace = t;
+	for(int i=0;i<net->boxes_size;i++)
+		trace_add(net, net->boxes[i], NULL);
+	for(int i=0;i<net->giants_size;i++)
+		trace_add(net, net->giants[i], NULL);
+	int32_t boxes = net->optimize_boxes;
+	int32_t interval = net->reorder_interval;
+	trace_end(net, t, BOXNET_TRACE_OPTIMIZEBUDGET, &boxes, sizeof boxes,
+				&net->optimize_microseconds, sizeof net->optimize_microseconds);
+	trace_end(net, t, BOXNET_TRACE_REORDERINTERVAL, &interval, sizeof interval, NULL, 0);
+	int32_t quality[2] = {net->quality_action, net->quality_interval};
+	trace_end(net, t, BOXNET_TRACE_QUALITYPOLICY, quality, sizeof quality,
+				&net->quality_threshold, sizeof net->quality_threshold);
+	int32_t auto_rebuild = net->auto_rebuild;
+	trace_end(net, t, BOXNET_TRACE_AUTOREBUILD, &auto_rebuild, sizeof auto_rebuild, NULL, 0);
+	trace_end(net, t, BOXNET_TRACE_GIANTSIZE, &net->giant_size, sizeof net->giant_size, NULL, 0);
+	trace_end(net, t, BOXNET_TRACE_PERIODIC, &net->period_x, 2 * sizeof net->period_x,
+				&net->period_width, 2 * sizeof net->period_width);
+	return 0;
+}
+
+/*
+	stops recording and closes the trace file. Returns 0 if the
+	whole trace was written successfully, -1 otherwise.
+*/
+int Boxnet_trace_stop(Boxnet* net) {
+	Trace* t = net->trace;
+	if(t==NULL)
+		return 0;
+	int failed = t->failed || ferror(t->file);
+	if(fclose(t->file)!=0)
+		failed = 1;
+	bn_free(net, t->bounds, 4*t->bounds_size_max * sizeof *t->bounds);
+	bn_free(net, t, sizeof *t);
+	net->trace = NULL;
+	return failed ? -1 : 0;
 }
-#endif
+
 
 
 /*
@@ -369,6 +764,7 @@ static Junction* Junction_flipone_rewrite(Junction* jnc, RepairQueue* queue) {
 }*/
 
 static Junction* Junction_flipone(Junction* jnc, RepairQueue* queue) {
+	STAT(if(queue!=NULL) queue->stats->flips++;)
 	Junction* next = jnc->nb[jnc->beamdir];
 	if(next != NULL) {
 		if(queue!=NULL) {
@@ -410,13 +806,13 @@ static Junction* Junction_flipone(Junction* jnc, RepairQueue* queue) {
 	next = cur->nb[flipped->dir^2];
 	while(next != NULL && next->dir == flipped->beamdir) {
 		if(flipped->dir==0) {
-			if(flipped->pos[1]->posy > next->pos[1]->posy) break;
+			if(flipped->pos[1]->nety > next->pos[1]->nety) break;
 		} else if (flipped->dir==1) {
-			if(flipped->pos[0]->posx < next->pos[0]->posx) break;
+			if(flipped->pos[0]->netx < next->pos[0]->netx) break;
 		} else if (flipped->dir==2) {
-			if(flipped->pos[1]->posy < next->pos[1]->posy) break;
+			if(flipped->pos[1]->nety < next->pos[1]->nety) break;
 		} else if (flipped->dir==3) {
-			if(flipped->pos[0]->posx > next->pos[0]->posx) break;
+			if(flipped->pos[0]->netx > next->pos[0]->netx) break;
 		}
 		cur = next;
 		next = cur->nb[flipped->dir^2];
@@ -457,19 +853,27 @@ static Junction* Junction_flipone(Junction* jnc, RepairQueue* queue) {
 
 /*
 	returns True if self needs a flip with the junction
-	in direction d
+	in direction d.
+	The net is only sorted weakly: junctions with the same
+	coordinate are in order either way, and the walks compare
+	inclusively, so any order of a tie gives the same pairs.
+	Counting a tie as out of order from one side only would swap
+	the two junctions back and forth forever. Breaking ties by
+	Box.id instead would make the net independent of the order
+	of the moves, but the repair would have to sort every run of
+	equal coordinates, which doubles its work on grid-aligned
+	boxes (see the discrete scenario of tools/bench.c).
 */
 static int needsflip(Junction* jnc, unsigned char d) {
 	double nbpos;
 	double jncpos;
 	if( (d+1)%2 ) {
-		nbpos = jnc->nb[d]->pos[1]->posy;
-		jncpos = jnc->pos[1]->posy;
+		nbpos = jnc->nb[d]->pos[1]->nety;
+		jncpos = jnc->pos[1]->nety;
 	} else {
-		nbpos = jnc->nb[d]->pos[0]->posx;
-		jncpos = jnc->pos[0]->posx;
+		nbpos = jnc->nb[d]->pos[0]->netx;
+		jncpos = jnc->pos[0]->netx;
 	}
-	// needed for some reason to avoid wrong conclusions
 	if(nbpos==jncpos)
 		return 0;
 	return (nbpos<jncpos) != ((d+1)%4)/2;
@@ -485,11 +889,11 @@ static int needsflip_alt(Junction* jnc, unsigned char d) {
 	Junction* nb = jnc->nb[d];
 	assert(nb!=NULL);
 	if(d%2==0) {
-		if(nb->pos[1]->posy==jnc->pos[1]->posy) return 0;
-		return (nb->pos[1]->posy > jnc->pos[1]->posy) != (d/2==0);
+		if(nb->pos[1]->nety==jnc->pos[1]->nety) return 0;
+		return (nb->pos[1]->nety > jnc->pos[1]->nety) != (d/2==0);
 	} else {
-		if(nb->pos[0]->posx==jnc->pos[0]->posx) return 0;
-		return (nb->pos[0]->posx < jnc->pos[0]->posx) != (d/2==0);
+		if(nb->pos[0]->netx==jnc->pos[0]->netx) return 0;
+		return (nb->pos[0]->netx < jnc->pos[0]->netx) != (d/2==0);
 	}
 }
 #endif
@@ -515,6 +919,7 @@ static void reconnect_linear(Junction* start, Junction* next, unsigned char d) {
 static void Junction_slide(Junction* jnc, unsigned char tdir, RepairQueue* queue) {
 	assert(jnc->dir==4);
 	assert(needsflip(jnc,tdir));
+	STAT(queue->stats->slides++;)
 	Junction* bar = jnc->nb[tdir];
 	if(bar->dir==(tdir^2))
 		bar = Junction_flip(bar,queue);
@@ -573,6 +978,7 @@ static void Junction_slide_T(Junction* jnc, RepairQueue* queue) {
 	if(next->dir==jnc->dir || next->beamdir==(jnc->dir^2)) return;
 	if(jnc->beamdir!=next->beamdir)
 		next = Junction_flip(next,queue);
+	STAT(queue->stats->slides++;)
 	assert(jnc->beamdir==next->beamdir);
 	assert(jnc->dir==(next->dir^2));
 	reconnect_linear(jnc,next,jnc->beamdir);
@@ -583,39 +989,282 @@ static void Junction_slide_T(Junction* jnc, RepairQueue* queue) {
 		RepairQueue_append(next, jnc->beamdir, queue);
 }
 
-Box* Boxnet_addbox(Boxnet* net, double x, double y,
-							double right, double top,
-							Box* near, void* usrdata) {
-	Box* new = Box_new();
+/*
+	moves box to position i of net->boxes. A pending repair
+	treats it as if it had always been there: it is done with
+	right away if it jumped over the cursor, and isn't counted
+	twice if it jumped back behind it.
+*/
+static void box_move(Boxnet* net, Box* box, int i) {
+	int from = box->index;
+	net->boxes[i] = box;
+	box->index = i;
+	if(i < net->repair_cursor && from >= net->repair_cursor)
+		repair_seed(net, box);
+	else if(net->repair_syncing && from < net->repair_cursor && i >= net->repair_cursor)
+		net->repair_moved -= box->dirty!=0;
+}
+
+/*
+	links box into the net next to near, or close to its net
+	bounds if near is NULL, and appends it to the boxes or the
+	ghosts in net->boxes, which must have room for it.
+*/
+static void Box_insert(Boxnet* net, Box* box, Box* near) {
+	if(near!=NULL) {
+		Junction_insert(&box->jnc, &near->jnc);
+	} else if(linked(net)!=0) {
+		Junction_insert(&box->jnc, locate(net, box, box->netx, box->nety));
+	} else {
+		for(int d=0;d<4;d++)
+			box->jnc.nb[d] = NULL;
+	}
+	int i = linked(net);
+	if(box->ghost) {
+		net->ghosts_size++;
+	} else {
+		// the first ghost makes room
+		if(net->ghosts_size>0)
+			box_move(net, net->boxes[net->boxes_size], i);
+		i = net->boxes_size++;
+	}
+	box->index = i;
+	net->boxes[i] = box;
+	mark_dirty(net, box);
+}
+
+// a new box that isn't in the net yet; NULL if out of memory
+static Box* Box_make(Boxnet* net, double x, double y,
+							double right, double top, void* usrdata) {
+	Box* new = Box_new(net);
+	if(new==NULL)
+		return NULL;
 	new->usrdata = usrdata;
 	assert(right>=x && top>=y);
 	new->posx = x;		new->posy = y;
 	new->right = right;	new->top = top;
-	if(near==NULL && net->boxes_size!=0)
-		near = net->boxes[0];
-	if(near!=NULL) {
-		Junction_insert(&new->jnc, &near->jnc);
+	new->netx = x;		new->nety = y;
+	new->netright = right;	new->nettop = top;
+	new->margin = 0;
+	new->dirty = 0;
+	new->index = -1;
+	new->id = net->next_id++;
+	return new;
+}
+
+/*
+	puts a box made by Box_make() into the net or the giants.
+	Returns -1 if there isn't enough memory.
+*/
+static int Box_enter(Boxnet* net, Box* new, Box* near) {
+	if(is_giant(net, new)) {
+		if(giants_reserve(net)!=0)
+			return -1;
+		giant_add(net, new);
+		near = NULL;
 	} else {
-		for(int d=0;d<4;d++)
-			new->jnc.nb[d] = NULL;
+		if(linked(net)==net->boxes_size_max &&
+				Boxnet_reserve(net, linked(net)>0 ? 2*linked(net) : BOXES_SIZE_INIT)!=0)
+			return -1;
+		if(near!=NULL && near->jnc.dir==5)
+			near = NULL;	// a giant isn't in the net
+		Box_insert(net, new, near);
+	}
+	if(net->trace!=NULL)
+		trace_add(net, new, near);
+	return 0;
+}
+
+/*
+	adds a box to the net, linked in next to near. If near is
+	NULL, a place close to the box is looked for (see locate()),
+	so that the repair doesn't have to slide it far.
+	Returns NULL if there isn't enough memory.
+*/
+Box* Boxnet_addbox(Boxnet* net, double x, double y,
+							double right, double top,
+							Box* near, void* usrdata) {
+	Box* new = Box_make(net, x, y, right, top, usrdata);
+	if(new!=NULL && Box_enter(net, new, near)!=0) {
+		bn_free(net, new, sizeof *new);
+		return NULL;
 	}
-	vector_append(net->boxes, new, net->boxes_size,
-					net->boxes_size_max, BOXES_SIZE_INIT);
 	return new;
 }
 
 void Boxnet_delbox(Boxnet* net, Box* box) {
-	// TODO: this is stupid, going through the whole array
-	//       just to remove one element...
-	for(int n=0;n<net->boxes_size;n++) {
-		if(net->boxes[n]==box) {
-			Box_free(box);
-			net->boxes_size--;
-			net->boxes[n] = net->boxes[net->boxes_size];
-			return;
+	assert(!box->ghost);
+	if(net->trace!=NULL) {
+		uint32_t id = box->id;
+		trace_op(net->trace, BOXNET_TRACE_DEL);
+		trace_write(net->trace, &id, sizeof id);
+	}
+	if(net->pipeline!=NULL)
+		pipeline_drop(net, box);
+	if(net->sweep!=NULL)
+		sweep_drop(net, box);
+	if(net->ghosts_size>0)
+		ghosts_drop(net, box);
+	Box_remove(net, box);
+}
+
+/*
+	takes a box or a ghost out of the net, or a box out of the
+	giants, and frees it
+*/
+static void Box_remove(Boxnet* net, Box* box) {
+	int n = box->index;
+	assert(box->jnc.dir==5 ? n>=0 && n<net->giants_size && net->giants[n]==box :
+				n>=0 && n<linked(net) && net->boxes[n]==box);
+	if(box->jnc.dir==5) {
+		giant_remove(net, box);
+		bn_free(net, box, sizeof *box);
+		return;
+	}
+	// see mark_dirty()
+	if(box->dirty && net->repair_cursor>=0 && (n < net->repair_cursor) == net->repair_syncing)
+		net->repair_moved--;
+	int ghost = box->ghost;
+	Box_free(net, box);
+	if(ghost) {
+		net->ghosts_size--;
+		if(n!=linked(net))
+			box_move(net, net->boxes[linked(net)], n);
+		return;
+	}
+	net->boxes_size--;
+	if(n!=net->boxes_size)
+		box_move(net, net->boxes[net->boxes_size], n);
+	// the last ghost fills the gap
+	if(net->ghosts_size>0)
+		box_move(net, net->boxes[linked(net)], net->boxes_size);
+}
+
+/*
+	Deferred changes
+	================
+
+	Boxes can't be added or deleted while Boxnet_collide() walks the
+	net, so inside a collision callback, Boxnet_addbox_deferred() and
+	Boxnet_delbox_deferred() only queue the change in net->deferred;
+	the queue is worked off in call order as soon as the collision
+	search is done, and the changed region is repaired along with
+	everything else by the next repair. Outside of a collision
+	search, both take effect immediately.
+	Room for the queued boxes is made in net->boxes and net->giants
+	when they are queued, so that working off the queue can't run
+	out of memory; net->deferred_adds counts them.
+*/
+
+typedef struct Deferred {
+	Box*				box;
+	Box*				near;		// for an added box
+	int					add;
+} Deferred;
+
+// returns -1 if there isn't enough memory
+static int defer(Boxnet* net, Box* box, Box* near, int add) {
+	if(net->deferred_size==net->deferred_size_max) {
+		int grown = net->deferred_size_max>0 ? 2*net->deferred_size_max : 16;
+		Deferred* deferred = bn_realloc(net, net->deferred,
+							net->deferred_size_max * sizeof *deferred, grown * sizeof *deferred);
+		if(deferred==NULL)
+			return -1;
+		net->deferred = deferred;
+		net->deferred_size_max = grown;
+	}
+	Deferred deferred = {box, near, add};
+	net->deferred[net->deferred_size++] = deferred;
+	return 0;
+}
+
+/*
+	makes room for one more queued box in net->boxes and, since
+	it isn't known yet where it goes, in net->giants.
+	Returns -1 if there isn't enough memory.
+*/
+static int deferred_reserve(Boxnet* net) {
+	int n = net->deferred_adds + 1;
+	if(linked(net) + n > net->boxes_size_max) {
+		int grown = 2*net->boxes_size_max;
+		if(Boxnet_reserve(net, grown > linked(net) + n ? grown : linked(net) + n)!=0)
+			return -1;
+	}
+	if(net->giants_size + n > net->giants_size_max) {
+		int grown = net->giants_size_max>0 ? 2*net->giants_size_max : 16;
+		Box** giants = bn_realloc(net, net->giants, net->giants_size_max * sizeof *giants,
+									grown * sizeof *giants);
+		if(giants==NULL)
+			return -1;
+		net->giants = giants;
+		net->giants_size_max = grown;
+	}
+	return 0;
+}
+
+static void deferred_free(Boxnet* net) {
+	bn_free(net, net->deferred, net->deferred_size_max * sizeof *net->deferred);
+}
+
+// applies the changes queued during the last collision search
+static void deferred_apply(Boxnet* net) {
+	for(int i=0;i<net->deferred_size;i++) {
+		Deferred* d = &net->deferred[i];
+		if(!d->add) {
+			Boxnet_delbox(net, d->box);
+		} else {
+			// can't fail, deferred_reserve() made room
+			Box_enter(net, d->box, d->near);
 		}
 	}
-	assert(0);
+	net->deferred_size = 0;
+	net->deferred_adds = 0;
+}
+
+/*
+	like Boxnet_addbox(), but may be called from a collision
+	callback. The box is in the net only after the collision
+	search; until then, it takes part in no pairs. near must not
+	be a box that is deleted in the same collision search.
+	Returns NULL if there isn't enough memory.
+*/
+Box* Boxnet_addbox_deferred(Boxnet* net, double x, double y,
+							double right, double top,
+							Box* near, void* usrdata) {
+	if(!net->colliding)
+		return Boxnet_addbox(net, x, y, right, top, near, usrdata);
+	if(deferred_reserve(net)!=0)
+		return NULL;
+	Box* new = Box_make(net, x, y, right, top, usrdata);
+	if(new==NULL)
+		return NULL;
+	if(defer(net, new, near, 1)!=0) {
+		bn_free(net, new, sizeof *new);
+		return NULL;
+	}
+	net->deferred_adds++;
+	return new;
+}
+
+/*
+	like Boxnet_delbox(), but may be called from a collision
+	callback, also for the boxes of the pair being reported.
+	The pairs of the box that are still to be reported aren't;
+	deleting it again before the search is over does nothing.
+	Returns -1 if there isn't enough memory to queue the deletion;
+	the box then stays in the net.
+*/
+int Boxnet_delbox_deferred(Boxnet* net, Box* box) {
+	if(!net->colliding) {
+		Boxnet_delbox(net, box);
+		return 0;
+	}
+	if(box->deleted)
+		return 0;
+	if(defer(net, box, NULL, 0)!=0)
+		return -1;
+	box->deleted = 1;
+	return 0;
 }
 
 // CAUTION: only removes the FIRST element that matches usrdata...
@@ -624,9 +1273,13 @@ void Boxnet_delbox_byusrdata(Boxnet* net, void* usrdata) {
 	//       just to remove one element...
 	for(int n=0;n<net->boxes_size;n++) {
 		if(net->boxes[n]->usrdata==usrdata) {
-			Box_free(net->boxes[n]);
-			net->boxes_size--;
-			net->boxes[n] = net->boxes[net->boxes_size];
+			Boxnet_delbox(net, net->boxes[n]);
+			return;
+		}
+	}
+	for(int n=0;n<net->giants_size;n++) {
+		if(net->giants[n]->usrdata==usrdata) {
+			Boxnet_delbox(net, net->giants[n]);
 			return;
 		}
 	}
@@ -638,11 +1291,229 @@ static double bnabs(double a) {
 }
 
 /*
-	TODO: This function could also try to optimize the
-	memory layout...
+	finds a junction near (x,y) in net coordinates, for inserting
+	a box there ("jump and walk"): starts at the closest of about
+	n^(1/3) boxes sampled from the net, then walks along the rays
+	as long as that gets closer (in the manhattan metric). The
+	result isn't necessarily the closest junction, but the repair
+	after inserting the box there only has a short way to go.
+	It only moves while the distance shrinks, so junctions with
+	the same coordinates can't make it circle.
+	except is left out, since it is about to be moved.
+*/
+static Junction* locate(Boxnet* net, Box* except, double x, double y) {
+	double distance(Junction* jnc) {
+		return bnabs(jnc->pos[0]->netx - x) + bnabs(jnc->pos[1]->nety - y);
+	}
+	int n = net->boxes_size;
+	int samples = 1;
+	while(samples*samples*samples < n)
+		samples++;
+	Junction* cur = NULL;
+	double dist = 0;
+	for(int k=0;k<samples;k++) {
+		Box* box = net->boxes[(int)((long)k*n/samples)];
+		if(box==except)
+			continue;
+		double d = distance(&box->jnc);
+		if(cur==NULL || d<dist) {
+			cur = &box->jnc;
+			dist = d;
+		}
+	}
+	if(cur==NULL)
+		cur = &net->boxes[except->index>0 ? 0 : 1]->jnc;
+	while(1) {
+		Junction* best = NULL;
+		for(unsigned char d=0;d<4;d++) {
+			// a T-junction has no neighbor opposite its terminated ray
+			Junction* nb = (d^2)==cur->dir ? NULL : cur->nb[d];
+			if(nb!=NULL && distance(nb)<dist) {
+				best = nb;
+				dist = distance(nb);
+			}
+		}
+		if(best==NULL)
+			return cur;
+		cur = best;
+	}
+}
+
+/*
+	sets new bounds for box. Small moves are left to the repair,
+	just like when the bounds are written directly. If the new net
+	bounds don't overlap the old ones, though, the box is taken out
+	of the net and inserted again at its destination, since sliding
+	it there would take time proportional to the distance. A box
+	that crosses the giant size (see Boxnet_setgiantsize()) moves
+	between the net and the giants right away, unless a repair is
+	pending; the next repair does it then. Must not be called from
+	a collision callback, use Boxnet_delbox_deferred() and
+	Boxnet_addbox_deferred() there.
+*/
+void Boxnet_movebox(Boxnet* net, Box* box, double x, double y,
+							double right, double top) {
+	assert(right>=x && top>=y);
+	assert(!net->colliding);
+	box->posx = x;		box->posy = y;
+	box->right = right;	box->top = top;
+	if(net->trace!=NULL) {
+		uint32_t id = box->id;
+		trace_op(net->trace, BOXNET_TRACE_MOVEBOX);
+		trace_write(net->trace, &id, sizeof id);
+		trace_bounds(net->trace, box);
+	}
+	if(net->repair_cursor<0 && is_giant(net, box) != (box->jnc.dir==5) &&
+			(box->jnc.dir==5 ? giant_leave(net, box) : giant_enter(net, box))==0)
+		return;
+	if(box->jnc.dir==5)
+		return;		// a giant; see Boxnet_setgiantsize()
+	double m = box->margin;
+	if(net->boxes_size<2 || (x-m <= box->netright && right+m >= box->netx &&
+							y-m <= box->nettop && top+m >= box->nety))
+		return;
+	Box_detach(box, net->repair_cursor>=0 ? net->repair_queue[0] : NULL);
+	box->netx = x-m;		box->nety = y-m;
+	box->netright = right+m;	box->nettop = top+m;
+	Junction_insert(&box->jnc, locate(net, box, box->netx, box->nety));
+	mark_dirty(net, box);
+	STAT(net->stats.relocated++;)
+}
+
+/*
+	makes room for at least n boxes, so that adding them doesn't
+	have to grow net->boxes. Returns 0 on success, -1 if there
+	isn't enough memory (the net is unchanged then).
+*/
+int Boxnet_reserve(Boxnet* net, int n) {
+	if(n <= net->boxes_size_max)
+		return 0;
+	Box** boxes = bn_realloc(net, net->boxes, net->boxes_size_max * sizeof *boxes,
+							n * sizeof *boxes);
+	if(boxes==NULL)
+		return -1;
+	net->boxes = boxes;
+	net->boxes_size_max = n;
+	return 0;
+}
+
+/*
+	reports how much memory the net holds, see Boxnet_memory.
+	Only counts the requested sizes, not the overhead of the
+	allocator.
+*/
+void Boxnet_memory_usage(Boxnet* net, Boxnet_memory* report) {
+	size_t n = net->boxes_size + net->giants_size;
+	size_t slack = 0;
+	report->junctions = n * 5 * sizeof(Junction);
+	report->boxes = n * (sizeof(Box) - 5*sizeof(Junction)) +
+					net->boxes_size_max * sizeof *net->boxes +
+					net->giants_size_max * sizeof *net->giants;
+	slack += (net->boxes_size_max - linked(net)) * sizeof *net->boxes +
+			(net->giants_size_max - net->giants_size) * sizeof *net->giants;
+	report->ghosts = net->ghosts_size * sizeof(Box);
+	report->queues = 0;
+	for(int slot=0;slot<BOXNET_WALKS;slot++) {
+		report->queues += net->bc_queue_size_max[slot] * sizeof *net->bc_queue[slot];
+		slack += net->bc_queue_size_max[slot] * sizeof *net->bc_queue[slot];
+	}
+	for(int i=0;i<2;i++) {
+		RepairQueue* q = net->repair_queue[i];
+		report->queues += sizeof *q + q->size_max * sizeof *q->queue;
+		slack += (q->size_max - q->size) * sizeof *q->queue;
+	}
+	report->deferred = net->deferred_size_max * sizeof *net->deferred;
+	slack += (net->deferred_size_max - net->deferred_size) * sizeof *net->deferred;
+	report->pipeline = pipeline_memory(net, &slack);
+	report->sweep = sweep_memory(net, &slack);
+	report->threads = pool_memory(net);
+	report->trace = 0;
+	if(net->trace!=NULL)
+		report->trace = sizeof *net->trace +
+						4*net->trace->bounds_size_max * sizeof *net->trace->bounds;
+	report->published = published_memory(net);
+	report->slack = slack;
+	report->total = sizeof *net + report->boxes + report->junctions + report->ghosts +
+					report->queues + report->deferred + report->pipeline + report->sweep +
+					report->threads + report->trace + report->published;
+}
+
+/*
+	trims the array v of *size_max elements of elem_size bytes to
+	size elements, or frees it if size is 0. Returns the array to
+	keep using, the old one if it can't be trimmed.
+*/
+static void* trim(Boxnet* net, void* v, int* size_max, int size, size_t elem_size) {
+	if(size >= *size_max)
+		return v;
+	if(size==0) {
+		bn_free(net, v, *size_max * elem_size);
+		*size_max = 0;
+		return NULL;
+	}
+	void* trimmed = bn_realloc(net, v, *size_max * elem_size, size * elem_size);
+	if(trimmed==NULL)
+		return v;
+	*size_max = size;
+	return trimmed;
+}
+
+/*
+	gives back the memory that the net only holds because it
+	once was larger or had more work to do: the unused parts of
+	net->boxes and the giants and the buffers of the
+	deferred changes, the pipeline and the sweeps, and the repair
+	and collision queues. They grow again when needed. The boxes
+	themselves can't be moved, since the pointers returned by
+	Boxnet_addbox() have to stay valid.
+*/
+void Boxnet_shrink(Boxnet* net) {
+	int n = linked(net) > BOXES_SIZE_INIT ? linked(net) : BOXES_SIZE_INIT;
+	net->boxes = trim(net, net->boxes, &net->boxes_size_max, n, sizeof *net->boxes);
+	net->giants = trim(net, net->giants, &net->giants_size_max, net->giants_size,
+						sizeof *net->giants);
+	net->deferred = trim(net, net->deferred, &net->deferred_size_max, net->deferred_size,
+						sizeof *net->deferred);
+	if(net->pipeline!=NULL)
+		pipeline_shrink(net);
+	if(net->sweep!=NULL)
+		sweep_shrink(net);
+	for(int i=0;i<2;i++) {
+		RepairQueue* q = net->repair_queue[i];
+		if(q->size>0)
+			continue;	// a pending repair still needs it
+		bn_free(net, q->queue, q->size_max * sizeof *q->queue);
+		q->queue = NULL;
+		q->size = 0;
+		q->size_max = 0;
+	}
+	for(int slot=0;slot<BOXNET_WALKS;slot++) {
+		bn_free(net, net->bc_queue[slot], net->bc_queue_size_max[slot] * sizeof *net->bc_queue[slot]);
+		net->bc_queue[slot] = NULL;
+		net->bc_queue_size_max[slot] = 0;
+	}
+}
+
+static void swap_boxes(Boxnet* net, int a, int b) {
+	Box* tmp = net->boxes[a];
+	net->boxes[a] = net->boxes[b];
+	net->boxes[b] = tmp;
+	net->boxes[a]->index = a;
+	net->boxes[b]->index = b;
+}
+
+/*
+	flips the rays ending at the box at the optimization cursor
+	if their T-junction lies farther along the other axis, then
+	advances the cursor.
+	It also improves the memory layout a bit: the box right of
+	the current one in the net is moved directly behind it in
+	net->boxes, so the main loops of repair and collide tend to
+	visit net neighbors one after the other.
+	The net has to be repaired.
 */
-static void Boxnet_optimize(Boxnet* net) {
-	static int n=0;
+static void optimize_one(Boxnet* net) {
+	int n = net->optimize_cursor;
 	if(n>=net->boxes_size) n=0;
 	
 	Box* box = net->boxes[n];
@@ -651,17 +1522,67 @@ static void Boxnet_optimize(Boxnet* net) {
 		assert(jnc->dir!=4);
 		if(jnc->dir!=5) {
 			if(jnc->dir%2==0) {
-				if(bnabs( jnc->pos[1]->posx - box->posx ) >
-					bnabs( jnc->pos[1]->posy - box->posy ))
+				if(bnabs( jnc->pos[1]->netx - box->netx ) >
+					bnabs( jnc->pos[1]->nety - box->nety ))
 					Junction_flip(jnc,NULL);
 			} else {
-				if(bnabs( jnc->pos[0]->posy - box->posy ) >
-					bnabs( jnc->pos[0]->posx - box->posx ))
+				if(bnabs( jnc->pos[0]->nety - box->nety ) >
+					bnabs( jnc->pos[0]->netx - box->netx ))
 					Junction_flip(jnc,NULL);
 			}
 		}
 	}
-	n++;
+	Junction* right = box->jnc.nb[3];
+	if(right!=NULL && n+1<net->boxes_size) {
+		// junctions on the lower ray get their y from box;
+		// ghosts stay behind the boxes
+		Box* nb = right->pos[0];
+		if(nb->index > n+1 && !nb->ghost)
+			swap_boxes(net, n+1, nb->index);
+	}
+	net->optimize_cursor = n+1;
+}
+
+/*
+	runs the optimization pass for at most max_boxes boxes and
+	roughly max_microseconds (<=0 means no limit for either one),
+	continuing where the last call stopped. Only call this on a
+	repaired net, i.e. after Boxnet_repair() or Boxnet_collide();
+	a repair left pending by Boxnet_repairsome() is finished first.
+*/
+void Boxnet_optimize(Boxnet* net, int max_boxes, double max_microseconds) {
+	if(net->boxes_size==0)
+		return;
+	if(max_boxes<=0 || max_boxes>net->boxes_size)
+		max_boxes = net->boxes_size;
+	Trace* trace = trace_begin(net);
+	repair_finish(net);
+	double deadline = max_microseconds > 0 ? bn_time() + 1e-6*max_microseconds : 0;
+	int32_t i = 0;
+	while(i<max_boxes) {
+		optimize_one(net);
+		i++;
+		// don't ask the clock for every single box
+		if(deadline>0 && (i&7)==0 && bn_time()>deadline)
+			break;
+	}
+	// the trace gets the number of boxes actually done, so
+	// that a replay doesn't depend on the clock
+	double no_deadline = 0;
+	trace_end(net, trace, BOXNET_TRACE_OPTIMIZE, &i, sizeof i,
+				&no_deadline, sizeof no_deadline);
+}
+
+/*
+	makes Boxnet_collide() run Boxnet_optimize() with the given
+	budget after every repair. Set both to 0 to switch it off.
+*/
+void Boxnet_setoptimizebudget(Boxnet* net, int max_boxes, double max_microseconds) {
+	net->optimize_boxes = max_boxes;
+	net->optimize_microseconds = max_microseconds;
+	int32_t boxes = max_boxes;
+	trace_end(net, trace_begin(net), BOXNET_TRACE_OPTIMIZEBUDGET, &boxes, sizeof boxes,
+				&max_microseconds, sizeof max_microseconds);
 }
 
 /*
@@ -671,63 +1592,1374 @@ static void Boxnet_optimize(Boxnet* net) {
 	Gets called by collide(), so the user should never
 	need to call this for normal usage...
 */
-void Boxnet_repair(Boxnet* net) {
-	static RepairQueue	queue1 = {NULL,0,0};
-	static RepairQueue	queue2 = {NULL,0,0};
-	// queue can not get longer than 4*(number of boxes)
-	if(queue1.queue==NULL) {
-		queue1 = RepairQueue_new();
-		queue2 = RepairQueue_new();
-	}
-	void solve_conn(Junction* jnc, unsigned char tdir, RepairQueue* q) {
-		assert(jnc->enqueued!=0);
-		jnc->enqueued ^= (1<<tdir);
-		assert((jnc->enqueued & (1<<tdir))==0);
-		if(jnc->dir==5) return;
-		Junction* next = jnc->nb[tdir];
-		if(next==NULL) return;
-		if(!needsflip(jnc,tdir)) return;
-		if(jnc->dir==4) {
-			Junction_slide(jnc,tdir,q);
-		} else {
-			if(jnc->beamdir!=tdir) return;
-			Junction_slide_T(jnc,q);
-		}
-	}
-	queue1.size=0;
-	queue2.size=0;
-	//int max_queue_size = 0;
-	for(int i=0;i<net->boxes_size;i++) {
-		for(unsigned char tdir=0;tdir<4;tdir++) {
-			RepairQueue_append(&net->boxes[i]->jnc,tdir, &queue1);
-			Junction* jnc = &net->boxes[i]->rayend[tdir];
-			if(jnc->dir!=5)
-				RepairQueue_append(jnc,jnc->beamdir, &queue1);
-		}
-		while(queue1.size>0) {
-			while(queue1.size>0) {
-				//if(queue1.size>max_queue_size)
-				//	max_queue_size=queue1.size;
-				queue1.size--;
-				solve_conn(queue1.queue[queue1.size].jnc, queue1.queue[queue1.size].tdir, &queue2);
-			}
-			while(queue2.size>0) {
-				//if(queue2.size>max_queue_size)
-				//	max_queue_size=queue2.size;
-				queue2.size--;
-				solve_conn(queue2.queue[queue2.size].jnc, queue2.queue[queue2.size].tdir, &queue1);
-			}
-		}
+static void solve_conn(Junction* jnc, unsigned char tdir, RepairQueue* q) {
+	STAT(q->stats->solve_conn++;)
+	assert(jnc->enqueued!=0);
+	jnc->enqueued ^= (1<<tdir);
+	assert((jnc->enqueued & (1<<tdir))==0);
+	if(jnc->dir==5) return;
+	Junction* next = jnc->nb[tdir];
+	if(next==NULL) return;
+	if(!needsflip(jnc,tdir)) return;
+	if(jnc->dir==4) {
+		Junction_slide(jnc,tdir,q);
+	} else {
+		if(jnc->beamdir!=tdir) return;
+		Junction_slide_T(jnc,q);
 	}
-	//printf("max queue size: %i\n",max_queue_size);
-	//Boxnet_optimize(net);
 }
 
 /*
-	finds collisions for this bounding box; this does
-	not find all collisions of box, in the sense that each collision
-	pair is reported only by one of the two involved physpoints.
-	The collision net needs to be valid.
+	the amount of repair work a call may do: max_steps steps
+	(syncing a box or solving a connection) and until deadline;
+	0 means no limit for either one.
+*/
+typedef struct RepairBudget {
+	long	steps;		// done so far
+	long	max_steps;
+	double	deadline;
+} RepairBudget;
+
+/*
+	counts one step against budget; returns 0 if it is used up.
+*/
+static int budget_step(RepairBudget* budget) {
+	if(budget->max_steps>0 && budget->steps>=budget->max_steps)
+		return 0;
+	// don't ask the clock for every single step
+	if(budget->deadline>0 && budget->steps>0 && (budget->steps&63)==0 &&
+			bn_time()>budget->deadline)
+		return 0;
+	budget->steps++;
+	return 1;
+}
+
+/*
+	solves connections until both repair queues are empty.
+	Every solved connection may enqueue new ones in the
+	other queue. Returns 0 if the budget ran out first.
+*/
+static int repair_drain(Boxnet* net, RepairBudget* budget) {
+	RepairQueue* queue1 = net->repair_queue[0];
+	RepairQueue* queue2 = net->repair_queue[1];
+	// this is the inner loop of every repair; skip the counting if
+	// there is no budget
+	int limited = budget->max_steps>0 || budget->deadline>0;
+	while(queue1->size>0 || queue2->size>0) {
+		while(queue1->size>0) {
+			if(limited && !budget_step(budget))
+				return 0;
+			STAT(if(queue1->size>net->stats.repair_queue_peak)
+				net->stats.repair_queue_peak=queue1->size;)
+			queue1->size--;
+			solve_conn(queue1->queue[queue1->size].jnc, queue1->queue[queue1->size].tdir, queue2);
+		}
+		while(queue2->size>0) {
+			if(limited && !budget_step(budget))
+				return 0;
+			STAT(if(queue2->size>net->stats.repair_queue_peak)
+				net->stats.repair_queue_peak=queue2->size;)
+			queue2->size--;
+			solve_conn(queue2->queue[queue2->size].jnc, queue2->queue[queue2->size].tdir, queue1);
+		}
+	}
+	return 1;
+}
+
+/*
+	enqueues all connections of jnc, from both sides.
+*/
+static void seed_junction(Junction* jnc, RepairQueue* q) {
+	for(unsigned char d=0;d<4;d++) {
+		if(jnc->nb[d]==NULL || (jnc->dir<4 && d==(jnc->dir^2)))
+			continue;
+		RepairQueue_append(jnc, d, q);
+		RepairQueue_append(jnc->nb[d], d^2, q);
+	}
+}
+
+/*
+	enqueues every connection whose spatial relation depends on
+	the position of box: those of its own junction and of all
+	junctions on its four rays. Draining the queues afterwards
+	repairs the net, if box was the only one that moved (or was
+	just inserted).
+*/
+static void seed_box(Box* box, RepairQueue* q) {
+	seed_junction(&box->jnc, q);
+	for(unsigned char d=0;d<4;d++) {
+		for(Junction* jnc = box->jnc.nb[d]; jnc!=NULL; jnc = jnc->nb[d]) {
+			seed_junction(jnc, q);
+			if(jnc->dir==(d^2))
+				break;
+		}
+	}
+}
+
+/*
+	brings the net bounds of box up to date. They have to contain
+	the bounds and must not be more than two margins larger on any
+	side; otherwise they are set to the bounds grown by the margin.
+	Returns 1 if they changed.
+*/
+static int sync_box(Box* box) {
+	double m2 = 2*box->margin;
+	double d[4] = {box->posx - box->netx, box->posy - box->nety,
+					box->netright - box->right, box->nettop - box->top};
+	if(d[0]>=0 && d[0]<=m2 && d[1]>=0 && d[1]<=m2 &&
+			d[2]>=0 && d[2]<=m2 && d[3]>=0 && d[3]<=m2)
+		return 0;
+	box->netx = box->posx - box->margin;
+	box->nety = box->posy - box->margin;
+	box->netright = box->right + box->margin;
+	box->nettop = box->top + box->margin;
+	return 1;
+}
+
+/*
+	sets the margin of box: the net is built on its bounds grown by
+	margin, and only has to be repaired when the bounds move out of
+	these, or shrink by more than two margins. The collision pairs
+	are still those of the exact bounds.
+	Boxes that jitter by small amounts should get a margin slightly
+	larger than their usual motion per frame.
+*/
+void Boxnet_setmargin(Boxnet* net, Box* box, double margin) {
+	assert(margin>=0);
+	box->margin = margin;
+	if(net->trace!=NULL) {
+		uint32_t id = box->id;
+		trace_op(net->trace, BOXNET_TRACE_MARGIN);
+		trace_write(net->trace, &id, sizeof id);
+		trace_write(net->trace, &margin, sizeof margin);
+	}
+}
+
+/*
+	Giants
+	======
+
+	Boxes wider or higher than net->giant_size are kept out of
+	the net, in net->giants: their rays would cross the cells of
+	many other boxes and have to be flipped whenever one of them
+	moves, and their collision walks would be long. Instead, the
+	boxes of the net are tested against all giants in one pass
+	over net->boxes, which costs little as long as there are only
+	a few of them. A giant's own junction has dir=5, and box->index
+	is its position in net->giants. Boxes are sorted in or out
+	whenever a repair starts.
+*/
+
+static int is_giant(Boxnet* net, Box* box) {
+	// a giant couldn't have ghosts, see Boxnet_setperiodic()
+	return net->giant_size>0 && net->period_width==0 &&
+			(box->right - box->posx > net->giant_size ||
+									box->top - box->posy > net->giant_size);
+}
+
+// makes room for one more giant; -1 if there isn't enough memory
+static int giants_reserve(Boxnet* net) {
+	if(net->giants_size<net->giants_size_max)
+		return 0;
+	int grown = net->giants_size_max>0 ? 2*net->giants_size_max : 16;
+	Box** giants = bn_realloc(net, net->giants, net->giants_size_max * sizeof *giants,
+								grown * sizeof *giants);
+	if(giants==NULL)
+		return -1;
+	net->giants = giants;
+	net->giants_size_max = grown;
+	return 0;
+}
+
+// adds a box that isn't in the net to the giants, after giants_reserve()
+static void giant_add(Boxnet* net, Box* box) {
+	box->jnc.dir = 5;
+	box->dirty = 0;
+	box->index = net->giants_size;
+	net->giants[net->giants_size++] = box;
+}
+
+static void giant_remove(Boxnet* net, Box* box) {
+	int n = box->index;
+	assert(n>=0 && n<net->giants_size && net->giants[n]==box);
+	net->giants[n] = net->giants[--net->giants_size];
+	net->giants[n]->index = n;
+}
+
+/*
+	moves a giant that got small enough back into the net, and a
+	box of the net that got too large out of it. No repair may be
+	pending. Returns -1 if there isn't enough memory; the box
+	stays where it is then.
+*/
+static int giant_leave(Boxnet* net, Box* box) {
+	assert(net->repair_cursor<0);
+	if(linked(net)==net->boxes_size_max &&
+			Boxnet_reserve(net, 2*net->boxes_size_max)!=0)
+		return -1;
+	giant_remove(net, box);
+	box->jnc.dir = 4;
+	box->netx = box->posx - box->margin;
+	box->nety = box->posy - box->margin;
+	box->netright = box->right + box->margin;
+	box->nettop = box->top + box->margin;
+	Box_insert(net, box, NULL);
+	return 0;
+}
+
+static int giant_enter(Boxnet* net, Box* box) {
+	assert(net->repair_cursor<0 && net->ghosts_size==0);
+	if(giants_reserve(net)!=0)
+		return -1;
+	// like Boxnet_delbox(), but the box lives on
+	int i = box->index;
+	Box_detach(box, NULL);
+	net->boxes[i] = net->boxes[--net->boxes_size];
+	net->boxes[i]->index = i;
+	giant_add(net, box);
+	return 0;
+}
+
+/*
+	moves the giants that got small enough back into the net,
+	and the boxes that got too large out of it. No repair may be
+	pending. Boxes stay where they are if there isn't enough
+	memory to move them.
+*/
+static void sort_giants(Boxnet* net) {
+	for(int i=0;i<net->giants_size;) {
+		Box* box = net->giants[i];
+		if(is_giant(net, box) || giant_leave(net, box)!=0)
+			i++;
+	}
+	if(net->giant_size<=0)
+		return;
+	for(int i=0;i<net->boxes_size;) {
+		Box* box = net->boxes[i];
+		if(!is_giant(net, box) || giant_enter(net, box)!=0)
+			i++;
+	}
+}
+
+/*
+	reports the pairs of giants with each other and with the
+	boxes of the net.
+*/
+static void giant_collisions(Boxnet* net, boxCallback func, void* data) {
+	int n = net->giants_size;
+	if(n==0)
+		return;
+	// not kept in a local: Boxnet_addbox_deferred() in a callback
+	// may move the array, see deferred_reserve()
+	int overlap(Box* a, Box* b) {
+		return a->posx <= b->right && a->right >= b->posx &&
+				a->posy <= b->top && a->top >= b->posy;
+	}
+	// only boxes in the bounding box of all giants are tested
+	double left = net->giants[0]->posx, bottom = net->giants[0]->posy;
+	double right = net->giants[0]->right, top = net->giants[0]->top;
+	for(int k=0;k<n;k++) {
+		Box* giant = net->giants[k];
+		left = giant->posx < left ? giant->posx : left;
+		bottom = giant->posy < bottom ? giant->posy : bottom;
+		right = giant->right > right ? giant->right : right;
+		top = giant->top > top ? giant->top : top;
+		for(int j=k+1;j<n;j++)
+			if(overlap(giant, net->giants[j])) {
+				STAT(net->stats.pairs++;)
+				func(giant, net->giants[j], data);
+			}
+	}
+	for(int i=0;i<net->boxes_size;i++) {
+		Box* box = net->boxes[i];
+		if(box->posx > right || box->right < left || box->posy > top || box->top < bottom)
+			continue;
+		STAT(net->stats.candidates += n;)
+		for(int k=0;k<n;k++)
+			if(overlap(net->giants[k], box)) {
+				STAT(net->stats.pairs++;)
+				func(net->giants[k], box, data);
+			}
+	}
+}
+
+/*
+	lets boxes wider or higher than size be kept out of the net
+	(see above); 0, the default, keeps all boxes in the net. The
+	boxes are sorted in or out by the next repair. Only worth it
+	if few boxes are that large. The giants are not in
+	net->boxes, but in net->giants.
+*/
+void Boxnet_setgiantsize(Boxnet* net, double size) {
+	net->giant_size = size>0 ? size : 0;
+	trace_end(net, trace_begin(net), BOXNET_TRACE_GIANTSIZE,
+				&net->giant_size, sizeof net->giant_size, NULL, 0);
+}
+
+/*
+	Periodic worlds
+	===============
+
+	A periodic world isn't built with links across the seams;
+	the net stays planar, and the library links ghosts into it
+	instead: copies of boxes, shifted by whole periods. They are
+	kept in net->boxes behind the boxes (from boxes_size on), so
+	the repair and the walks see them but the user doesn't, and
+	they don't take ids. The bounds of the boxes are left alone.
+	The home of a box is its image whose lower left corner lies
+	in the domain given to Boxnet_setperiodic(). If the home
+	sticks out over the right or the upper edge, the images
+	shifted back from it by one period over each edge (and over
+	both, in the corner) are needed as well, so the walks find
+	its pairs across the seam. The box itself stands for one of
+	these images if it is there; each of the others is a ghost.
+	A ghost's usrdata points to its box, and Box.ghost is GHOST
+	plus the number of the image: bit 0 for one width back from
+	the home, bit 1 for one height.
+	Of all the images of a pair, only the one whose overlap region
+	starts (has its lower left corner) in the domain is reported;
+	as boxes are smaller than the domain, exactly one such image
+	is in the net. Boxes that are together wider or higher than
+	the domain can still overlap in two places, see
+	periodic_pair().
+*/
+
+#define GHOST 4
+
+/*
+	puts the home of box into home and returns the images of box
+	the net needs, bit k for image number k (see above); the home
+	itself is number 0. *mx and *my are the widths and heights the
+	home is away from the box.
+*/
+static int images(Boxnet* net, Box* box, double* home, double* mx, double* my) {
+	double x = net->period_x, y = net->period_y;
+	double width = net->period_width, height = net->period_height;
+	assert(box->right - box->posx < width && box->top - box->posy < height);
+	*mx = box->posx < x || box->posx >= x+width ? -floor((box->posx - x) / width) : 0;
+	*my = box->posy < y || box->posy >= y+height ? -floor((box->posy - y) / height) : 0;
+	home[0] = box->posx + *mx * width;	home[1] = box->posy + *my * height;
+	home[2] = box->right + *mx * width;	home[3] = box->top + *my * height;
+	int seams = (home[2] >= x+width) | (home[3] >= y+height) << 1;
+	return 1 | (seams&1) << 1 | (seams&2) << 1 | (seams==3) << 3;
+}
+
+// which image of its box b is, or -1 if it isn't one the net needs
+static int image_of(Boxnet* net, Box* b) {
+	if(b->ghost)
+		return b->ghost & 3;
+	double home[4], mx, my;
+	int need = images(net, b, home, &mx, &my);
+	if(!(mx==0 || mx==1) || !(my==0 || my==1))
+		return -1;
+	int k = (int)mx | (int)my << 1;
+	return need & 1<<k ? k : -1;
+}
+
+// gives a ghost the bounds of its image, from the home of its box
+static void ghost_sync(Boxnet* net, Box* ghost, const double* home) {
+	double dx = ghost->ghost&1 ? net->period_width : 0;
+	double dy = ghost->ghost&2 ? net->period_height : 0;
+	ghost->posx = home[0] - dx;	ghost->posy = home[1] - dy;
+	ghost->right = home[2] - dx;	ghost->top = home[3] - dy;
+	ghost->margin = ((Box*)ghost->usrdata)->margin;
+}
+
+// a new ghost for image k of box; NULL if out of memory
+static Box* ghost_make(Boxnet* net, Box* box, int k, const double* home) {
+	Box* ghost = Box_new(net);
+	if(ghost==NULL)
+		return NULL;
+	ghost->usrdata = box;
+	ghost->ghost = GHOST | k;
+	ghost_sync(net, ghost, home);
+	ghost->netx = ghost->posx - ghost->margin;
+	ghost->nety = ghost->posy - ghost->margin;
+	ghost->netright = ghost->right + ghost->margin;
+	ghost->nettop = ghost->top + ghost->margin;
+	ghost->dirty = 0;
+	ghost->index = -1;
+	ghost->id = box->id;
+	return ghost;
+}
+
+// removes the ghosts of a box that is deleted
+static void ghosts_drop(Boxnet* net, Box* owner) {
+	for(int i=net->boxes_size;i<linked(net);)
+		if(net->boxes[i]->usrdata==owner)
+			Box_remove(net, net->boxes[i]);	// the last one moves to i
+		else
+			i++;
+}
+
+static void ghosts_clear(Boxnet* net) {
+	while(net->ghosts_size>0)
+		Box_remove(net, net->boxes[linked(net)-1]);
+}
+
+/*
+	brings the ghosts up to date with their boxes, makes the ones
+	that are missing and removes those that aren't needed any
+	more; run when a repair starts.
+*/
+static void periodic_sync(Boxnet* net) {
+	double home[4], mx, my;
+	for(int i=0;i<net->boxes_size;i++) {
+		Box* box = net->boxes[i];
+		int k = image_of(net, box);
+		box->marked = k>=0 ? 1<<k : 0;	// the images it has
+	}
+	for(int i=net->boxes_size;i<linked(net);) {
+		Box* ghost = net->boxes[i];
+		Box* box = ghost->usrdata;
+		int k = 1 << (ghost->ghost&3);
+		if(images(net, box, home, &mx, &my) & k & ~box->marked) {
+			box->marked |= k;
+			ghost_sync(net, ghost, home);
+			i++;
+		} else {
+			Box_remove(net, ghost);
+		}
+	}
+	int n = net->boxes_size;
+	for(int i=0;i<n;i++) {
+		Box* box = net->boxes[i];
+		int missing = images(net, box, home, &mx, &my) & ~box->marked;
+		for(int k=0;k<4;k++) {
+			if(!(missing & 1<<k))
+				continue;
+			if(linked(net)==net->boxes_size_max &&
+					Boxnet_reserve(net, 2*net->boxes_size_max)!=0)
+				continue;
+			Box* ghost = ghost_make(net, box, k, home);
+			if(ghost!=NULL)
+				Box_insert(net, ghost, NULL);
+		}
+	}
+}
+
+/*
+	which of the shifts -1, 0 and 1 (index 0, 1, 2) of b by one
+	period, relative to a, make a and b overlap on one axis; a
+	shift is done by moving the other box back, like ghost_sync()
+	does, so the result matches the bounds in the net.
+*/
+static void periodic_overlaps(double a0, double a1, double b0, double b1,
+								double period, int* overlaps) {
+	for(int k=0;k<3;k++) {
+		double da = k==2 ? period : 0, db = k==0 ? period : 0;
+		overlaps[k] = a0-da <= b1-db && a1-da >= b0-db;
+	}
+}
+
+/*
+	whether a pair found in the net is the image of the pair that
+	is reported; if so, ghosts are replaced by their boxes.
+	Two boxes that are together wider or higher than the domain
+	can overlap in several places at once, with different shifts
+	between them; the pair is only reported for the first of
+	those, ordered by the box with the smaller id.
+*/
+static int periodic_pair(Boxnet* net, Box** box1, Box** box2) {
+	double x = (*box1)->posx > (*box2)->posx ? (*box1)->posx : (*box2)->posx;
+	double y = (*box1)->posy > (*box2)->posy ? (*box1)->posy : (*box2)->posy;
+	if(x < net->period_x || y < net->period_y)
+		return 0;
+	int k1 = image_of(net, *box1), k2 = image_of(net, *box2);
+	if(k1<0 || k2<0)
+		return 0;	// a box that lies elsewhere
+	Box* a = (*box1)->ghost ? (*box1)->usrdata : *box1;
+	Box* b = (*box2)->ghost ? (*box2)->usrdata : *box2;
+	double width = net->period_width, height = net->period_height;
+	if((a->right - a->posx) + (b->right - b->posx) >= width ||
+			(a->top - a->posy) + (b->top - b->posy) >= height) {
+		// the shift of b relative to a in this image
+		int sx = (k1&1) - (k2&1);
+		int sy = (k1>>1) - (k2>>1);
+		if(a->id > b->id) {
+			Box* t = a;	a = b;	b = t;
+			sx = -sx;	sy = -sy;
+		}
+		double ha[4], hb[4], m;
+		images(net, a, ha, &m, &m);
+		images(net, b, hb, &m, &m);
+		int ox[3], oy[3];
+		periodic_overlaps(ha[0], ha[2], hb[0], hb[2], width, ox);
+		periodic_overlaps(ha[1], ha[3], hb[1], hb[3], height, oy);
+		int first = 0;
+		while(first<9 && !(ox[first/3] && oy[first%3]))
+			first++;
+		if(first != 3*(sx+1) + sy+1)
+			return 0;
+	}
+	*box1 = (*box1)->ghost ? (*box1)->usrdata : *box1;
+	*box2 = (*box2)->ghost ? (*box2)->usrdata : *box2;
+	return 1;
+}
+
+/*
+	makes the world periodic: a box that leaves the rectangle from
+	x, y to x+width, y+height on one side comes in on the other,
+	and is reported to overlap the boxes there. The bounds of the
+	boxes may lie anywhere, they are taken modulo the period, but
+	the boxes must be smaller than the rectangle. A width of 0
+	makes the world flat again. Boxes aren't kept out as giants
+	(see Boxnet_setgiantsize()) in a periodic world, since a giant
+	couldn't have ghosts. Snapshots store the period but not the
+	ghosts (see above); a restored net makes them anew.
+*/
+void Boxnet_setperiodic(Boxnet* net, double x, double y,
+							double width, double height) {
+	Trace* trace = trace_begin(net);
+	assert(width==0 || (width>0 && height>0));
+	ghosts_clear(net);
+	net->period_x = x;
+	net->period_y = y;
+	net->period_width = width;
+	net->period_height = width>0 ? height : 0;
+	trace_end(net, trace, BOXNET_TRACE_PERIODIC, &net->period_x, 2 * sizeof net->period_x,
+				&net->period_width, 2 * sizeof net->period_width);
+}
+
+/*
+	A repair goes through the boxes twice: first it brings their
+	net bounds up to date, then it seeds the connections around
+	the ones that moved and drains the queues after each of them,
+	so that the work stays local. net->repair_cursor is the next
+	box, net->repair_syncing tells the passes apart; the cursor
+	is -1 if no repair is pending. net->repair_moved counts the
+	dirty boxes behind the cursor while syncing, and those ahead
+	of it while seeding, so the seeding can stop early.
+*/
+
+/*
+	returns 1 if solve_conn() would have to change something,
+	without changing anything itself.
+*/
+static int conn_violated(Junction* jnc, unsigned char tdir) {
+	if(jnc->dir==5 || (jnc->dir<4 && jnc->beamdir!=tdir) || jnc->nb[tdir]==NULL)
+		return 0;
+	return needsflip(jnc, tdir);
+}
+
+static int junction_violated(Junction* jnc) {
+	for(unsigned char d=0;d<4;d++) {
+		if(jnc->nb[d]==NULL || (jnc->dir<4 && d==(jnc->dir^2)))
+			continue;
+		if(conn_violated(jnc, d) || conn_violated(jnc->nb[d], d^2))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+	returns 1 if any of the connections seed_box() (or with own,
+	only those of the own junctions, like a repair of all boxes)
+	would enqueue needs solving.
+*/
+static int box_violated(Box* box, int own) {
+	if(own) {
+		for(unsigned char tdir=0;tdir<4;tdir++) {
+			Junction* jnc = &box->rayend[tdir];
+			if(conn_violated(&box->jnc, tdir) ||
+					(jnc->dir!=5 && conn_violated(jnc, jnc->beamdir)))
+				return 1;
+		}
+		return 0;
+	}
+	if(junction_violated(&box->jnc))
+		return 1;
+	for(unsigned char d=0;d<4;d++) {
+		for(Junction* jnc = box->jnc.nb[d]; jnc!=NULL; jnc = jnc->nb[d]) {
+			if(junction_violated(jnc))
+				return 1;
+			if(jnc->dir==(d^2))
+				break;
+		}
+	}
+	return 0;
+}
+
+typedef int (*SliceJob)(Boxnet* net, int begin, int end);
+
+typedef struct SliceWorker {
+	Boxnet*		net;
+	SliceJob	job;
+	int			slices;
+	int			next;
+	long		sum;
+} SliceWorker;
+
+static void* slice_work(void* arg) {
+	SliceWorker* w = arg;
+	long sum = 0;
+	int s;
+	while((s = __sync_fetch_and_add(&w->next, 1)) < w->slices)
+		sum += w->job(w->net, (long)linked(w->net)*s/w->slices,
+						(long)linked(w->net)*(s+1)/w->slices);
+	__sync_fetch_and_add(&w->sum, sum);
+	return NULL;
+}
+
+/*
+	the threads of Boxnet_setthreads(), besides the calling one.
+	They are started once and sleep until parallel_slices() hands
+	them a job; each job number is taken by every thread once.
+*/
+typedef struct WorkerPool {
+	pthread_t			threads[BOXNET_THREADS-1];
+	int					started;
+	pthread_mutex_t		lock;
+	pthread_cond_t		wake;		// a job was handed out or quit set
+	pthread_cond_t		done;		// busy dropped to 0
+	SliceWorker*		work;
+	unsigned long		job;		// counts the jobs handed out
+	int					busy;		// threads still on the current job
+	int					quit;
+} WorkerPool;
+
+static void* pool_work(void* arg) {
+	WorkerPool* pool = arg;
+	unsigned long job = 0;
+	pthread_mutex_lock(&pool->lock);
+	for(;;) {
+		while(pool->job==job && !pool->quit)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		if(pool->quit)
+			break;
+		job = pool->job;
+		SliceWorker* w = pool->work;
+		pthread_mutex_unlock(&pool->lock);
+		slice_work(w);
+		pthread_mutex_lock(&pool->lock);
+		if(--pool->busy==0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/*
+	starts net->threads-1 threads. If not all of them can be
+	started, the pool makes do with fewer; if there isn't enough
+	memory, parallel_slices() runs everything on the calling one.
+*/
+static void pool_new(Boxnet* net) {
+	WorkerPool* pool = bn_alloc(net, sizeof *pool);
+	if(pool==NULL)
+		return;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->work = NULL;
+	pool->job = 0;
+	pool->busy = 0;
+	pool->quit = 0;
+	pool->started = 0;
+	while(pool->started<net->threads-1 &&
+			pthread_create(&pool->threads[pool->started], NULL, pool_work, pool)==0)
+		pool->started++;
+	net->pool = pool;
+}
+
+static void pool_free(Boxnet* net) {
+	WorkerPool* pool = net->pool;
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+	for(int i=0;i<pool->started;i++)
+		pthread_join(pool->threads[i], NULL);
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->wake);
+	pthread_mutex_destroy(&pool->lock);
+	bn_free(net, pool, sizeof *pool);
+	net->pool = NULL;
+}
+
+// see Boxnet_memory_usage()
+static size_t pool_memory(Boxnet* net) {
+	return net->pool!=NULL ? sizeof *net->pool : 0;
+}
+
+/*
+	runs job(net, begin, end) on slices of net->boxes, on the
+	threads of the pool and the calling one, and returns the sum
+	of what the jobs returned.
+*/
+static long parallel_slices(Boxnet* net, SliceJob job) {
+	WorkerPool* pool = net->pool;
+	int threads = pool!=NULL ? pool->started+1 : 1;
+	// a few slices per thread, to even out the load
+	SliceWorker w = { net, job, 4*threads, 0, 0 };
+	if(threads>1) {
+		pthread_mutex_lock(&pool->lock);
+		pool->work = &w;
+		pool->busy = pool->started;
+		pool->job++;
+		pthread_cond_broadcast(&pool->wake);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	slice_work(&w);
+	if(threads>1) {
+		pthread_mutex_lock(&pool->lock);
+		while(pool->busy>0)
+			pthread_cond_wait(&pool->done, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return w.sum;
+}
+
+static int sync_slice(Boxnet* net, int begin, int end) {
+	int moved = 0;
+	for(int i=begin;i<end;i++) {
+		Box* box = net->boxes[i];
+		box->dirty |= sync_box(box);
+		moved += box->dirty!=0;
+	}
+	return moved;
+}
+
+static int scan_slice(Boxnet* net, int begin, int end) {
+	int violated = 0;
+	for(int i=begin;i<end;i++) {
+		Box* box = net->boxes[i];
+		if(net->repair_all)
+			box->dirty = box_violated(box, 1) ? 3 : 0;
+		else if(box->dirty)
+			box->dirty = box_violated(box, 0);
+		violated += box->dirty!=0;
+	}
+	return violated;
+}
+
+/*
+	marks box as needing seed_box(). While a repair is seeding,
+	boxes the cursor already passed are seeded right away.
+*/
+static void mark_dirty(Boxnet* net, Box* box) {
+	if(net->repair_cursor<0 || (net->repair_syncing && box->index >= net->repair_cursor)) {
+		box->dirty = 1;
+	} else if(net->repair_syncing) {
+		net->repair_moved += !box->dirty;
+		box->dirty = 1;
+	} else if(box->index >= net->repair_cursor) {
+		// even a repair that seeds all boxes has to seed the rays
+		// of a box inserted in the middle of it
+		net->repair_moved += !box->dirty;
+		box->dirty = 2;
+	} else {
+		seed_box(box, net->repair_queue[0]);
+	}
+}
+
+/*
+	does what the current pass of the pending repair has to do
+	for box, when the cursor reaches it.
+*/
+static void repair_seed(Boxnet* net, Box* box) {
+	if(net->repair_syncing) {
+		box->dirty |= sync_box(box);
+		net->repair_moved += box->dirty!=0;
+		return;
+	}
+	if((net->repair_all && box->dirty!=2) || box->dirty==3) {
+		for(unsigned char tdir=0;tdir<4;tdir++) {
+			RepairQueue_append(&box->jnc,tdir, net->repair_queue[0]);
+			Junction* jnc = &box->rayend[tdir];
+			if(jnc->dir!=5)
+				RepairQueue_append(jnc,jnc->beamdir, net->repair_queue[0]);
+		}
+	} else if(box->dirty) {
+		seed_box(box, net->repair_queue[0]);
+	}
+	net->repair_moved -= box->dirty!=0;
+	box->dirty = 0;
+}
+
+/*
+	switches from syncing to seeding. Seeding the rays of a box
+	costs a few times more than seeding only its own junctions,
+	so if most boxes moved, the own junctions of all boxes are
+	seeded instead; that covers every connection.
+*/
+static void repair_synced(Boxnet* net) {
+	STAT(net->stats.synced += net->repair_moved;)
+	net->repair_syncing = 0;
+	net->repair_cursor = 0;
+	net->repair_all = net->repair_moved > linked(net)/2;
+}
+
+/*
+	does the syncing pass of a repair that was just started on
+	several threads, and finds out which of the boxes the seeding
+	pass would seed have connections that really need solving.
+	Both only write to the boxes of their own slice. Only those
+	boxes are left dirty for the seeding pass (with dirty=3 if
+	their own junctions suffice, see repair_synced()), which
+	stays serial: the flips and slides change junctions along
+	whole rays, so there are no regions that could be repaired
+	independently.
+*/
+static void repair_scan(Boxnet* net) {
+	assert(net->repair_syncing && net->repair_cursor==0);
+	net->repair_moved = parallel_slices(net, sync_slice);
+	repair_synced(net);
+	net->repair_moved = parallel_slices(net, scan_slice);
+	net->repair_all = 0;
+}
+
+/*
+	works on the pending repair until it is done (returns 1) or
+	the budget runs out (returns 0).
+*/
+static int repair_continue(Boxnet* net, RepairBudget* budget) {
+	if(net->repair_syncing) {
+		// every repair goes through all boxes here, keep it tight
+		int limited = budget->max_steps>0 || budget->deadline>0;
+		int i = net->repair_cursor;
+		int n = linked(net);
+		int moved = net->repair_moved;
+		while(i < n && (!limited || budget_step(budget))) {
+			Box* box = net->boxes[i++];
+			box->dirty |= sync_box(box);
+			moved += box->dirty!=0;
+		}
+		net->repair_cursor = i;
+		net->repair_moved = moved;
+		if(i < n)
+			return 0;
+		repair_synced(net);
+	}
+	while(repair_drain(net, budget)) {
+		int n = linked(net);
+		if(!net->repair_all) {
+			if(net->repair_moved==0)
+				net->repair_cursor = n;
+			while(net->repair_cursor < n &&
+					!net->boxes[net->repair_cursor]->dirty)
+				net->repair_cursor++;
+		}
+		if(net->repair_cursor >= n) {
+			assert(net->repair_moved==0);
+			net->repair_cursor = -1;
+			return 1;
+		}
+		repair_seed(net, net->boxes[net->repair_cursor++]);
+	}
+	return 0;
+}
+
+/*
+	starts a repair of every box whose net bounds have to be
+	updated (see Boxnet_setmargin()), or that was inserted or
+	relocated, unless one is pending already.
+*/
+static void repair_start(Boxnet* net) {
+	if(net->repair_cursor>=0)
+		return;
+	if(net->giant_size>0 || net->giants_size>0)
+		sort_giants(net);
+	if(net->period_width>0)
+		periodic_sync(net);
+	net->repair_cursor = 0;
+	net->repair_syncing = 1;
+	net->repair_moved = 0;
+}
+
+/*
+	finishes a pending repair; for the calls that need a
+	repaired net to work on.
+*/
+static void repair_finish(Boxnet* net) {
+	RepairBudget unlimited = {0, 0, 0};
+	if(net->repair_cursor>=0)
+		repair_continue(net, &unlimited);
+}
+
+// what a rebuild costs in repair steps, until one was measured
+#define REBUILD_STEPS_PER_BOX 40
+// after a repair was given up, the following ones get this much
+// less, except for every AUTOREBUILD_PROBE-th
+#define AUTOREBUILD_PROBE 8
+
+/*
+	repairs the net after the boxes moved, were added or
+	relocated. A repair left pending by Boxnet_repairsome() is
+	finished first; the motion since is repaired as well.
+	When the boxes moved far, repairing costs much more than
+	building the net anew. So if this is switched on with
+	Boxnet_setautorebuild(), the repair gets as many steps as the
+	last Boxnet_rebuild() needed, and is given up for a rebuild
+	if that isn't enough; that is never more than twice the
+	better one. While the motion stays incoherent, the following
+	repairs only get an AUTOREBUILD_PROBE-th of that, except for
+	every AUTOREBUILD_PROBE-th one.
+*/
+void Boxnet_repair(Boxnet* net) {
+	Trace* trace = trace_begin(net);
+	STAT(double t = bn_time();)
+	repair_finish(net);
+	repair_start(net);
+	if(net->threads>1 && net->boxes_size>0)
+		repair_scan(net);
+	int done = 1;
+	if(!net->auto_rebuild || net->boxes_size==0) {
+		repair_finish(net);
+	} else {
+		RepairBudget budget = {0, net->rebuild_steps>0 ? net->rebuild_steps :
+									(long)REBUILD_STEPS_PER_BOX*net->boxes_size, 0};
+		if(net->rebuild_streak%AUTOREBUILD_PROBE!=0)
+			budget.max_steps /= AUTOREBUILD_PROBE;
+		done = repair_continue(net, &budget);
+		// a repair that only synced tells nothing about the motion
+		if(done && budget.steps > net->boxes_size)
+			net->rebuild_streak = 0;
+	}
+	STAT(net->stats.time_repair += bn_time()-t;)
+	if(!done) {
+		Boxnet_rebuild(net);
+		net->rebuild_streak++;
+		STAT(net->stats.rebuilds++;)
+	}
+	trace_end(net, trace, BOXNET_TRACE_REPAIR, NULL, 0, NULL, 0);
+}
+
+/*
+	switches the automatic rebuild of Boxnet_repair() on or off
+	(the default).
+*/
+void Boxnet_setautorebuild(Boxnet* net, int enabled) {
+	net->auto_rebuild = enabled!=0;
+	net->rebuild_streak = 0;
+	int32_t arg = net->auto_rebuild;
+	trace_end(net, trace_begin(net), BOXNET_TRACE_AUTOREBUILD,
+				&arg, sizeof arg, NULL, 0);
+}
+
+/*
+	lets Boxnet_repair() use that many threads (including the
+	calling one; the default is 1, at most BOXNET_THREADS) for
+	bringing the net bounds up to date and for finding the
+	connections that need solving. The solving itself stays
+	serial and isn't partitioned by region: a flip or slide
+	rewrites junctions along a whole ray, so no region of the
+	net can be solved on its own (see repair_scan()). So this
+	helps most when many boxes moved, but only a little each,
+	and boxnet_bench --scaling shows how far. The threads are started here and kept until the
+	net is freed or this is called again.
+*/
+void Boxnet_setthreads(Boxnet* net, int threads) {
+	threads = threads<1 ? 1 : threads>BOXNET_THREADS ? BOXNET_THREADS : threads;
+	if(threads==net->threads)
+		return;
+	if(net->pool!=NULL)
+		pool_free(net);
+	net->threads = threads;
+	if(threads>1)
+		pool_new(net);
+}
+
+static int repair_budgeted(Boxnet* net, int start, int max_steps,
+							double max_microseconds) {
+	Trace* trace = trace_begin(net);
+	RepairBudget budget = {0, max_steps>0 ? max_steps : 0,
+				max_microseconds > 0 ? bn_time() + 1e-6*max_microseconds : 0};
+	STAT(double t = bn_time();)
+	if(start)
+		repair_start(net);
+	int done = net->repair_cursor<0 || repair_continue(net, &budget);
+	STAT(net->stats.time_repair += bn_time()-t;)
+	// like Boxnet_optimize(), the trace gets the number of steps
+	// actually done, so that a replay doesn't depend on the clock
+	int32_t args[2] = {budget.steps, start};
+	trace_end(net, trace, BOXNET_TRACE_REPAIRSOME, args, sizeof args, NULL, 0);
+	return done;
+}
+
+/*
+	like Boxnet_repair(), but does at most max_steps steps of work
+	(syncing the net bounds of a box or solving a connection) and
+	stops after roughly max_microseconds (<=0 means no limit for
+	either one), leaving the rest pending in the net.
+	Returns 1 if the net is repaired, 0 if not.
+	If a repair is pending already, this continues it, like
+	Boxnet_repairresume(); motion since it started is left to the
+	next one. Until the net is repaired, Boxnet_trycollide()
+	refuses to report pairs; Boxnet_collide() and the other calls
+	that need a repaired net finish the pending work first.
+*/
+int Boxnet_repairsome(Boxnet* net, int max_steps, double max_microseconds) {
+	return repair_budgeted(net, 1, max_steps, max_microseconds);
+}
+
+/*
+	continues a repair left pending by Boxnet_repairsome(), with
+	the same kind of budget, but never starts a new one.
+	Returns 1 if the net is repaired (or nothing was pending).
+*/
+int Boxnet_repairresume(Boxnet* net, int max_steps, double max_microseconds) {
+	return repair_budgeted(net, 0, max_steps, max_microseconds);
+}
+
+// returns 1 unless a repair started by Boxnet_repairsome() is pending
+int Boxnet_repaired(const Boxnet* net) {
+	return net->repair_cursor<0;
+}
+
+
+/*
+	position of (x,y) on the hilbert curve through a
+	65536x65536 grid
+*/
+static unsigned int hilbert(unsigned int x, unsigned int y) {
+	const unsigned int n = 1<<16;
+	unsigned int d = 0;
+	for(unsigned int s=n/2;s>0;s/=2) {
+		unsigned int rx = (x & s) > 0;
+		unsigned int ry = (y & s) > 0;
+		d += s * s * ((3 * rx) ^ ry);
+		// rotate the quadrant
+		if(ry==0) {
+			if(rx==1) {
+				x = n-1 - x;
+				y = n-1 - y;
+			}
+			unsigned int t = x;
+			x = y;
+			y = t;
+		}
+	}
+	return d;
+}
+
+struct SortKey {
+	unsigned int		key;
+	int					index;
+};
+
+static int SortKey_cmp(const void* a, const void* b) {
+	unsigned int ka = ((const struct SortKey*)a)->key;
+	unsigned int kb = ((const struct SortKey*)b)->key;
+	return (ka > kb) - (ka < kb);
+}
+
+/*
+	returns the indices of all boxes, sorted along a hilbert
+	curve through their centres. The caller has to bn_free() the
+	result. Returns NULL if there isn't enough memory.
+*/
+static int* spatial_order(Boxnet* net) {
+	int n = net->boxes_size;
+	double x0 = net->boxes[0]->netx + net->boxes[0]->netright, x1 = x0;
+	double y0 = net->boxes[0]->nety + net->boxes[0]->nettop, y1 = y0;
+	for(int i=1;i<n;i++) {
+		Box* b = net->boxes[i];
+		double cx = b->netx + b->netright;
+		double cy = b->nety + b->nettop;
+		if(cx < x0) x0 = cx;
+		if(cx > x1) x1 = cx;
+		if(cy < y0) y0 = cy;
+		if(cy > y1) y1 = cy;
+	}
+	double sx = x1>x0 ? 65535./(x1-x0) : 0;
+	double sy = y1>y0 ? 65535./(y1-y0) : 0;
+	struct SortKey* keys = bn_alloc(net, n * sizeof *keys);
+	int* order = bn_alloc(net, n * sizeof *order);
+	if(keys==NULL || order==NULL) {
+		bn_free(net, keys, n * sizeof *keys);
+		bn_free(net, order, n * sizeof *order);
+		return NULL;
+	}
+	for(int i=0;i<n;i++) {
+		Box* b = net->boxes[i];
+		unsigned int qx = (unsigned int)((b->netx + b->netright - x0)*sx);
+		unsigned int qy = (unsigned int)((b->nety + b->nettop - y0)*sy);
+		keys[i].key = hilbert(qx, qy);
+		keys[i].index = i;
+	}
+	qsort(keys, n, sizeof *keys, SortKey_cmp);
+	for(int i=0;i<n;i++)
+		order[i] = keys[i].index;
+	bn_free(net, keys, n * sizeof *keys);
+	return order;
+}
+
+/*
+	sorts net->boxes along a hilbert curve through the box
+	centres. The main loops of repair and collide then visit
+	boxes that are close to each other one after the other,
+	so the junctions they touch are often still in the cache.
+	The boxes themselves are not moved in memory, since the
+	Box pointers returned by Boxnet_addbox() have to stay valid.
+*/
+void Boxnet_reorder(Boxnet* net) {
+	int n = net->boxes_size;
+	if(n==0)
+		return;
+	Trace* trace = trace_begin(net);
+	// the repair cursor is an index into net->boxes
+	repair_finish(net);
+	// the order is only an optimization; without the memory
+	// for it, the boxes simply keep their order
+	int* order = spatial_order(net);
+	Box** sorted = order!=NULL ? bn_alloc(net, n * sizeof *sorted) : NULL;
+	if(sorted!=NULL) {
+		for(int i=0;i<n;i++) {
+			sorted[i] = net->boxes[order[i]];
+			sorted[i]->index = i;
+		}
+		memcpy(net->boxes, sorted, n * sizeof *sorted);
+	}
+	bn_free(net, sorted, n * sizeof *sorted);
+	bn_free(net, order, n * sizeof *order);
+	net->optimize_cursor = 0;
+	trace_end(net, trace, BOXNET_TRACE_REORDER, NULL, 0, NULL, 0);
+}
+
+/*
+	makes Boxnet_collide() call Boxnet_reorder() every interval
+	frames; 0 switches it off.
+*/
+void Boxnet_setreorderinterval(Boxnet* net, int interval) {
+	net->reorder_interval = interval;
+	net->reorder_countdown = interval;
+	int32_t arg = interval;
+	trace_end(net, trace_begin(net), BOXNET_TRACE_REORDERINTERVAL,
+				&arg, sizeof arg, NULL, 0);
+}
+
+/*
+	throws away the whole net structure and builds it again.
+	The boxes are sorted along a space filling curve (see
+	Boxnet_reorder()) and each one is inserted next to its
+	predecessor and repaired right away, so the repair only has
+	to do local work. This takes about linear time and is much
+	faster than repairing a net whose boxes moved far. Two
+	optimization sweeps afterwards shorten the rays the insertion
+	order left behind.
+*/
+void Boxnet_rebuild(Boxnet* net) {
+	if(net->boxes_size==0)
+		return;
+	Trace* trace = trace_begin(net);
+	// a pending repair is moot, the net is built from scratch
+	net->repair_queue[0]->size = 0;
+	net->repair_queue[1]->size = 0;
+	net->repair_cursor = -1;
+	if(net->period_width>0)
+		periodic_sync(net);
+	int n = linked(net);
+	// counted, for Boxnet_repair()
+	RepairBudget counted = {0, LONG_MAX, 0};
+	for(int i=0;i<n;i++)
+		sync_box(net->boxes[i]);
+	Boxnet_reorder(net);
+	for(int i=0;i<n;i++) {
+		Box* box = net->boxes[i];
+		box->dirty = 0;
+		box->jnc.enqueued = 0;
+		for(int d=0;d<4;d++) {
+			box->jnc.nb[d] = NULL;
+			box->rayend[d].dir = 5;
+			box->rayend[d].enqueued = 0;
+		}
+	}
+	// repairing right after each insertion keeps the work local;
+	// inserting everything first and repairing once is far slower
+	STAT(double t = bn_time();)
+	for(int i=1;i<n;i++) {
+		Junction_insert(&net->boxes[i]->jnc, &net->boxes[i-1]->jnc);
+		seed_box(net->boxes[i], net->repair_queue[0]);
+		repair_drain(net, &counted);
+	}
+	net->rebuild_steps = counted.steps + n;
+	STAT(net->stats.time_repair += bn_time()-t;)
+	Boxnet_optimize(net, n, 0);
+	Boxnet_optimize(net, n, 0);
+	trace_end(net, trace, BOXNET_TRACE_REBUILD, NULL, 0, NULL, 0);
+}
+
+/*
+	measures the structural quality of the net by walking
+	every ray. Takes time linear in the size of the net,
+	so don't call it every frame for large nets.
+	Note that every T-junction ends one ray and lies on another
+	one, so junctions_mean is always close to one; the maximum
+	and the ray lengths are what degrades over time.
+*/
+void Boxnet_getquality(Boxnet* net, Boxnet_quality* quality) {
+	Boxnet_quality q = {0., 0, 0., 0., 0, 0};
+	double size[2] = {0., 0.};	// mean box height and width
+	for(int i=0;i<net->boxes_size;i++) {
+		size[0] += net->boxes[i]->nettop - net->boxes[i]->nety;
+		size[1] += net->boxes[i]->netright - net->boxes[i]->netx;
+	}
+	for(int a=0;a<2;a++) {
+		size[a] /= net->boxes_size;
+		if(!(size[a] > 0.))
+			size[a] = 1.;
+	}
+	long junctions = 0;
+	int bounded = 0;
+	for(int i=0;i<net->boxes_size;i++) {
+		Box* box = net->boxes[i];
+		for(unsigned char d=0;d<4;d++) {
+			int count = 0;
+			Junction* next = box->jnc.nb[d];
+			while(next!=NULL && next->dir!=(d^2)) {
+				count++;
+				next = next->nb[d];
+			}
+			q.rays++;
+			junctions += count;
+			if(count > q.junctions_max)
+				q.junctions_max = count;
+			if(next==NULL) {
+				q.rays_infinite++;
+				continue;
+			}
+			double length = d%2 ? bnabs(next->pos[0]->netx - box->netx)
+								: bnabs(next->pos[1]->nety - box->nety);
+			length /= size[d%2];
+			q.length_mean += length;
+			if(length > q.length_max)
+				q.length_max = length;
+			bounded++;
+		}
+	}
+	if(q.rays > 0)
+		q.junctions_mean = (double)junctions / q.rays;
+	if(bounded > 0)
+		q.length_mean /= bounded;
+	*quality = q;
+}
+
+/*
+	lets Boxnet_collide() watch the net quality: every interval
+	frames, Boxnet_getquality() is measured after the repair, and if
+	the mean ray length (Boxnet_quality.length_mean) is above
+	max_length_mean, the net is optimized (BOXNET_QUALITY_OPTIMIZE)
+	or rebuilt (BOXNET_QUALITY_REBUILD). BOXNET_QUALITY_IGNORE turns
+	this off.
+*/
+void Boxnet_setqualitypolicy(Boxnet* net, int action,
+							double max_length_mean, int interval) {
+	net->quality_action = action;
+	net->quality_threshold = max_length_mean;
+	net->quality_interval = interval > 0 ? interval : 1;
+	net->quality_countdown = net->quality_interval;
+	int32_t args[2] = {action, net->quality_interval};
+	trace_end(net, trace_begin(net), BOXNET_TRACE_QUALITYPOLICY, args, sizeof args,
+				&max_length_mean, sizeof max_length_mean);
+}
+
+static void quality_policy(Boxnet* net) {
+	if(net->quality_action==BOXNET_QUALITY_IGNORE || net->boxes_size==0)
+		return;
+	if(--net->quality_countdown > 0)
+		return;
+	net->quality_countdown = net->quality_interval;
+	Boxnet_quality q;
+	Boxnet_getquality(net, &q);
+	if(q.length_mean <= net->quality_threshold)
+		return;
+	if(net->quality_action==BOXNET_QUALITY_REBUILD) {
+		Boxnet_rebuild(net);
+	} else {
+		Boxnet_optimize(net, net->boxes_size, 0);
+	}
+}
+
+/*
+	overlap kernels for the candidate batches of boxcollisions().
+	left[] and right[] hold the x-extents of n candidates (SoA);
+	bit i of the result is set if candidate i overlaps [qleft,qright]
+	in x. The walk itself only guarantees y-overlap of the net
+	bounds, which can be larger (see Boxnet_setmargin()), so the
+	hits are tested in y once more.
+	n must not exceed BC_BATCH_SIZE.
+*/
+typedef unsigned int (*OverlapKernel)(const double* left, const double* right,
+								int n, double qleft, double qright);
+
+static unsigned int overlap_scalar(const double* left, const double* right,
+								int n, double qleft, double qright) {
+	unsigned int mask = 0;
+	for(int i=0;i<n;i++)
+		mask |= (unsigned int)(left[i] <= qright && right[i] >= qleft) << i;
+	return mask;
+}
+
+#ifdef BOXNET_SIMD_X86
+__attribute__((target("sse2")))
+static unsigned int overlap_sse2(const double* left, const double* right,
+								int n, double qleft, double qright) {
+	__m128d ql = _mm_set1_pd(qleft);
+	__m128d qr = _mm_set1_pd(qright);
+	unsigned int mask = 0;
+	int i=0;
+	for(;i+2<=n;i+=2) {
+		__m128d l = _mm_loadu_pd(left+i);
+		__m128d r = _mm_loadu_pd(right+i);
+		__m128d hit = _mm_and_pd(_mm_cmple_pd(l,qr), _mm_cmpge_pd(r,ql));
+		mask |= (unsigned int)_mm_movemask_pd(hit) << i;
+	}
+	// a full batch of 32 leaves no tail, and shifting by 32 is undefined
+	if(i<n)
+		mask |= overlap_scalar(left+i, right+i, n-i, qleft, qright) << i;
+	return mask;
+}
+
+__attribute__((target("avx")))
+static unsigned int overlap_avx(const double* left, const double* right,
+								int n, double qleft, double qright) {
+	__m256d ql = _mm256_set1_pd(qleft);
+	__m256d qr = _mm256_set1_pd(qright);
+	unsigned int mask = 0;
+	int i=0;
+	for(;i+4<=n;i+=4) {
+		__m256d l = _mm256_loadu_pd(left+i);
+		__m256d r = _mm256_loadu_pd(right+i);
+		__m256d hit = _mm256_and_pd(_mm256_cmp_pd(l,qr,_CMP_LE_OQ),
+									_mm256_cmp_pd(r,ql,_CMP_GE_OQ));
+		mask |= (unsigned int)_mm256_movemask_pd(hit) << i;
+	}
+	// a full batch of 32 leaves no tail, and shifting by 32 is undefined
+	if(i<n)
+		mask |= overlap_scalar(left+i, right+i, n-i, qleft, qright) << i;
+	return mask;
+}
+#endif
+
+static OverlapKernel kernel = overlap_scalar;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+// picks the widest overlap kernel the cpu supports
+static void kernel_pick() {
+#ifdef BOXNET_SIMD_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx"))
+		kernel = overlap_avx;
+	else if(__builtin_cpu_supports("sse2"))
+		kernel = overlap_sse2;
+#endif
+}
+
+/*
+	returns the kernel picked by kernel_pick(). Nets may collide
+	on several threads at once, so it is picked only once.
+*/
+static OverlapKernel overlap_kernel() {
+	pthread_once(&kernel_once, kernel_pick);
+	return kernel;
+}
+
+/*
+	finds collisions for this bounding box; this does
+	not find all collisions of box, in the sense that each collision
+	pair is reported only by one of the two involved physpoints.
+	The collision net needs to be valid.
 	CAUTION: this function assumes that the lower edge of
 	the BB "stands" completely on rays, i.e. if you go
 	from self.intersection to the right, you encounter
@@ -737,105 +2969,1491 @@ void Boxnet_repair(Boxnet* net) {
 	net changes between two rasterizations of BBs that
 	should be tested for overlap.
 	
-	CAUTION: do NOT call Boxnet_delbox from the collision callback
-	function "func", or else you will have buggy behaviour!
+	CAUTION: do NOT call Boxnet_delbox from the collision callback
+	function "func", or else you will have buggy behaviour!
+*/
+static void boxcollisions(Box* box, Boxnet* net, unsigned int serial,
+							boxCallback func, void* data) {
+	//Box_overlap_right_append(Box* box, Box* append)
+	Box**				queue = net->bc_queue[0];
+	int					queue_size = 0;
+	// candidates are not tested one by one, but gathered in
+	// batches and tested together by the overlap kernel
+	Box*				batch[BC_BATCH_SIZE];
+	double				batch_left[BC_BATCH_SIZE];
+	double				batch_right[BC_BATCH_SIZE];
+	int					batch_size = 0;
+	OverlapKernel		overlap = overlap_kernel();
+	void batch_flush() {
+		unsigned int mask = overlap(batch_left, batch_right, batch_size,
+									box->posx, box->right);
+		for(int i=0;mask!=0;i++,mask>>=1)
+			if((mask&1) && batch[i]->posy <= box->top && batch[i]->top >= box->posy) {
+				STAT(net->stats.pairs++;)
+				func(box,batch[i],data);
+			}
+		batch_size = 0;
+	}
+	void queue_append(Box* append) {
+		if(append->marked==serial)
+			return;
+		append->marked=serial;
+		STAT(net->stats.candidates++;)
+		// add to overlap regions
+		assert(append->nety <= box->nettop);
+		assert(append->nettop >= box->nety);
+		assert(box!=append);
+		batch[batch_size] = append;
+		batch_left[batch_size] = append->posx;
+		batch_right[batch_size] = append->right;
+		if(++batch_size == BC_BATCH_SIZE)
+			batch_flush();
+		vector_append(net, queue, append, queue_size, net->bc_queue_size_max[0], BC_QUEUE_SIZE_INIT);
+		net->bc_queue[0] = queue;
+	}
+	vector_append(net, queue, box, queue_size, net->bc_queue_size_max[0], BC_QUEUE_SIZE_INIT);
+	net->bc_queue[0] = queue;
+	while(queue_size>0) {
+		// go left
+		// BEWARE: nearly duplicated code below...
+		queue_size--;
+		Junction* jnc = &queue[queue_size]->jnc;
+		Junction* root = jnc;
+		while(root!=NULL && root->dir!=3 && root->pos[0]->netx > box->netx) {
+			STAT(net->stats.junctions++;)
+			if(root->dir != 2) {
+				Junction* next = root->nb[0];
+				// go upwards until we can go forward
+				while(next!=NULL && next->pos[1]->nety <= box->nettop) {
+					STAT(net->stats.junctions++;)
+					if(next->dir!=3) {
+						queue_append(next->pos[1]);
+						break;
+					}
+					next = next->nb[0];
+				}
+			}
+			root = root->nb[1];
+		}
+		// go right
+		// BEWARE: nearly duplicated code above...
+		root = jnc;
+		while(root!=NULL && root->dir!=1 &&
+						root->pos[0]->netx <= box->netright) {
+			STAT(net->stats.junctions++;)
+			if(root->dir != 2) {
+				Junction* next = root->nb[0];
+				// go upwards until we can go forward
+				while(next!=NULL && next->pos[1]->nety <= box->nettop) {
+					STAT(net->stats.junctions++;)
+					if(next->dir!=1) {
+						queue_append(next->pos[1]);
+						break;
+					}
+					next = next->nb[0];
+				}
+			}
+			root = root->nb[3];
+		}
+	}
+	if(batch_size>0)
+		batch_flush();
+}
+
+/*
+	Interleaved collision walks
+	===========================
+
+	The walk of boxcollisions() is a chain of dependent loads
+	through nb[] and pos[], so a single walk stalls on every
+	junction that isn't cached. With net->walks > 1, up to that
+	many walks run at once, each in a slot with a queue of its
+	own: every walk goes one junction further, prefetches the
+	junction it needs next and makes way for the next slot, so
+	the loads of all walks overlap.
+	A walk marks its candidates with the bit of its slot
+	(Box.walk_marks) so it queues them only once; running walks
+	can share a candidate this way. When a walk is done, it
+	clears the bit on the candidates in its queue again.
+*/
+
+typedef struct Walk {
+	Box*				box;		// NULL if the slot is free
+	Junction*			jnc;		// the walk goes left and right from here
+	Junction*			root;		// on the ray below the box
+	Junction*			next;		// going upward from root, or NULL
+	int					side;		// 0 left, 1 right
+	int					queue_read;	// net->bc_queue[slot] up to here is done
+	int					queue_size;
+	int					batch_size;
+	// candidates are not tested one by one, but gathered in
+	// batches and tested together by the overlap kernel
+	Box*				batch[BC_BATCH_SIZE];
+	double				batch_left[BC_BATCH_SIZE];
+	double				batch_right[BC_BATCH_SIZE];
+} Walk;
+
+static void walk_flush(Boxnet* net, Walk* w, OverlapKernel overlap,
+						boxCallback func, void* data) {
+	Box* box = w->box;
+	unsigned int mask = overlap(w->batch_left, w->batch_right, w->batch_size,
+								box->posx, box->right);
+	for(int i=0;mask!=0;i++,mask>>=1)
+		if((mask&1) && w->batch[i]->posy <= box->top && w->batch[i]->top >= box->posy) {
+			STAT(net->stats.pairs++;)
+			func(box,w->batch[i],data);
+		}
+	w->batch_size = 0;
+}
+
+/*
+	whether the walk in slot has queued candidate already; marks
+	it for the walk if not.
+*/
+static inline int walk_seen(Box* candidate, int slot) {
+	if(candidate->walk_marks & (1<<slot))
+		return 1;
+	candidate->walk_marks |= 1<<slot;
+	return 0;
+}
+
+// a finished walk takes its marks off its candidates
+static void walk_unmark(Boxnet* net, Walk* w, int slot) {
+	Box** queue = net->bc_queue[slot];
+	for(int i=0;i<w->queue_size;i++)
+		queue[i]->walk_marks &= ~(1<<slot);
+}
+
+/*
+	advances the walk in slot by one junction, the same way as
+	boxcollisions() does. Returns 1 when the walk is done.
+*/
+static inline int walk_step(Boxnet* net, Walk* w, int slot,
+							OverlapKernel overlap, boxCallback func, void* data) {
+	Box* box = w->box;
+	Junction* root = w->root;
+	Junction* next = w->next;
+	int side = w->side;
+	int stop = side ? 1 : 3;
+	if(next!=NULL) {
+		STAT(net->stats.junctions++;)
+		if(next->pos[1]->nety <= box->nettop) {
+			if(next->dir==stop) {
+				next = next->nb[0];
+				if(next!=NULL) {
+					__builtin_prefetch(next);
+					w->next = next;
+					return 0;
+				}
+			} else {
+				Box* append = next->pos[1];
+				if(!walk_seen(append, slot)) {
+					STAT(net->stats.candidates++;)
+					assert(append->nety <= box->nettop);
+					assert(append->nettop >= box->nety);
+					assert(box!=append);
+					int n = w->batch_size;
+					w->batch[n] = append;
+					w->batch_left[n] = append->posx;
+					w->batch_right[n] = append->right;
+					if(++w->batch_size == BC_BATCH_SIZE)
+						walk_flush(net, w, overlap, func, data);
+					Box** queue = net->bc_queue[slot];
+					vector_append(net, queue, append, w->queue_size,
+									net->bc_queue_size_max[slot], BC_QUEUE_SIZE_INIT);
+					net->bc_queue[slot] = queue;
+				}
+			}
+		}
+		// done going upward, go on along the ray
+		w->next = NULL;
+		root = root->nb[side ? 3 : 1];
+		__builtin_prefetch(root);
+		w->root = root;
+		return 0;
+	}
+	if(root!=NULL && root->dir!=stop && (side ? root->pos[0]->netx <= box->netright :
+												root->pos[0]->netx > box->netx)) {
+		STAT(net->stats.junctions++;)
+		if(root->dir!=2 && (next = root->nb[0])!=NULL) {
+			__builtin_prefetch(next);
+			w->next = next;
+		} else {
+			root = root->nb[side ? 3 : 1];
+			__builtin_prefetch(root);
+			w->root = root;
+		}
+		return 0;
+	}
+	if(side==0) {
+		w->side = 1;
+		w->root = w->jnc;
+		return 0;
+	}
+	if(w->queue_read==w->queue_size) {
+		if(w->batch_size>0)
+			walk_flush(net, w, overlap, func, data);
+		return 1;
+	}
+	w->jnc = &net->bc_queue[slot][w->queue_read++]->jnc;
+	__builtin_prefetch(w->jnc);
+	w->root = w->jnc;
+	w->side = 0;
+	return 0;
+}
+
+// boxcollisions() for all boxes of the net, net->walks at a time
+static void boxcollisions_interleaved(Boxnet* net, boxCallback func, void* data) {
+	OverlapKernel overlap = overlap_kernel();
+	Walk slots[BOXNET_WALKS];
+	int walks = net->walks;
+	int i = 0;
+	for(int slot=0;slot<walks;slot++)
+		slots[slot].box = NULL;
+	for(int active=walks;active>0;) {
+		active = 0;
+		for(int slot=0;slot<walks;slot++) {
+			Walk* w = &slots[slot];
+			if(w->box==NULL) {
+				if(i==linked(net))
+					continue;
+				Box* box = net->boxes[i++];
+				w->box = box;
+				w->jnc = &box->jnc;
+				w->root = w->jnc;
+				w->next = NULL;
+				w->side = 0;
+				w->queue_read = 0;
+				w->queue_size = 0;
+				w->batch_size = 0;
+			}
+			active++;
+			if(walk_step(net, w, slot, overlap, func, data)) {
+				walk_unmark(net, w, slot);
+				w->box = NULL;
+			}
+		}
+	}
+}
+
+/*
+	sets how many collision walks are interleaved, from 1 (one
+	walk after the other, the default) to BOXNET_WALKS. This only
+	pays off for nets far larger than the cache whose boxes are
+	not ordered by location (see Boxnet_reorder()); otherwise,
+	the bookkeeping costs more than the overlapping loads gain.
+*/
+void Boxnet_setwalks(Boxnet* net, int walks) {
+	net->walks = walks<1 ? 1 : walks>BOXNET_WALKS ? BOXNET_WALKS : walks;
+}
+
+/*
+	prepares a repaired net for boxcollisions(): makes the lower
+	edge of every box stand on rays (see the CAUTION there)
+*/
+static void prepare(Boxnet* net) {
+	for(int i=0;i<linked(net);i++) {
+		Box* box = net->boxes[i];
+		box->marked = 0;
+		for(Junction* next = box->jnc.nb[3];
+				next != NULL && next->pos[0]->netx <= box->netright;
+				next = next->nb[3]) {
+			if(next->dir==1) {
+				STAT(net->stats.prep_flips++;)
+				next = Junction_flip(next,NULL);
+			}
+		}
+	}
+}
+
+// the collisionCallback of Boxnet_collide(), for boxcollisions()
+typedef struct UsrdataPairs {
+	Boxnet*				net;
+	collisionCallback	func;
+	void*				data;
+} UsrdataPairs;
+
+static void usrdata_pair(Box* box1, Box* box2, void* data) {
+	UsrdataPairs* pairs = data;
+	if(pairs->net->period_width>0 && !periodic_pair(pairs->net, &box1, &box2))
+		return;
+	if(box1->deleted || box2->deleted)
+		return;		// see Boxnet_delbox_deferred()
+	pairs->func(box1->usrdata, box2->usrdata, pairs->data);
+}
+
+/*
+	runs boxcollisions() for all boxes of a repaired net, and
+	reports the giants' pairs.
+*/
+static void collide_all(Boxnet* net, boxCallback func, void* data) {
+	STAT(double t = bn_time();)
+	prepare(net);
+	STAT(net->stats.time_prepare += bn_time()-t;)
+	STAT(t = bn_time();)
+	if(net->walks>1) {
+		boxcollisions_interleaved(net, func, data);
+	} else {
+		for(int i=0;i<linked(net);i++)
+			boxcollisions(net->boxes[i], net, i+1, func, data);
+	}
+	giant_collisions(net, func, data);
+	STAT(net->stats.time_collide += bn_time()-t;)
+}
+
+// Boxnet_collide() up to, but without, applying the deferred changes
+static void collide_frame(Boxnet* net, collisionCallback func, void* data) {
+	Trace* trace = trace_begin(net);
+	if(trace!=NULL) {
+		trace->func = func;
+		trace->data = data;
+		trace->pairs = 0;
+		func = trace_count;
+		data = trace;
+	}
+	Boxnet_repair(net);
+	quality_policy(net);
+	if(net->reorder_interval>0 && --net->reorder_countdown<=0) {
+		Boxnet_reorder(net);
+		net->reorder_countdown = net->reorder_interval;
+	}
+	if(net->optimize_boxes>0 || net->optimize_microseconds>0)
+		Boxnet_optimize(net, net->optimize_boxes, net->optimize_microseconds);
+	UsrdataPairs pairs = {net, func, data};
+	net->colliding = 1;
+	collide_all(net, usrdata_pair, &pairs);
+	net->colliding = 0;
+	STAT(stats_endframe(net);)
+	if(trace!=NULL)
+		trace_end(net, trace, BOXNET_TRACE_COLLIDE, &trace->pairs, sizeof trace->pairs, NULL, 0);
+}
+
+/*
+	find all collisions between BBs.
+	repairs the net before finding collisions.
+*/
+void Boxnet_collide(Boxnet* net, collisionCallback func, void* data) {
+	collide_frame(net, func, data);
+	deferred_apply(net);
+}
+
+/*
+	like Boxnet_collide(), but refuses to work while a repair left
+	pending by Boxnet_repairsome() isn't done: then it reports no
+	pairs and returns 0, instead of finishing the repair at any cost.
+	Returns 1 if it found the collisions.
+*/
+int Boxnet_trycollide(Boxnet* net, collisionCallback func, void* data) {
+	if(!Boxnet_repaired(net))
+		return 0;
+	Boxnet_collide(net, func, data);
+	return 1;
+}
+
+
+/*
+	Pipelined frames
+	================
+
+	The bounds of the next frame can be staged with Boxnet_stage()
+	while Boxnet_commit() has the last frame repaired and collided
+	on a worker thread. Boxnet_commit() waits for that, writes all
+	staged bounds at once and starts the next frame.
+	The staging buffer is only touched by the caller's thread and
+	the net only by the worker, so neither needs a lock. That's
+	why the changes deferred by the callbacks are applied by
+	Boxnet_wait(), on the caller's thread: deleting a box drops
+	its staged bounds.
+*/
+
+typedef struct Staged {
+	Box*				box;
+	double				bounds[4];
+} Staged;
+
+typedef struct Pipeline {
+	pthread_t			thread;
+	int					running;
+	collisionCallback	func;
+	void*				data;
+	Staged*				staged;
+	int					staged_size;
+	int					staged_size_max;
+} Pipeline;
+
+static void* pipeline_work(void* arg) {
+	Boxnet* net = arg;
+	collide_frame(net, net->pipeline->func, net->pipeline->data);
+	return NULL;
+}
+
+// NULL if there isn't enough memory
+static Pipeline* pipeline_get(Boxnet* net) {
+	if(net->pipeline==NULL) {
+		net->pipeline = bn_alloc(net, sizeof *net->pipeline);
+		if(net->pipeline!=NULL)
+			memset(net->pipeline, 0, sizeof *net->pipeline);
+	}
+	return net->pipeline;
+}
+
+// staged bounds of a deleted box must not be written anymore
+static void pipeline_drop(Boxnet* net, Box* box) {
+	Pipeline* p = net->pipeline;
+	int j = 0;
+	for(int i=0;i<p->staged_size;i++)
+		if(p->staged[i].box!=box)
+			p->staged[j++] = p->staged[i];
+	p->staged_size = j;
+}
+
+static void pipeline_free(Boxnet* net) {
+	Boxnet_wait(net);
+	Pipeline* p = net->pipeline;
+	bn_free(net, p->staged, p->staged_size_max * sizeof *p->staged);
+	bn_free(net, p, sizeof *p);
+	net->pipeline = NULL;
+}
+
+// see Boxnet_memory_usage()
+static size_t pipeline_memory(Boxnet* net, size_t* slack) {
+	Pipeline* p = net->pipeline;
+	if(p==NULL)
+		return 0;
+	*slack += (p->staged_size_max - p->staged_size) * sizeof *p->staged;
+	return sizeof *p + p->staged_size_max * sizeof *p->staged;
+}
+
+static void pipeline_shrink(Boxnet* net) {
+	Pipeline* p = net->pipeline;
+	p->staged = trim(net, p->staged, &p->staged_size_max, p->staged_size, sizeof *p->staged);
+}
+
+/*
+	sets the bounds box gets with the next Boxnet_commit(). Unlike
+	everything else, this may be called while a frame started by
+	Boxnet_commit() is still running. If a box is staged more than
+	once, the last bounds count. The staging buffer comes from the
+	net's allocator, which has to be thread-safe if the buffer
+	grows while a frame runs. Returns 0 on success, -1 if there
+	isn't enough memory (the bounds aren't staged then).
+*/
+int Boxnet_stage(Boxnet* net, Box* box, double x, double y,
+							double right, double top) {
+	assert(right>=x && top>=y);
+	Pipeline* p = pipeline_get(net);
+	if(p==NULL)
+		return -1;
+	if(p->staged_size==p->staged_size_max) {
+		int grown = p->staged_size_max>0 ? 2*p->staged_size_max : BOXES_SIZE_INIT;
+		Staged* staged = bn_realloc(net, p->staged, p->staged_size_max * sizeof *staged,
+									grown * sizeof *staged);
+		if(staged==NULL)
+			return -1;
+		p->staged = staged;
+		p->staged_size_max = grown;
+	}
+	Staged staged = {box, {x, y, right, top}};
+	p->staged[p->staged_size++] = staged;
+	return 0;
+}
+
+/*
+	waits for the frame started by Boxnet_commit(), if any, and
+	applies the additions and deletions its callbacks deferred.
+	Until then, the net and its boxes must not be used, except
+	for Boxnet_stage(); a box deleted by the frame may be staged,
+	its bounds are dropped here.
+*/
+void Boxnet_wait(Boxnet* net) {
+	Pipeline* p = net->pipeline;
+	if(p==NULL || !p->running)
+		return;
+	pthread_join(p->thread, NULL);
+	p->running = 0;
+	deferred_apply(net);
+}
+
+/*
+	waits for the running frame, gives the boxes their staged
+	bounds and starts the next frame: Boxnet_collide(net, func,
+	data) on a worker thread, so func is called from there.
+	If no thread can be started, the frame is run right away.
+*/
+void Boxnet_commit(Boxnet* net, collisionCallback func, void* data) {
+	Pipeline* p = pipeline_get(net);
+	if(p==NULL) {
+		// nothing can have been staged without it
+		Boxnet_collide(net, func, data);
+		return;
+	}
+	Boxnet_wait(net);
+	for(int i=0;i<p->staged_size;i++) {
+		Box* box = p->staged[i].box;
+		box->posx = p->staged[i].bounds[0];
+		box->posy = p->staged[i].bounds[1];
+		box->right = p->staged[i].bounds[2];
+		box->top = p->staged[i].bounds[3];
+	}
+	p->staged_size = 0;
+	p->func = func;
+	p->data = data;
+	if(pthread_create(&p->thread, NULL, pipeline_work, net)==0)
+		p->running = 1;
+	else
+		Boxnet_collide(net, func, data);
+}
+
+
+/*
+	Swept collisions
+	================
+
+	A box that moves a long way in one frame can pass through a
+	thin one without their bounds ever overlapping at a collide.
+	Boxnet_sweep() moves a box and remembers where it came from;
+	Boxnet_collide_swept() then repairs the net on the swept
+	bounds (the union of start and end), so the walk finds all
+	pairs whose swept bounds overlap, and reports those that
+	actually meet while every bound moves linearly from its start
+	to its end, together with the earliest such time.
+*/
+
+typedef struct Swept {
+	Box*				box;
+	double				start[4];
+	double				end[4];		// set by Boxnet_collide_swept()
+} Swept;
+
+typedef struct Sweep {
+	Swept*				swept;
+	int					swept_size;
+	int					swept_size_max;
+	int*				index;		// Swept of every box, by position
+	int					index_size_max;
+	sweptCallback		func;
+	void*				data;
+	uint64_t			pairs;		// reported, for the trace
+} Sweep;
+
+static void sweep_drop(Boxnet* net, Box* box) {
+	Sweep* sw = net->sweep;
+	int j = 0;
+	for(int i=0;i<sw->swept_size;i++)
+		if(sw->swept[i].box!=box)
+			sw->swept[j++] = sw->swept[i];
+	sw->swept_size = j;
+}
+
+// NULL if there isn't enough memory
+static Sweep* sweep_get(Boxnet* net) {
+	if(net->sweep==NULL) {
+		net->sweep = bn_alloc(net, sizeof *net->sweep);
+		if(net->sweep!=NULL)
+			memset(net->sweep, 0, sizeof *net->sweep);
+	}
+	return net->sweep;
+}
+
+static void sweep_free(Boxnet* net) {
+	Sweep* sw = net->sweep;
+	bn_free(net, sw->swept, sw->swept_size_max * sizeof *sw->swept);
+	bn_free(net, sw->index, sw->index_size_max * sizeof *sw->index);
+	bn_free(net, sw, sizeof *sw);
+	net->sweep = NULL;
+}
+
+// see Boxnet_memory_usage(); the index is only needed during a sweep
+static size_t sweep_memory(Boxnet* net, size_t* slack) {
+	Sweep* sw = net->sweep;
+	if(sw==NULL)
+		return 0;
+	*slack += (sw->swept_size_max - sw->swept_size) * sizeof *sw->swept +
+				sw->index_size_max * sizeof *sw->index;
+	return sizeof *sw + sw->swept_size_max * sizeof *sw->swept +
+			sw->index_size_max * sizeof *sw->index;
+}
+
+static void sweep_shrink(Boxnet* net) {
+	Sweep* sw = net->sweep;
+	sw->swept = trim(net, sw->swept, &sw->swept_size_max, sw->swept_size, sizeof *sw->swept);
+	sw->index = trim(net, sw->index, &sw->index_size_max, 0, sizeof *sw->index);
+}
+
+/*
+	moves box to the new bounds, like changing them directly, but
+	the next Boxnet_collide_swept() sweeps it from the bounds it
+	has now. Moving a box more than once before that sweeps it
+	from its first bounds. Returns 0 on success, -1 if there isn't
+	enough memory (the box isn't moved then).
+*/
+int Boxnet_sweep(Boxnet* net, Box* box, double x, double y,
+							double right, double top) {
+	assert(right>=x && top>=y);
+	Sweep* sw = sweep_get(net);
+	if(sw==NULL)
+		return -1;
+	if(sw->swept_size==sw->swept_size_max) {
+		int grown = sw->swept_size_max>0 ? 2*sw->swept_size_max : BOXES_SIZE_INIT;
+		Swept* swept = bn_realloc(net, sw->swept, sw->swept_size_max * sizeof *swept,
+								grown * sizeof *swept);
+		if(swept==NULL)
+			return -1;
+		sw->swept = swept;
+		sw->swept_size_max = grown;
+	}
+	Swept swept = {box, {box->posx, box->posy, box->right, box->top}};
+	sw->swept[sw->swept_size++] = swept;
+	// the start bounds may have been written directly
+	if(net->trace!=NULL)
+		trace_moved(net->trace, box);
+	box->posx = x;		box->posy = y;
+	box->right = right;	box->top = top;
+	if(net->trace!=NULL) {
+		uint32_t id = box->id;
+		trace_op(net->trace, BOXNET_TRACE_SWEEP);
+		trace_write(net->trace, &id, sizeof id);
+		trace_bounds(net->trace, box);
+	}
+	return 0;
+}
+
+/*
+	the earliest time in [0,1] at which the bounds a and b overlap
+	while moving linearly from start to end, or -1 if they don't.
+*/
+static double time_of_impact(const double* a0, const double* a1,
+							const double* b0, const double* b1) {
+	double first = 0, last = 1;
+	// a's low edge below b's high edge and the other way round,
+	// in x (k=0) and y (k=1)
+	for(int k=0;k<4;k++) {
+		int low = k<2 ? k : k-2;
+		const double *p0 = k<2 ? a0 : b0, *p1 = k<2 ? a1 : b1;
+		const double *q0 = k<2 ? b0 : a0, *q1 = k<2 ? b1 : a1;
+		// p's low edge minus q's high edge must not be positive
+		double c = p0[low] - q0[low+2];
+		double d = (p1[low] - q1[low+2]) - c;
+		if(d>0)
+			last = -c/d < last ? -c/d : last;
+		else if(d<0)
+			first = -c/d > first ? -c/d : first;
+		else if(c>0)
+			return -1;
+	}
+	return first<=last ? first : -1;
+}
+
+static void swept_pair(Box* box1, Box* box2, void* data) {
+	Boxnet* net = data;
+	Sweep* sw = net->sweep;
+	Box* boxes[2] = {box1, box2};
+	if(net->period_width>0 && !periodic_pair(net, &box1, &box2))
+		return;
+	if(box1->deleted || box2->deleted)
+		return;
+	const double* bounds[2][2];
+	double shifted[2][2][4];
+	for(int i=0;i<2;i++) {
+		Box* box = boxes[i];
+		Box* owner = box->ghost ? box->usrdata : box;
+		int pos = owner->jnc.dir==5 ? net->boxes_size + owner->index : owner->index;
+		int k = sw->index[pos];
+		if(k<0) {
+			// not swept, so it's where it was: posx, posy, right, top
+			bounds[i][0] = bounds[i][1] = &box->posx;
+		} else if(box==owner) {
+			bounds[i][0] = sw->swept[k].start;
+			bounds[i][1] = sw->swept[k].end;
+		} else {
+			// a ghost is swept like its box, whole periods away
+			double dx = box->posx - owner->posx, dy = box->posy - owner->posy;
+			for(int j=0;j<4;j++) {
+				shifted[i][0][j] = sw->swept[k].start[j] + (j%2 ? dy : dx);
+				shifted[i][1][j] = sw->swept[k].end[j] + (j%2 ? dy : dx);
+			}
+			bounds[i][0] = shifted[i][0];
+			bounds[i][1] = shifted[i][1];
+		}
+	}
+	double toi = time_of_impact(bounds[0][0], bounds[0][1], bounds[1][0], bounds[1][1]);
+	if(toi>=0) {
+		sw->pairs++;
+		sw->func(box1->usrdata, box2->usrdata, toi, sw->data);
+	}
+}
+
+/*
+	repairs the net on the swept bounds of the boxes moved by
+	Boxnet_sweep() since the last call, and reports the pairs
+	that meet on the way with func, together with the earliest
+	time of impact: 0 at the start bounds, 1 at the end bounds.
+	Boxes that weren't swept stay where they are. Afterwards, all
+	boxes have their end bounds again. Pairs that overlap at the
+	start are reported with time 0; a pair that only touches
+	in between is reported as well.
+	Returns 0 on success, -1 if there isn't enough memory; no
+	pairs are reported then, but the boxes have their end bounds
+	and the sweeps are done with, as after a successful call.
+*/
+int Boxnet_collide_swept(Boxnet* net, sweptCallback func, void* data) {
+	Sweep* sw = sweep_get(net);
+	if(sw==NULL)
+		return -1;
+	Trace* trace = trace_begin(net);
+	sw->pairs = 0;
+	// a box swept more than once keeps its first start
+	for(int i=0;i<sw->swept_size;i++)
+		sw->swept[i].box->marked = 0;
+	int j = 0;
+	for(int i=0;i<sw->swept_size;i++) {
+		Swept* swept = &sw->swept[i];
+		Box* box = swept->box;
+		if(box->marked)
+			continue;
+		box->marked = 1;
+		swept->end[0] = box->posx;	swept->end[1] = box->posy;
+		swept->end[2] = box->right;	swept->end[3] = box->top;
+		const double *start = swept->start, *end = swept->end;
+		box->posx = start[0] < end[0] ? start[0] : end[0];
+		box->posy = start[1] < end[1] ? start[1] : end[1];
+		box->right = start[2] > end[2] ? start[2] : end[2];
+		box->top = start[3] > end[3] ? start[3] : end[3];
+		sw->swept[j++] = *swept;
+	}
+	sw->swept_size = j;
+	Boxnet_repair(net);
+	int n = net->boxes_size + net->giants_size;
+	int failed = 0;
+	if(n > sw->index_size_max) {
+		int* index = bn_realloc(net, sw->index, sw->index_size_max * sizeof *index,
+								n * sizeof *index);
+		if(index!=NULL) {
+			sw->index = index;
+			sw->index_size_max = n;
+		} else
+			failed = 1;
+	}
+	if(!failed) {
+		for(int i=0;i<n;i++)
+			sw->index[i] = -1;
+		for(int i=0;i<sw->swept_size;i++) {
+			Box* box = sw->swept[i].box;
+			sw->index[box->jnc.dir==5 ? net->boxes_size + box->index : box->index] = i;
+		}
+		sw->func = func;
+		sw->data = data;
+		net->colliding = 1;
+		collide_all(net, swept_pair, net);
+		net->colliding = 0;
+		STAT(stats_endframe(net);)
+	}
+	for(int i=0;i<sw->swept_size;i++) {
+		Box* box = sw->swept[i].box;
+		const double* end = sw->swept[i].end;
+		box->posx = end[0];	box->posy = end[1];
+		box->right = end[2];	box->top = end[3];
+	}
+	sw->swept_size = 0;
+	trace_end(net, trace, BOXNET_TRACE_COLLIDESWEPT, &sw->pairs, sizeof sw->pairs, NULL, 0);
+	deferred_apply(net);
+	return failed ? -1 : 0;
+}
+
+
+
+
+
+
+
+
+
+
+
+/*
+	Snapshots
+	=========
+	
+	A snapshot stores the boxes and the complete junction structure,
+	so a net can be restored without any repair. All links are
+	stored as indices instead of pointers: junction number 5*i is
+	the junction of box i, 5*i+1+d is its rayend[d]; positions
+	refer to box numbers; -1 stands for NULL.
+	The layout is fixed-size records after a small header, in the
+	byte order of the machine that wrote it (checked on restore).
+	The net is repaired and prepared for collision detection before
+	it is written, so a snapshot can also be queried in place by a
+	Boxnet_view. The ghosts of a periodic world are left out; only
+	the period is stored, and the first repair of a restored net
+	makes new ones.
 */
-static void boxcollisions(Box* box, Boxnet* net, collisionCallback func, void* data) {
-	//Box_overlap_right_append(Box* box, Box* append)
-	static Box**		queue = NULL;
-	static int			queue_size_max;
+
+#define SNAPSHOT_MAGIC		"BOXNET\x1a"
+#define SNAPSHOT_VERSION	3
+#define SNAPSHOT_BYTEORDER	0x01020304
+#define SNAPSHOT_PREPARED	1
+
+typedef struct SnapshotHeader {
+	char				magic[8];
+	uint32_t			version;
+	uint32_t			byteorder;
+	uint32_t			boxes;
+	uint32_t			flags;
+	double				period[4];	// see Boxnet_setperiodic()
+} SnapshotHeader;
+
+typedef struct SnapshotJunction {
+	int32_t				nb[4];
+	int32_t				pos[2];
+	unsigned char		dir;
+	unsigned char		beamdir;
+	unsigned char		padding[2];
+} SnapshotJunction;
+
+typedef struct SnapshotBox {
+	double				posx;
+	double				posy;
+	double				right;
+	double				top;
+	double				netx;		// the junctions refer to these
+	double				nety;
+	double				netright;
+	double				nettop;
+	double				margin;
+	SnapshotJunction	jnc[5];		// jnc, rayend[0..3]
+} SnapshotBox;
+
+static int32_t snapshot_jncindex(Junction* jnc) {
+	if(jnc==NULL)
+		return -1;
+	if(jnc->dir==4)
+		return 5*jnc->pos[0]->index;
+	// a T-junction is rayend[dir] of the box it gets its
+	// position along dir from
+	return 5*jnc->pos[jnc->dir%2]->index + 1 + jnc->dir;
+}
+
+size_t Boxnet_snapshotsize(Boxnet* net) {
+	int boxes = net->boxes_size + net->giants_size;
+	return sizeof(SnapshotHeader) + boxes * sizeof(SnapshotBox);
+}
+
+/*
+	writes a snapshot of net to buffer, which must be at least
+	Boxnet_snapshotsize(net) bytes large. usrdata is not saved;
+	the boxes are restored in the order of net->boxes, followed
+	by net->giants, so use that order to reconnect your objects.
+	In a periodic world, the net has no ghosts afterwards, until
+	the next repair.
+*/
+void Boxnet_snapshot(Boxnet* net, void* buffer) {
+	Boxnet_repair(net);
+	ghosts_clear(net);
+	prepare(net);
+	SnapshotHeader* h = buffer;
+	memset(h, 0, sizeof *h);
+	memcpy(h->magic, SNAPSHOT_MAGIC, sizeof h->magic);
+	h->version = SNAPSHOT_VERSION;
+	h->byteorder = SNAPSHOT_BYTEORDER;
+	h->boxes = net->boxes_size + net->giants_size;
+	h->flags = SNAPSHOT_PREPARED;
+	h->period[0] = net->period_x;
+	h->period[1] = net->period_y;
+	h->period[2] = net->period_width;
+	h->period[3] = net->period_height;
+	SnapshotBox* sb = (SnapshotBox*)(h+1);
+	for(int i=0;i<h->boxes;i++,sb++) {
+		Box* box = i<net->boxes_size ? net->boxes[i] : net->giants[i-net->boxes_size];
+		memset(sb, 0, sizeof *sb);
+		sb->posx = box->posx;
+		sb->posy = box->posy;
+		sb->right = box->right;
+		sb->top = box->top;
+		sb->netx = box->netx;
+		sb->nety = box->nety;
+		sb->netright = box->netright;
+		sb->nettop = box->nettop;
+		sb->margin = box->margin;
+		for(int j=0;j<5;j++) {
+			Junction* jnc = j==0 ? &box->jnc : &box->rayend[j-1];
+			SnapshotJunction* sj = &sb->jnc[j];
+			sj->dir = jnc->dir;
+			sj->beamdir = jnc->beamdir;
+			// nb[dir^2] of a T-junction is left over and may even
+			// point into a deleted box
+			for(int d=0;d<4;d++)
+				sj->nb[d] = jnc->dir==5 || (jnc->dir<4 && d==(jnc->dir^2)) ?
+								-1 : snapshot_jncindex(jnc->nb[d]);
+			for(int a=0;a<2;a++)
+				sj->pos[a] = jnc->dir==5 ? -1 : jnc->pos[a]->index;
+		}
+	}
+}
+
+/*
+	checks a snapshot for consistency, so that corrupt or
+	foreign data can't produce dangling links: all indices are in
+	range and every link is answered by the junction it points
+	to. Links can still form cycles the net never has, so the
+	view walks are bounded as well. Returns the number of boxes
+	or -1 if the snapshot is invalid.
+*/
+static long snapshot_check(const void* buffer, size_t size) {
+	const SnapshotHeader* h = buffer;
+	if(size < sizeof *h || memcmp(h->magic, SNAPSHOT_MAGIC, sizeof h->magic)!=0 ||
+			h->version!=SNAPSHOT_VERSION || h->byteorder!=SNAPSHOT_BYTEORDER)
+		return -1;
+	if(!(h->period[2]==0 || (h->period[2]>0 && h->period[3]>0 &&
+			isfinite(h->period[0]) && isfinite(h->period[1]) &&
+			isfinite(h->period[2]) && isfinite(h->period[3]))))
+		return -1;
+	long n = h->boxes;
+	if((size - sizeof *h) / sizeof(SnapshotBox) < (size_t)n)
+		return -1;
+	const SnapshotBox* sb = (const SnapshotBox*)(h+1);
+	// giants have all their junctions disconnected, nothing may
+	// link to them, and they come after the boxes of the net
+	int giant(int32_t box) {
+		return sb[box].jnc[0].dir==5;
+	}
+	for(long i=1;i<n;i++)
+		if(giant(i-1) && !giant(i))
+			return -1;
+	for(long i=0;i<n;i++)
+		for(int j=0;j<5;j++) {
+			const SnapshotJunction* sj = &sb[i].jnc[j];
+			if(sj->dir != (j==0 && !giant(i) ? 4 : sj->dir==5 || giant(i) ? 5 : j-1) ||
+					(j>0 && sj->dir!=5 && sj->beamdir > 3))
+				return -1;
+			for(int d=0;d<4;d++)
+				if(sj->nb[d] < -1 || sj->nb[d] >= 5*n || (sj->nb[d]>=0 && giant(sj->nb[d]/5)))
+					return -1;
+			for(int a=0;a<2;a++)
+				if(sj->pos[a] < -1 || sj->pos[a] >= n || (sj->dir!=5 && sj->pos[a]<0) ||
+						(sj->pos[a]>=0 && giant(sj->pos[a])))
+					return -1;
+		}
+	// links go both ways; a T-junction has no link where its ray
+	// ends and a disconnected junction has none at all
+	for(long i=0;i<n;i++)
+		for(int j=0;j<5;j++) {
+			const SnapshotJunction* sj = &sb[i].jnc[j];
+			for(int d=0;d<4;d++) {
+				int32_t nb = sj->nb[d];
+				if(nb<0)
+					continue;
+				const SnapshotJunction* other = &sb[nb/5].jnc[nb%5];
+				if(sj->dir==5 || (sj->dir<4 && d==(sj->dir^2)) ||
+						other->dir==5 || other->nb[d^2]!=5*i+j)
+					return -1;
+			}
+		}
+	return n;
+}
+
+/*
+	creates a new net from a snapshot written by Boxnet_snapshot().
+	No repair is necessary, except for making the ghosts of a
+	periodic world. Returns NULL if the snapshot is invalid.
+	All usrdata pointers are NULL.
+*/
+Boxnet* Boxnet_restore(const void* buffer, size_t size) {
+	return Boxnet_restorealloc(buffer, size, NULL);
+}
+
+/*
+	like Boxnet_restore(), but the net gets its memory from
+	allocator, see Boxnet_newalloc().
+*/
+Boxnet* Boxnet_restorealloc(const void* buffer, size_t size, const Boxnet_allocator* allocator) {
+	long n = snapshot_check(buffer, size);
+	if(n<0)
+		return NULL;
+	const SnapshotBox* sb = (const SnapshotBox*)((const SnapshotHeader*)buffer + 1);
+	Boxnet* net = Boxnet_newalloc(allocator);
+	if(net==NULL)
+		return NULL;
+	if(Boxnet_reserve(net, n)!=0) {
+		Boxnet_free(net);
+		return NULL;
+	}
+	for(long i=0;i<n;i++) {
+		Box* box = Box_new(net);
+		if(box==NULL) {
+			// the boxes so far aren't linked up yet
+			for(long j=0;j<i;j++)
+				bn_free(net, net->boxes[j], sizeof *box);
+			Boxnet_free(net);
+			return NULL;
+		}
+		box->posx = sb[i].posx;
+		box->posy = sb[i].posy;
+		box->right = sb[i].right;
+		box->top = sb[i].top;
+		box->netx = sb[i].netx;
+		box->nety = sb[i].nety;
+		box->netright = sb[i].netright;
+		box->nettop = sb[i].nettop;
+		box->margin = sb[i].margin;
+		box->dirty = 0;
+		box->usrdata = NULL;
+		box->marked = 0;
+		box->index = i;
+		box->id = i;
+		net->boxes[i] = box;
+	}
+	net->boxes_size = n;
+	net->next_id = n;
+	Junction* junction(int32_t index) {
+		if(index<0)
+			return NULL;
+		Box* box = net->boxes[index/5];
+		return index%5==0 ? &box->jnc : &box->rayend[index%5-1];
+	}
+	for(long i=0;i<n;i++) {
+		Box* box = net->boxes[i];
+		for(int j=0;j<5;j++) {
+			Junction* jnc = j==0 ? &box->jnc : &box->rayend[j-1];
+			const SnapshotJunction* sj = &sb[i].jnc[j];
+			jnc->dir = sj->dir;
+			jnc->beamdir = sj->beamdir;
+			if(jnc->dir==5)
+				continue;
+			for(int d=0;d<4;d++)
+				jnc->nb[d] = junction(sj->nb[d]);
+			for(int a=0;a<2;a++)
+				jnc->pos[a] = net->boxes[sj->pos[a]];
+		}
+	}
+	// the giants are at the end, keep their order
+	long boxes = n;
+	while(boxes>0 && net->boxes[boxes-1]->jnc.dir==5)
+		boxes--;
+	net->boxes_size = boxes;
+	for(long i=boxes;i<n;i++) {
+		if(giants_reserve(net)!=0) {
+			// net->boxes doesn't hold the giants anymore
+			for(long j=i;j<n;j++)
+				bn_free(net, net->boxes[j], sizeof **net->boxes);
+			Boxnet_free(net);
+			return NULL;
+		}
+		giant_add(net, net->boxes[i]);
+	}
+	const SnapshotHeader* h = buffer;
+	net->period_x = h->period[0];
+	net->period_y = h->period[1];
+	net->period_width = h->period[2];
+	net->period_height = h->period[3];
+	return net;
+}
+
+/*
+	writes a snapshot to a file; returns 0 on success, -1 on error.
+*/
+int Boxnet_save(Boxnet* net, const char* filename) {
+	size_t size = Boxnet_snapshotsize(net);
+	void* buffer = bn_alloc(net, size);
+	if(buffer==NULL)
+		return -1;
+	Boxnet_snapshot(net, buffer);
+	FILE* f = fopen(filename, "wb");
+	int ok = f!=NULL && fwrite(buffer, 1, size, f)==size;
+	if(f!=NULL && fclose(f)!=0)
+		ok = 0;
+	bn_free(net, buffer, size);
+	return ok ? 0 : -1;
+}
+
+/*
+	restores a net from a file written by Boxnet_save();
+	returns NULL on error.
+*/
+Boxnet* Boxnet_load(const char* filename) {
+	return Boxnet_loadalloc(filename, NULL);
+}
+
+/*
+	like Boxnet_load(), but the net and the file buffer get their
+	memory from allocator, see Boxnet_newalloc().
+*/
+Boxnet* Boxnet_loadalloc(const char* filename, const Boxnet_allocator* allocator) {
+	const Boxnet_allocator* a = allocator!=NULL ? allocator : &default_allocator;
+	FILE* f = fopen(filename, "rb");
+	if(f==NULL)
+		return NULL;
+	Boxnet* net = NULL;
+	long size = 0;
+	void* buffer = NULL;
+	if(fseek(f, 0, SEEK_END)==0 && (size = ftell(f))>=0 &&
+			fseek(f, 0, SEEK_SET)==0 && (buffer = a->alloc(size>0 ? size : 1, a->ctx))!=NULL &&
+			fread(buffer, 1, size, f)==(size_t)size)
+		net = Boxnet_restorealloc(buffer, size, allocator);
+	if(buffer!=NULL)
+		a->free(buffer, size>0 ? size : 1, a->ctx);
+	fclose(f);
+	return net;
+}
+
+
+/*
+	Views
+	=====
+	
+	A view queries a snapshot in place, without building a Boxnet.
+	The snapshot is never written to, so one process can save a
+	static world and any number of others can map the same file
+	read-only and share its pages. Each view only owns the small
+	per-reader state (candidate marks and the walk queue), so
+	don't share one view between threads.
+*/
+
+struct Boxnet_view {
+	const SnapshotBox*	boxes;
+	int					boxes_size;
+	int*				marked;		// per box: 1 + number of the box
+									// that last queued it
+	int*				queue;
+	int					queue_size_max;
+	void*				mapping;	// only set by Boxnet_view_open
+	size_t				mapping_size;
+	struct Published*	published;	// only set by Boxnet_view_acquire
+};
+
+// a view on n boxes of a snapshot that was checked already
+static Boxnet_view* view_new(const void* buffer, long n) {
+	Boxnet_view* view = malloc(sizeof *view);
+	if(view==NULL)
+		return NULL;
+	view->boxes = (const SnapshotBox*)((const SnapshotHeader*)buffer + 1);
+	view->boxes_size = n;
+	view->marked = calloc(n>0 ? n : 1, sizeof *view->marked);
+	view->queue_size_max = BC_QUEUE_SIZE_INIT;
+	view->queue = malloc(view->queue_size_max * sizeof *view->queue);
+	if(view->marked==NULL || view->queue==NULL) {
+		free(view->marked);
+		free(view->queue);
+		free(view);
+		return NULL;
+	}
+	view->mapping = NULL;
+	view->mapping_size = 0;
+	view->published = NULL;
+	return view;
+}
+
+/*
+	creates a view on a snapshot in memory, e.g. written by
+	Boxnet_snapshot() into shared memory. The buffer must stay
+	valid and unchanged while the view exists.
+	Returns NULL if the snapshot is invalid or there isn't enough
+	memory.
+*/
+Boxnet_view* Boxnet_view_new(const void* buffer, size_t size) {
+	long n = snapshot_check(buffer, size);
+	if(n<0 || !(((const SnapshotHeader*)buffer)->flags & SNAPSHOT_PREPARED))
+		return NULL;
+	return view_new(buffer, n);
+}
+
+/*
+	maps a file written by Boxnet_save() read-only and creates
+	a view on it; returns NULL on error.
+*/
+Boxnet_view* Boxnet_view_open(const char* filename) {
+	int fd = open(filename, O_RDONLY);
+	if(fd<0)
+		return NULL;
+	struct stat st;
+	void* mapping = MAP_FAILED;
+	if(fstat(fd, &st)==0 && st.st_size>0)
+		mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(mapping==MAP_FAILED)
+		return NULL;
+	Boxnet_view* view = Boxnet_view_new(mapping, st.st_size);
+	if(view==NULL) {
+		munmap(mapping, st.st_size);
+		return NULL;
+	}
+	view->mapping = mapping;
+	view->mapping_size = st.st_size;
+	return view;
+}
+
+void Boxnet_view_free(Boxnet_view* view) {
+	if(view->mapping!=NULL)
+		munmap(view->mapping, view->mapping_size);
+	if(view->published!=NULL)
+		published_release(view->published);
+	free(view->marked);
+	free(view->queue);
+	free(view);
+}
+
+/*
+	number of boxes; they are numbered in the order of
+	net->boxes at the time of the snapshot
+*/
+int Boxnet_view_size(Boxnet_view* view) {
+	return view->boxes_size;
+}
+
+void Boxnet_view_getbox(Boxnet_view* view, int box,
+						double* left, double* bottom, double* right, double* top) {
+	const SnapshotBox* b = &view->boxes[box];
+	*left = b->posx;
+	*bottom = b->posy;
+	*right = b->right;
+	*top = b->top;
+}
+
+/*
+	boxcollisions() on the index-linked snapshot layout.
+	Junction number j is jnc[j%5] of box j/5. No ray of a net is
+	longer than all its junctions together, so a walk that takes
+	more steps is running around a cycle of a corrupt snapshot
+	and stops.
+*/
+static void view_boxcollisions(Boxnet_view* view, int self,
+							viewCallback func, void* data) {
+	const SnapshotBox*	boxes = view->boxes;
+	const SnapshotBox*	box = &boxes[self];
+	int*				queue = view->queue;
 	int					queue_size;
-	if(queue==NULL) {
-		// TODO: do error checking... (NULL pointer)
-		queue = malloc(BC_QUEUE_SIZE_INIT * sizeof *queue);
-		assert(queue!=NULL);
-		queue_size_max=BC_QUEUE_SIZE_INIT;
+	const SnapshotJunction* junction(int32_t j) {
+		return j<0 ? NULL : &boxes[j/5].jnc[j%5];
 	}
-	void queue_append(Box* append) {
-		if(append->marked==box)
+	void queue_append(int append) {
+		if(view->marked[append]==self+1)
 			return;
-		append->marked=box;
-		// add to overlap regions
-		assert(append->posy <= box->top);
-		assert(append->top >= box->posy);
-		assert(box!=append);
-		if(append->posx <= box->right &&
-					append->right >= box->posx) {
-				func(box->usrdata,append->usrdata,data);
-		}
-		vector_append(queue, append, queue_size, queue_size_max, BC_QUEUE_SIZE_INIT);
+		view->marked[append] = self+1;
+		const SnapshotBox* b = &boxes[append];
+		if(b->posx <= box->right && b->right >= box->posx &&
+				b->posy <= box->top && b->top >= box->posy)
+			func(self, append, data);
+		vector_append(NULL, queue, append, queue_size, view->queue_size_max, BC_QUEUE_SIZE_INIT);
+		view->queue = queue;
 	}
-	queue[0] = box;
+	long				steps_max = 5L*view->boxes_size;
+	queue[0] = self;
 	for(queue_size = 1;queue_size>0;) {
 		// go left
 		// BEWARE: nearly duplicated code below...
 		queue_size--;
-		Junction* jnc = &queue[queue_size]->jnc;
-		Junction* root = jnc;
-		while(root!=NULL && root->dir!=3 && root->pos[0]->posx > box->posx) {
+		const SnapshotJunction* jnc = &boxes[queue[queue_size]].jnc[0];
+		const SnapshotJunction* root = jnc;
+		for(long steps=0;root!=NULL && root->dir!=3 && steps<steps_max &&
+					boxes[root->pos[0]].netx > box->netx;steps++) {
 			if(root->dir != 2) {
-				Junction* next = root->nb[0];
+				const SnapshotJunction* next = junction(root->nb[0]);
 				// go upwards until we can go forward
-				while(next!=NULL && next->pos[1]->posy <= box->top) {
+				for(long up=0;next!=NULL && up<steps_max &&
+							boxes[next->pos[1]].nety <= box->nettop;up++) {
 					if(next->dir!=3) {
 						queue_append(next->pos[1]);
 						break;
 					}
-					next = next->nb[0];
+					next = junction(next->nb[0]);
 				}
 			}
-			root = root->nb[1];
+			root = junction(root->nb[1]);
 		}
 		// go right
 		// BEWARE: nearly duplicated code above...
 		root = jnc;
-		while(root!=NULL && root->dir!=1 &&
-						root->pos[0]->posx <= box->right) {
+		for(long steps=0;root!=NULL && root->dir!=1 && steps<steps_max &&
+					boxes[root->pos[0]].netx <= box->netright;steps++) {
 			if(root->dir != 2) {
-				Junction* next = root->nb[0];
+				const SnapshotJunction* next = junction(root->nb[0]);
 				// go upwards until we can go forward
-				while(next!=NULL && next->pos[1]->posy <= box->top) {
+				for(long up=0;next!=NULL && up<steps_max &&
+							boxes[next->pos[1]].nety <= box->nettop;up++) {
 					if(next->dir!=1) {
 						queue_append(next->pos[1]);
 						break;
 					}
-					next = next->nb[0];
+					next = junction(next->nb[0]);
 				}
 			}
-			root = root->nb[3];
+			root = junction(root->nb[3]);
 		}
 	}
 }
 
 /*
-	find all collisions between BBs.
-	repairs the net before finding collisions.
+	find all collisions between the boxes of the view;
+	func is called with the numbers of the two boxes. A snapshot
+	of a periodic world has no ghosts, so pairs across its seams
+	are not found.
 */
-void Boxnet_collide(Boxnet* net, collisionCallback func, void* data) {
-	Boxnet_repair(net);
-	// prepare net for collisions
-	for(int i=0;i<net->boxes_size;i++) {
-		Box* box = net->boxes[i];
-		box->marked=NULL;
-		for(Junction* next = box->jnc.nb[3];
-				next != NULL && next->pos[0]->posx <= box->right;
-				next = next->nb[3]) {
-			if(next->dir==1)
-				next = Junction_flip(next,NULL);
+void Boxnet_view_collide(Boxnet_view* view, viewCallback func, void* data) {
+	memset(view->marked, 0, view->boxes_size * sizeof *view->marked);
+	const SnapshotBox* boxes = view->boxes;
+	int giant(int box) {
+		return boxes[box].jnc[0].dir==5;
+	}
+	for(int i=0;i<view->boxes_size;i++)
+		if(!giant(i))
+			view_boxcollisions(view, i, func, data);
+	// giants aren't linked to anything, see Boxnet_setgiantsize()
+	for(int i=0;i<view->boxes_size;i++) {
+		if(!giant(i))
+			continue;
+		const SnapshotBox* a = &boxes[i];
+		for(int j=0;j<view->boxes_size;j++) {
+			const SnapshotBox* b = &boxes[j];
+			if(j!=i && (j>i || !giant(j)) &&
+					a->posx <= b->right && a->right >= b->posx &&
+					a->posy <= b->top && a->top >= b->posy)
+				func(i, j, data);
 		}
 	}
-	// find collisions
-	for(int i=0;i<net->boxes_size;i++)
-		boxcollisions(net->boxes[i], net, func, data);
 }
 
 
+/*
+	Published versions
+	==================
+
+	Boxnet_publish() writes a snapshot of the repaired net into a
+	new block of memory that is never changed afterwards; views
+	on it can be used from other threads while the net is moved
+	and repaired again. The blocks are reference counted: the net
+	holds the newest one, every view the one it was made on, and
+	the last one to let go frees it. Only taking a reference on
+	the newest block is guarded by a spin lock, for a few
+	instructions; nobody waits for a repair or a query.
+*/
+
+typedef struct Published {
+	long				refs;
+	unsigned long		version;	// counts the publications of the net
+	size_t				size;		// of the snapshot that follows
+	long				boxes;		// in the snapshot
+} Published;
+
+static const void* published_snapshot(Published* published) {
+	return published+1;
+}
+
+static void published_release(Published* published) {
+	if(__sync_sub_and_fetch(&published->refs, 1)==0)
+		free(published);
+}
+
+static void publish_lock(Boxnet* net) {
+	while(__sync_lock_test_and_set(&net->publish_lock, 1))
+		while(__atomic_load_n(&net->publish_lock, __ATOMIC_RELAXED))
+			;
+}
+
+static void publish_unlock(Boxnet* net) {
+	__sync_lock_release(&net->publish_lock);
+}
 
+// see Boxnet_memory_usage()
+static size_t published_memory(Boxnet* net) {
+	Published* published = net->published;
+	return published!=NULL ? sizeof *published + published->size : 0;
+}
 
+// the newest publication of net with a reference taken, or NULL
+static Published* published_acquire(Boxnet* net) {
+	publish_lock(net);
+	Published* published = net->published;
+	if(published!=NULL)
+		__sync_add_and_fetch(&published->refs, 1);
+	publish_unlock(net);
+	return published;
+}
 
+/*
+	repairs the net and makes its current state the one that
+	Boxnet_view_acquire() and Boxnet_view_refresh() hand out.
+	Costs about as much as Boxnet_snapshot(). Has to be called
+	from the thread that changes the net, like every other call
+	on it. Returns 0 on success, -1 if there isn't enough memory
+	(the previous publication stays then).
+*/
+int Boxnet_publish(Boxnet* net) {
+	size_t size = Boxnet_snapshotsize(net);
+	Published* published = malloc(sizeof *published + size);
+	if(published==NULL)
+		return -1;
+	published->refs = 1;
+	published->version = net->published!=NULL ? net->published->version+1 : 1;
+	published->size = size;
+	Boxnet_snapshot(net, published+1);
+	// views trust the count from here on instead of checking each time
+	published->boxes = snapshot_check(published+1, size);
+	assert(published->boxes>=0);
+	publish_lock(net);
+	Published* old = net->published;
+	net->published = published;
+	publish_unlock(net);
+	if(old!=NULL)
+		published_release(old);
+	return 0;
+}
 
+/*
+	creates a view on the newest publication of net (see
+	Boxnet_publish()); it stays valid and unchanged until
+	Boxnet_view_refresh() or Boxnet_view_free(), even if net is
+	freed in the meantime. May be called from any thread.
+	Returns NULL if nothing was published yet or there isn't
+	enough memory.
+*/
+Boxnet_view* Boxnet_view_acquire(Boxnet* net) {
+	Published* published = published_acquire(net);
+	if(published==NULL)
+		return NULL;
+	Boxnet_view* view = view_new(published_snapshot(published), published->boxes);
+	if(view==NULL) {
+		published_release(published);
+		return NULL;
+	}
+	view->published = published;
+	return view;
+}
 
+/*
+	moves a view made by Boxnet_view_acquire() on to the newest
+	publication of net. Returns 1 if it changed, 0 if the view
+	was up to date already, -1 if there isn't enough memory (the
+	view stays on its publication then).
+*/
+int Boxnet_view_refresh(Boxnet_view* view, Boxnet* net) {
+	assert(view->published!=NULL);
+	Published* published = published_acquire(net);
+	if(published==view->published) {
+		published_release(published);
+		return 0;
+	}
+	long n = published->boxes;
+	if(n > view->boxes_size) {
+		int* marked = realloc(view->marked, n * sizeof *view->marked);
+		if(marked==NULL) {
+			published_release(published);
+			return -1;
+		}
+		view->marked = marked;
+	}
+	view->boxes = (const SnapshotBox*)((const SnapshotHeader*)published_snapshot(published) + 1);
+	view->boxes_size = n;
+	published_release(view->published);
+	view->published = published;
+	return 1;
+}
 
+/*
+	the publication a view made by Boxnet_view_acquire() is on;
+	they are numbered from 1 per net.
+*/
+unsigned long Boxnet_view_version(Boxnet_view* view) {
+	return view->published!=NULL ? view->published->version : 0;
+}
 
 
 
@@ -878,7 +4496,7 @@ void Boxnet_collide(Boxnet* net, collisionCallback func, void* data) {
 */
 static int repair_check(Boxnet* net) {
 	// control results
-	for(int i=0;i<net->boxes_size;i++) {
+	for(int i=0;i<linked(net);i++) {
 		for(unsigned char tdir=0;tdir<4;tdir++) {
 			Junction* next = net->boxes[i]->jnc.nb[tdir];
 			if(next!=NULL)
@@ -906,13 +4524,13 @@ static void find_inconsistencies(Boxnet* net) {
 		Junction* nb = jnc->nb[d];
 		if(nb==NULL) return 1;
 		if(d%2) {
-			if( jnc->pos[0]->posx - nb->pos[0]->posx >= 1.)
+			if( jnc->pos[0]->netx - nb->pos[0]->netx >= 1.)
 				return 1;
-			jnc->pos[0]->posx = nb->pos[0]->posx + 1;
+			jnc->pos[0]->netx = nb->pos[0]->netx + 1;
 		} else {
-			if( jnc->pos[1]->posy - nb->pos[1]->posy >= 1.)
+			if( jnc->pos[1]->nety - nb->pos[1]->nety >= 1.)
 				return 1;
-			jnc->pos[1]->posy = nb->pos[1]->posy + 1;
+			jnc->pos[1]->nety = nb->pos[1]->nety + 1;
 		}
 		return 0;
 	}
@@ -920,15 +4538,15 @@ static void find_inconsistencies(Boxnet* net) {
 	double posx[net->boxes_size];
 	double posy[net->boxes_size];
 	for(int i=0;i<net->boxes_size;i++) {
-		posx[i] = net->boxes[i]->posx;
-		posy[i] = net->boxes[i]->posy;
-		net->boxes[i]->posx = 0.;
-		net->boxes[i]->posy = 0.;
+		posx[i] = net->boxes[i]->netx;
+		posy[i] = net->boxes[i]->nety;
+		net->boxes[i]->netx = 0.;
+		net->boxes[i]->nety = 0.;
 	}
 	void restore() {
 		for(int i=0;i<net->boxes_size;i++) {
-			net->boxes[i]->posx = posx[i];
-			net->boxes[i]->posy = posy[i];
+			net->boxes[i]->netx = posx[i];
+			net->boxes[i]->nety = posy[i];
 		}
 	}
 	
@@ -938,7 +4556,7 @@ static void find_inconsistencies(Boxnet* net) {
 		done=1;
 		for(int i=0;i<net->boxes_size;i++) {
 			Box* box = net->boxes[i];
-			if(box->posx > maxsize || box->posy > maxsize) {
+			if(box->netx > maxsize || box->nety > maxsize) {
 				restore();
 				assert(0); // net is invalid
 			}
@@ -964,7 +4582,7 @@ static void find_inconsistencies(Boxnet* net) {
 static void validate(Boxnet* net) {
 	// find simple errors like wrong beamdirs
 	// and wrong links
-	for(int i=0;i<net->boxes_size;i++) {
+	for(int i=0;i<linked(net);i++) {
 		Box* box = net->boxes[i];
 		for(unsigned char tdir=0;tdir<4;tdir++) {
 			Junction* prev = &box->jnc;
@@ -1000,23 +4618,17 @@ static void validate(Boxnet* net) {
 
 
 /*
-	prints the net; only works if connected boxes don't have the
-	same x or y value.
+	prints the net: the net bounds of every box and the number
+	of junctions on each of its rays. Boxes with the same x or y
+	value may be in any order in the net (see needsflip()), so
+	the dump doesn't tell how ties were linked; use
+	Boxnet_snapshot() for a complete copy.
 */
 void print_net(Boxnet* net) {
-	// check net for degenerate positions (in that case we can't print
-	// the net because of the simple save format)
-	for(int i=0;i<net->boxes_size;i++) {
-		for(int j=0;j<net->boxes_size;j++) {
-			if(net->boxes[i]->posx == net->boxes[j]->posx ||
-						net->boxes[i]->posy == net->boxes[j]->posy)
-				printf("can't save net (duplicate positions).\n");
-		}
-	}
 	printf("boxnet dump:\n");
 	for(int i=0;i<net->boxes_size;i++) {
 		Box* b = net->boxes[i];
-		printf("P:%f,%f,%f,%f:",b->posx,b->posy,b->right,b->top);
+		printf("P:%f,%f,%f,%f:",b->netx,b->nety,b->netright,b->nettop);
 		int c[4]={0,0,0,0};
 		for(unsigned char d=0;d<4;d++) {
 			Junction* next = b->jnc.nb[d];
@@ -1061,7 +4673,7 @@ void col_callback(void* obj1, void* obj2, void* data) {
 	Collision col;
 	col.box1 = (Box*) obj1;
 	col.box2 = (Box*) obj2;
-	vector_append(cols->cols, col, cols->size, cols->size_max, 256);
+	vector_append(NULL, cols->cols, col, cols->size, cols->size_max, 256);
 }
 
 void Boxnet_collide_store(Boxnet* net, Collisions* cols) {
@@ -1172,7 +4784,7 @@ void stresstest(int nbox, int ncycl, int ndelete, int discrete, double stepcoeff
 		double x,y;
 		x = random_d();
 		y = random_d();
-		Box* box = Boxnet_addbox(net, x,y,x,y,NULL,NULL,1);
+		Box* box = Boxnet_addbox(net, x,y,x,y,NULL,NULL);
 		box->usrdata = box;
 		if(discrete)
 			quantize(box);
@@ -0,0 +1,421 @@
+/*
+	Copyright 2012 Samuel Moll
+	License: AGPLv3
+
+	Tiled worlds of boxnets, see boxworld.h.
+*/
+
+// for pthreads
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <pthread.h>
+#include "boxworld.h"
+#include "allocator.h"
+
+
+
+/*
+	tile coordinates of a position; outside of the world, the
+	border tiles are used. Monotonic in x, so the corner of an
+	overlap region is always in a tile that both boxes are in.
+*/
+static int tile_x(const Boxworld* world, double x) {
+	double t = floor((x-world->x) / world->tilewidth);
+	return t<0 ? 0 : (t>=world->tiles_x ? world->tiles_x-1 : (int)t);
+}
+
+static int tile_y(const Boxworld* world, double y) {
+	double t = floor((y-world->y) / world->tileheight);
+	return t<0 ? 0 : (t>=world->tiles_y ? world->tiles_y-1 : (int)t);
+}
+
+static void tile_range(const Boxworld* world, const Boxworld_box* box, int* range) {
+	range[0] = tile_x(world, box->posx);
+	range[1] = tile_y(world, box->posy);
+	range[2] = tile_x(world, box->right);
+	range[3] = tile_y(world, box->top);
+}
+
+static int in_range(const int* range, int x, int y) {
+	return x>=range[0] && x<=range[2] && y>=range[1] && y<=range[3];
+}
+
+static void free_parts(Boxworld* world, Boxworld_box* box) {
+	const int* t = box->tiles;
+	if(box->parts!=&box->part)
+		mem_free(&world->allocator, box->parts,
+					(t[2]-t[0]+1) * (t[3]-t[1]+1) * sizeof *box->parts);
+}
+
+/*
+	moves box into the tiles of range, which has to be non-empty.
+	If a tile runs out of memory, the box stays where it was and
+	-1 is returned.
+*/
+static int settiles(Boxworld* world, Boxworld_box* box, const int* range) {
+	const int* old = box->tiles;
+	int nx = range[2]-range[0]+1;
+	int old_nx = old[2]-old[0]+1;
+	int count = nx*(range[3]-range[1]+1);
+	Box* one;
+	Box** parts = count==1 ? &one : mem_alloc(&world->allocator, count * sizeof *parts);
+	if(parts==NULL)
+		return -1;
+	int failed = 0;
+	for(int y=range[1];y<=range[3];y++)
+		for(int x=range[0];x<=range[2];x++) {
+			Box** part = &parts[(y-range[1])*nx + x-range[0]];
+			if(in_range(old, x, y)) {
+				*part = box->parts[(y-old[1])*old_nx + x-old[0]];
+				continue;
+			}
+			Boxworld_tile* tile = &world->tiles[y*world->tiles_x+x];
+			*part = failed ? NULL : Boxnet_addbox(tile->net,
+								box->posx, box->posy, box->right, box->top, NULL, box);
+			failed |= *part==NULL;
+			tile->added++;
+		}
+	// leave the tiles that aren't needed anymore, or on failure,
+	// the ones that were just entered
+	const int* drop = failed ? range : old;
+	const int* keep = failed ? old : range;
+	Box** drop_parts = failed ? parts : box->parts;
+	int drop_nx = drop[2]-drop[0]+1;
+	for(int y=drop[1];y<=drop[3];y++)
+		for(int x=drop[0];x<=drop[2];x++) {
+			Box* part = drop_parts[(y-drop[1])*drop_nx + x-drop[0]];
+			if(!in_range(keep, x, y) && part!=NULL)
+				Boxnet_delbox(world->tiles[y*world->tiles_x+x].net, part);
+		}
+	if(failed) {
+		if(parts!=&one)
+			mem_free(&world->allocator, parts, count * sizeof *parts);
+		return -1;
+	}
+	free_parts(world, box);
+	if(count==1) {
+		box->part = one;
+		parts = &box->part;
+	}
+	box->parts = parts;
+	memcpy(box->tiles, range, sizeof box->tiles);
+	return 0;
+}
+
+
+
+/*
+	runs job(world, 0) ... job(world, jobs-1) on world->threads
+	threads (at most BOXNET_THREADS), the calling one included. If
+	threads can't be started, the others do more of the jobs.
+*/
+typedef void (*Job)(Boxworld* world, int job);
+
+typedef struct Worker {
+	Boxworld*	world;
+	Job			job;
+	int			jobs;
+} Worker;
+
+static void* work(void* arg) {
+	Worker* worker = arg;
+	int job;
+	while((job = __sync_fetch_and_add(&worker->world->jobs_next, 1)) < worker->jobs)
+		worker->job(worker->world, job);
+	return NULL;
+}
+
+static void parallel(Boxworld* world, Job job, int jobs) {
+	Worker worker = { world, job, jobs };
+	int n = world->threads < jobs ? world->threads : jobs;
+	if(n>BOXNET_THREADS)
+		n = BOXNET_THREADS;
+	pthread_t threads[BOXNET_THREADS-1];
+	int started = 0;
+	world->jobs_next = 0;
+	while(started<n-1 && pthread_create(&threads[started], NULL, work, &worker)==0)
+		started++;
+	work(&worker);
+	for(int i=0;i<started;i++)
+		pthread_join(threads[i], NULL);
+}
+
+/*
+	one slice of the boxes per tile, not the boxes in the tile.
+	A job can't return an error, running out of memory is noted
+	in world->jobs_failed.
+*/
+static void find_moved(Boxworld* world, int job) {
+	int jobs = world->tiles_x*world->tiles_y;
+	int begin = (long)world->boxes_size*job/jobs;
+	int end = (long)world->boxes_size*(job+1)/jobs;
+	Boxworld_tile* tile = &world->tiles[job];
+	tile->moved_size = 0;
+	for(int i=begin;i<end;i++) {
+		Boxworld_box* box = world->boxes[i];
+		int range[4];
+		tile_range(world, box, range);
+		if(memcmp(range, box->tiles, sizeof range)==0)
+			continue;
+		if(tile->moved_size==tile->moved_size_max) {
+			Boxworld_box** grown = vector_grow(&world->allocator, tile->moved,
+										&tile->moved_size_max, sizeof *grown, 16);
+			// the other boxes stay where they are until the next sync
+			if(grown==NULL) {
+				__sync_fetch_and_or(&world->jobs_failed, 1);
+				return;
+			}
+			tile->moved = grown;
+		}
+		tile->moved[tile->moved_size++] = box;
+	}
+}
+
+/*
+	puts all boxes into the tiles they are in now; only this
+	part is serial, and only boxes that cross tile borders cost
+	anything here. Returns -1 if some boxes couldn't be moved
+	for lack of memory.
+*/
+static int sync_tiles(Boxworld* world) {
+	int ntiles = world->tiles_x*world->tiles_y;
+	world->jobs_failed = 0;
+	parallel(world, find_moved, ntiles);
+	int ret = world->jobs_failed ? -1 : 0;
+	for(int t=0;t<ntiles;t++) {
+		Boxworld_tile* tile = &world->tiles[t];
+		for(int i=0;i<tile->moved_size;i++) {
+			int range[4];
+			tile_range(world, tile->moved[i], range);
+			if(settiles(world, tile->moved[i], range)!=0)
+				ret = -1;
+		}
+	}
+	return ret;
+}
+
+/*
+	takes over the bounds of the world boxes. A tile that got
+	many new boxes, like all of them at the start, is built from
+	scratch rather than repaired.
+*/
+static void update_tile(Boxworld_tile* tile) {
+	Boxnet* net = tile->net;
+	for(int i=0;i<net->boxes_size;i++) {
+		Box* part = net->boxes[i];
+		Boxworld_box* box = part->usrdata;
+		part->posx = box->posx;
+		part->posy = box->posy;
+		part->right = box->right;
+		part->top = box->top;
+	}
+	if(2*tile->added > net->boxes_size)
+		Boxnet_rebuild(net);
+	tile->added = 0;
+}
+
+static void repair_tile(Boxworld* world, int job) {
+	update_tile(&world->tiles[job]);
+	Boxnet_repair(world->tiles[job].net);
+}
+
+// only pairs whose overlap starts in this tile
+static void keep_pair(void* obj1, void* obj2, void* data) {
+	Boxworld_tile* tile = data;
+	Boxworld_box* a = obj1;
+	Boxworld_box* b = obj2;
+	double x = a->posx > b->posx ? a->posx : b->posx;
+	double y = a->posy > b->posy ? a->posy : b->posy;
+	if(tile_x(tile->world, x)!=tile->x || tile_y(tile->world, y)!=tile->y)
+		return;
+	if(tile->pairs_size+2 > tile->pairs_size_max) {
+		Boxworld_box** grown = vector_grow(&tile->world->allocator, tile->pairs,
+									&tile->pairs_size_max, sizeof *grown, 64);
+		if(grown==NULL) {
+			__sync_fetch_and_or(&tile->world->jobs_failed, 1);
+			return;
+		}
+		tile->pairs = grown;
+	}
+	tile->pairs[tile->pairs_size++] = a;
+	tile->pairs[tile->pairs_size++] = b;
+}
+
+static void collide_tile(Boxworld* world, int job) {
+	Boxworld_tile* tile = &world->tiles[job];
+	update_tile(tile);
+	tile->pairs_size = 0;
+	Boxnet_collide(tile->net, keep_pair, tile);
+}
+
+
+
+/*
+	creates a world of tiles_x * tiles_y equally sized tiles
+	covering the rectangle from (x,y) to (right,top). Boxes may
+	also lie outside of it, but then they all end up in the
+	border tiles. Returns NULL if there isn't enough memory.
+*/
+Boxworld* Boxworld_new(double x, double y, double right, double top,
+								int tiles_x, int tiles_y) {
+	return Boxworld_newalloc(x, y, right, top, tiles_x, tiles_y, NULL);
+}
+
+/*
+	like Boxworld_new(), but the world and the nets of its tiles
+	get their memory from allocator, see Boxnet_newalloc().
+*/
+Boxworld* Boxworld_newalloc(double x, double y, double right, double top,
+								int tiles_x, int tiles_y,
+								const Boxnet_allocator* allocator) {
+	assert(right>x && top>y && tiles_x>0 && tiles_y>0);
+	if(allocator==NULL)
+		allocator = &default_allocator;
+	Boxworld* world = mem_alloc(allocator, sizeof *world);
+	if(world==NULL)
+		return NULL;
+	memset(world, 0, sizeof *world);
+	world->allocator = *allocator;
+	world->x = x;
+	world->y = y;
+	world->tilewidth = (right-x)/tiles_x;
+	world->tileheight = (top-y)/tiles_y;
+	world->tiles_x = tiles_x;
+	world->tiles_y = tiles_y;
+	world->threads = 1;
+	world->tiles = mem_alloc(allocator, tiles_x*tiles_y * sizeof *world->tiles);
+	if(world->tiles==NULL) {
+		mem_free(allocator, world, sizeof *world);
+		return NULL;
+	}
+	memset(world->tiles, 0, tiles_x*tiles_y * sizeof *world->tiles);
+	for(int t=0;t<tiles_x*tiles_y;t++) {
+		Boxworld_tile* tile = &world->tiles[t];
+		tile->world = world;
+		tile->x = t%tiles_x;
+		tile->y = t/tiles_x;
+		tile->net = Boxnet_newalloc(allocator);
+		if(tile->net==NULL) {
+			Boxworld_free(world);
+			return NULL;
+		}
+	}
+	return world;
+}
+
+void Boxworld_free(Boxworld* world) {
+	const Boxnet_allocator* a = &world->allocator;
+	for(int t=0;t<world->tiles_x*world->tiles_y;t++) {
+		Boxworld_tile* tile = &world->tiles[t];
+		if(tile->net!=NULL)
+			Boxnet_free(tile->net);
+		mem_free(a, tile->pairs, tile->pairs_size_max * sizeof *tile->pairs);
+		mem_free(a, tile->moved, tile->moved_size_max * sizeof *tile->moved);
+	}
+	for(int i=0;i<world->boxes_size;i++) {
+		Boxworld_box* box = world->boxes[i];
+		free_parts(world, box);
+		mem_free(a, box, sizeof *box);
+	}
+	mem_free(a, world->tiles, world->tiles_x*world->tiles_y * sizeof *world->tiles);
+	mem_free(a, world->boxes, world->boxes_size_max * sizeof *world->boxes);
+	Boxnet_allocator allocator = *a;
+	mem_free(&allocator, world, sizeof *world);
+}
+
+/*
+	number of threads repair and collide run on, including the
+	calling one, at most BOXNET_THREADS. The default is 1. The
+	tiles are distributed dynamically, so more tiles than threads
+	balance better.
+*/
+void Boxworld_setthreads(Boxworld* world, int threads) {
+	world->threads = threads<1 ? 1 : threads>BOXNET_THREADS ? BOXNET_THREADS : threads;
+}
+
+/*
+	returns NULL if there isn't enough memory.
+*/
+Boxworld_box* Boxworld_addbox(Boxworld* world, double x, double y,
+								double right, double top, void* usrdata) {
+	if(world->boxes_size==world->boxes_size_max) {
+		Boxworld_box** boxes = vector_grow(&world->allocator, world->boxes,
+									&world->boxes_size_max, sizeof *boxes, BOXES_SIZE_INIT);
+		if(boxes==NULL)
+			return NULL;
+		world->boxes = boxes;
+	}
+	Boxworld_box* box = mem_alloc(&world->allocator, sizeof *box);
+	if(box==NULL)
+		return NULL;
+	box->posx = x;		box->posy = y;
+	box->right = right;	box->top = top;
+	box->usrdata = usrdata;
+	// no tiles yet
+	box->tiles[0] = box->tiles[1] = 0;
+	box->tiles[2] = box->tiles[3] = -1;
+	box->parts = NULL;
+	int range[4];
+	tile_range(world, box, range);
+	if(settiles(world, box, range)!=0) {
+		mem_free(&world->allocator, box, sizeof *box);
+		return NULL;
+	}
+	box->index = world->boxes_size;
+	world->boxes[world->boxes_size++] = box;
+	return box;
+}
+
+void Boxworld_delbox(Boxworld* world, Boxworld_box* box) {
+	int nx = box->tiles[2]-box->tiles[0]+1;
+	for(int y=box->tiles[1];y<=box->tiles[3];y++)
+		for(int x=box->tiles[0];x<=box->tiles[2];x++)
+			Boxnet_delbox(world->tiles[y*world->tiles_x+x].net,
+							box->parts[(y-box->tiles[1])*nx + x-box->tiles[0]]);
+	free_parts(world, box);
+	int n = box->index;
+	assert(n>=0 && n<world->boxes_size && world->boxes[n]==box);
+	mem_free(&world->allocator, box, sizeof *box);
+	world->boxes_size--;
+	if(n==world->boxes_size)
+		return;
+	world->boxes[n] = world->boxes[world->boxes_size];
+	world->boxes[n]->index = n;
+}
+
+/*
+	moves the boxes that crossed tile borders into their new
+	tiles and repairs all tiles in parallel. Returns -1 if some
+	box couldn't get into a new tile for lack of memory; it then
+	stays in its old tiles and may miss collisions.
+*/
+int Boxworld_repair(Boxworld* world) {
+	int ret = sync_tiles(world);
+	parallel(world, repair_tile, world->tiles_x*world->tiles_y);
+	return ret;
+}
+
+/*
+	repairs like Boxworld_repair(), then finds the collisions of
+	all tiles in parallel. func is called afterwards from the
+	calling thread only, with the usrdata of both boxes, once
+	for every overlapping pair. Returns -1 like Boxworld_repair(),
+	or if pairs were lost for lack of memory.
+*/
+int Boxworld_collide(Boxworld* world, collisionCallback func, void* data) {
+	int ret = sync_tiles(world);
+	world->jobs_failed = 0;
+	parallel(world, collide_tile, world->tiles_x*world->tiles_y);
+	if(world->jobs_failed)
+		ret = -1;
+	for(int t=0;t<world->tiles_x*world->tiles_y;t++) {
+		Boxworld_tile* tile = &world->tiles[t];
+		for(int i=0;i<tile->pairs_size;i+=2)
+			func(tile->pairs[i]->usrdata, tile->pairs[i+1]->usrdata, data);
+	}
+	return ret;
+}
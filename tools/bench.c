@@ -0,0 +1,810 @@
+/*
+	Copyright 2012 Samuel Moll
+	License: AGPLv3
+
+	Benchmark suite for the boxnet broadphase.
+
+	Every scenario generates the same deterministic sequence of
+	frames for every method, so boxnet and the baseline broadphases
+	(brute force, sort-and-sweep, uniform grid) and the tiled
+	Boxworld see identical inputs.
+	The pair counts of all methods are compared with those of brute
+	force, or of sort-and-sweep with --no-brute, which run first;
+	a mismatch is reported and makes the benchmark fail.
+
+	usage: boxnet_bench [-n boxes] [-f frames] [-s scenario]
+	                    [-j threads] [-g size] [-w walks]
+	                    [--no-brute] [--json file] [--quick]
+	                    [--trace file] [--scaling]
+
+	--trace records the boxnet run of the scenario given with -s
+	for tools/replay.c. -j sets the threads of boxnet (see
+	Boxnet_setthreads()) and of the boxworld method, -g the size
+	above which boxnet keeps boxes out of the net (see
+	Boxnet_setgiantsize()), -w the interleaved collision walks
+	(see Boxnet_setwalks()). boxnet always runs with the automatic
+	rebuild (see Boxnet_setautorebuild()).
+	--scaling runs only boxnet, on the scenario given with -s
+	(discrete if none), with a quarter, half and all of the boxes,
+	and compares the repair work per box, then times the repair
+	of all boxes with more and more threads; see scaling() and
+	threadscaling().
+*/
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "boxnet.h"
+#include "boxworld.h"
+
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+
+/*
+	deterministic random numbers (xorshift64*), so that every
+	method sees exactly the same frames.
+*/
+typedef struct Rng {
+	unsigned long long	s;
+} Rng;
+
+static double rng_d(Rng* r) {
+	r->s ^= r->s >> 12;
+	r->s ^= r->s << 25;
+	r->s ^= r->s >> 27;
+	return (double)((r->s * 2685821657736338717ULL) >> 11) / 9007199254740992.;
+}
+
+static double rng_gauss(Rng* r) {
+	double u = rng_d(r) + 1e-12;
+	double v = rng_d(r);
+	return sqrt(-2*log(u)) * cos(6.283185307179586*v);
+}
+
+// reflects x into [0,1]
+static double triangle(double x) {
+	return 2*fabs(0.5*x-floor(0.5*x+0.5));
+}
+
+
+/*
+	scenarios
+*/
+enum {
+	SC_UNIFORM,
+	SC_CLUSTERED,
+	SC_MIXED,
+	SC_STATIC,
+	SC_TELEPORT,
+	SC_DISCRETE,
+	SC_COUNT
+};
+
+static const char* scenario_names[SC_COUNT] = {
+	"uniform", "clustered", "mixed", "static", "teleport", "discrete"
+};
+
+#define NCLUSTERS 16
+
+typedef struct Scene {
+	int			type;
+	int			n;
+	Rng			rng;
+	double*		cx;			// box centres
+	double*		cy;
+	double*		hw;			// half extents
+	double*		hh;
+	double		size;		// typical box size
+	double		clx[NCLUSTERS];
+	double		cly[NCLUSTERS];
+	int			ndis;		// grid resolution for SC_DISCRETE
+	double*		bounds;		// output: 4 doubles per box
+} Scene;
+
+static void Scene_bounds(Scene* sc) {
+	for(int i=0;i<sc->n;i++) {
+		double* b = &sc->bounds[4*i];
+		if(sc->type==SC_DISCRETE) {
+			// snap to the grid; many boxes share coordinates
+			double unit = 1./sc->ndis;
+			b[0] = floor(sc->cx[i]*sc->ndis)*unit;
+			b[1] = floor(sc->cy[i]*sc->ndis)*unit;
+			b[2] = b[0] + floor(sc->hw[i]*2*sc->ndis)*unit;
+			b[3] = b[1] + floor(sc->hh[i]*2*sc->ndis)*unit;
+		} else {
+			b[0] = sc->cx[i]-sc->hw[i];
+			b[1] = sc->cy[i]-sc->hh[i];
+			b[2] = sc->cx[i]+sc->hw[i];
+			b[3] = sc->cy[i]+sc->hh[i];
+		}
+	}
+}
+
+static void Scene_init(Scene* sc, int type, int n) {
+	sc->type = type;
+	sc->n = n;
+	sc->rng.s = 0x9e3779b97f4a7c15ULL ^ (unsigned long long)(type+1)*1000003ULL;
+	sc->cx = malloc(n * sizeof *sc->cx);
+	sc->cy = malloc(n * sizeof *sc->cy);
+	sc->hw = malloc(n * sizeof *sc->hw);
+	sc->hh = malloc(n * sizeof *sc->hh);
+	sc->bounds = malloc(4*n * sizeof *sc->bounds);
+	sc->size = sqrt(1./n);
+	sc->ndis = (int)(0.5*sqrt(n)+1);
+	Rng* r = &sc->rng;
+	for(int c=0;c<NCLUSTERS;c++) {
+		sc->clx[c] = rng_d(r);
+		sc->cly[c] = rng_d(r);
+	}
+	for(int i=0;i<n;i++) {
+		sc->hw[i] = 0.5*sc->size*(0.2+rng_d(r));
+		sc->hh[i] = 0.5*sc->size*(0.2+rng_d(r));
+		if(type==SC_CLUSTERED) {
+			int c = i%NCLUSTERS;
+			sc->cx[i] = triangle(sc->clx[c] + 0.05*rng_gauss(r));
+			sc->cy[i] = triangle(sc->cly[c] + 0.05*rng_gauss(r));
+		} else {
+			sc->cx[i] = rng_d(r);
+			sc->cy[i] = rng_d(r);
+		}
+		if(type==SC_MIXED && i%500==0) {
+			// a few huge boxes, up to half of the world
+			sc->hw[i] = 0.05 + 0.2*rng_d(r);
+			sc->hh[i] = 0.05 + 0.2*rng_d(r);
+		}
+		if(type==SC_DISCRETE) {
+			sc->hw[i] = (rng_d(r)<0.8 ? 0.5 : 0.) / sc->ndis;
+			sc->hh[i] = (rng_d(r)<0.8 ? 0.5 : 0.) / sc->ndis;
+		}
+	}
+	Scene_bounds(sc);
+}
+
+static void Scene_free(Scene* sc) {
+	free(sc->cx);
+	free(sc->cy);
+	free(sc->hw);
+	free(sc->hh);
+	free(sc->bounds);
+}
+
+/*
+	advances the scene by one frame and recomputes bounds[]
+*/
+static void Scene_step(Scene* sc) {
+	Rng* r = &sc->rng;
+	double step = 0.1*sc->size;
+	if(sc->type==SC_CLUSTERED) {
+		for(int c=0;c<NCLUSTERS;c++) {
+			sc->clx[c] = triangle(sc->clx[c] + 0.002*(rng_d(r)-0.5));
+			sc->cly[c] = triangle(sc->cly[c] + 0.002*(rng_d(r)-0.5));
+		}
+	}
+	for(int i=0;i<sc->n;i++) {
+		switch(sc->type) {
+		case SC_STATIC:
+			// only every 20th box moves
+			if(i%20!=0)
+				continue;
+			break;
+		case SC_TELEPORT:
+			if(rng_d(r)<0.02) {
+				sc->cx[i] = rng_d(r);
+				sc->cy[i] = rng_d(r);
+				continue;
+			}
+			break;
+		case SC_CLUSTERED: {
+			// drift towards the own cluster centre
+			int c = i%NCLUSTERS;
+			sc->cx[i] += 0.02*(sc->clx[c]-sc->cx[i]);
+			sc->cy[i] += 0.02*(sc->cly[c]-sc->cy[i]);
+			break;
+		}
+		case SC_DISCRETE:
+			step = 1.5/sc->ndis;
+			break;
+		}
+		sc->cx[i] = triangle(sc->cx[i] + step*(rng_d(r)-0.5));
+		sc->cy[i] = triangle(sc->cy[i] + step*(rng_d(r)-0.5));
+	}
+	Scene_bounds(sc);
+}
+
+
+/*
+	broadphase methods; all of them report overlapping pairs
+	(inclusive bounds, like boxnet) and count them.
+*/
+enum { PH_UPDATE, PH_PREPARE, PH_COLLIDE, PH_COUNT };
+static const char* phase_names[PH_COUNT] = { "update", "prepare", "collide" };
+
+typedef struct Method {
+	const char*	name;
+	void*		(*init)(const double* bounds, int n);
+	void		(*update)(void* m, const double* bounds, int n);
+	void		(*prepare)(void* m);
+	long		(*collide)(void* m);
+	void		(*free)(void* m);
+	// optional; copies the accumulated counters, or resets them
+	void		(*counters)(void* m, Boxnet_stats* total, int reset);
+} Method;
+
+static int overlap(const double* a, const double* b) {
+	return a[0] <= b[2] && a[2] >= b[0] && a[1] <= b[3] && a[3] >= b[1];
+}
+
+
+// boxnet
+
+typedef struct BnState {
+	Boxnet*		net;
+	Box**		boxes;
+	long		pairs;
+} BnState;
+
+// see --trace
+static const char* trace = NULL;
+// see -j
+static int threads = 1;
+// see -g
+static double giantsize = 0;
+// see -w
+static int walks = 1;
+
+static void* bn_init(const double* b, int n) {
+	BnState* s = malloc(sizeof *s);
+	s->net = Boxnet_new();
+	Boxnet_setthreads(s->net, threads);
+	Boxnet_setwalks(s->net, walks);
+	if(trace!=NULL && Boxnet_trace_start(s->net, trace)!=0)
+		fprintf(stderr,"can't record a trace to \"%s\"\n",trace);
+	Boxnet_setgiantsize(s->net, giantsize);
+	Boxnet_setautorebuild(s->net, 1);
+	s->boxes = malloc(n * sizeof *s->boxes);
+	for(int i=0;i<n;i++)
+		s->boxes[i] = Boxnet_addbox(s->net, b[4*i],b[4*i+1],b[4*i+2],b[4*i+3],
+									i>0 ? s->boxes[i-1] : NULL, NULL);
+	Boxnet_rebuild(s->net);
+	return s;
+}
+static void bn_update(void* m, const double* b, int n) {
+	BnState* s = m;
+	for(int i=0;i<n;i++) {
+		Box* box = s->boxes[i];
+		box->posx  = b[4*i];
+		box->posy  = b[4*i+1];
+		box->right = b[4*i+2];
+		box->top   = b[4*i+3];
+	}
+}
+static void bn_prepare(void* m) {
+	Boxnet_repair(((BnState*)m)->net);
+}
+static void bn_callback(void* obj1, void* obj2, void* data) {
+	((BnState*)data)->pairs++;
+}
+static long bn_collide(void* m) {
+	BnState* s = m;
+	s->pairs = 0;
+	Boxnet_collide(s->net, bn_callback, s);
+	return s->pairs;
+}
+static void bn_counters(void* m, Boxnet_stats* total, int reset) {
+	BnState* s = m;
+	if(reset)
+		Boxnet_resetstats(s->net);
+	else
+		Boxnet_getstats(s->net, NULL, total);
+}
+static void bn_free(void* m) {
+	BnState* s = m;
+	Boxnet_free(s->net);
+	free(s->boxes);
+	free(s);
+}
+
+
+// boxworld; the tiles split the whole scene, so the huge boxes
+// of SC_MIXED and the border crossings are tested as well
+
+#define BW_TILES 4
+
+
+typedef struct BwState {
+	Boxworld*		world;
+	Boxworld_box**	boxes;
+	long			pairs;
+} BwState;
+
+static void* bw_init(const double* b, int n) {
+	BwState* s = malloc(sizeof *s);
+	s->world = Boxworld_new(0, 0, 1, 1, BW_TILES, BW_TILES);
+	Boxworld_setthreads(s->world, threads);
+	s->boxes = malloc(n * sizeof *s->boxes);
+	for(int i=0;i<n;i++)
+		s->boxes[i] = Boxworld_addbox(s->world, b[4*i],b[4*i+1],b[4*i+2],b[4*i+3], NULL);
+	return s;
+}
+static void bw_update(void* m, const double* b, int n) {
+	BwState* s = m;
+	for(int i=0;i<n;i++) {
+		Boxworld_box* box = s->boxes[i];
+		box->posx  = b[4*i];
+		box->posy  = b[4*i+1];
+		box->right = b[4*i+2];
+		box->top   = b[4*i+3];
+	}
+}
+static void bw_prepare(void* m) {
+	Boxworld_repair(((BwState*)m)->world);
+}
+static void bw_callback(void* obj1, void* obj2, void* data) {
+	((BwState*)data)->pairs++;
+}
+static long bw_collide(void* m) {
+	BwState* s = m;
+	s->pairs = 0;
+	Boxworld_collide(s->world, bw_callback, s);
+	return s->pairs;
+}
+static void bw_free(void* m) {
+	BwState* s = m;
+	Boxworld_free(s->world);
+	free(s->boxes);
+	free(s);
+}
+
+
+// brute force
+
+typedef struct BfState {
+	const double*	b;
+	int				n;
+} BfState;
+
+static void* bf_init(const double* b, int n) {
+	BfState* s = malloc(sizeof *s);
+	s->b = b;
+	s->n = n;
+	return s;
+}
+static void bf_update(void* m, const double* b, int n) {
+	((BfState*)m)->b = b;
+}
+static void bf_prepare(void* m) {}
+static long bf_collide(void* m) {
+	BfState* s = m;
+	long pairs = 0;
+	for(int i=0;i<s->n;i++)
+		for(int j=i+1;j<s->n;j++)
+			pairs += overlap(&s->b[4*i], &s->b[4*j]);
+	return pairs;
+}
+static void bf_free(void* m) {
+	free(m);
+}
+
+
+// sort and sweep; the order is kept between frames and
+// re-sorted with insertion sort, which is fast for coherent motion
+
+typedef struct SapState {
+	double*		b;
+	int*		order;
+	int			n;
+} SapState;
+
+static void* sap_init(const double* b, int n) {
+	SapState* s = malloc(sizeof *s);
+	s->n = n;
+	s->b = malloc(4*n * sizeof *s->b);
+	memcpy(s->b, b, 4*n * sizeof *s->b);
+	s->order = malloc(n * sizeof *s->order);
+	for(int i=0;i<n;i++)
+		s->order[i] = i;
+	return s;
+}
+static void sap_update(void* m, const double* b, int n) {
+	memcpy(((SapState*)m)->b, b, 4*n * sizeof *b);
+}
+static void sap_prepare(void* m) {
+	SapState* s = m;
+	for(int i=1;i<s->n;i++) {
+		int cur = s->order[i];
+		double x = s->b[4*cur];
+		int j = i;
+		while(j>0 && s->b[4*s->order[j-1]] > x) {
+			s->order[j] = s->order[j-1];
+			j--;
+		}
+		s->order[j] = cur;
+	}
+}
+static long sap_collide(void* m) {
+	SapState* s = m;
+	long pairs = 0;
+	for(int i=0;i<s->n;i++) {
+		const double* a = &s->b[4*s->order[i]];
+		for(int j=i+1;j<s->n;j++) {
+			const double* c = &s->b[4*s->order[j]];
+			if(c[0] > a[2])
+				break;
+			pairs += (a[1] <= c[3] && a[3] >= c[1]);
+		}
+	}
+	return pairs;
+}
+static void sap_free(void* m) {
+	SapState* s = m;
+	free(s->b);
+	free(s->order);
+	free(s);
+}
+
+
+// uniform grid over [0,1]^2; a pair is only reported in the cell
+// that contains the lower left corner of the overlap region
+
+typedef struct GridState {
+	const double*	b;
+	int				n;
+	int				res;
+	int*			start;		// res*res+1 cell offsets
+	int*			fill;
+	int*			items;
+	int				items_max;
+} GridState;
+
+static int grid_cell(GridState* s, double x) {
+	int c = (int)(x*s->res);
+	return c < 0 ? 0 : (c >= s->res ? s->res-1 : c);
+}
+
+static void* grid_init(const double* b, int n) {
+	GridState* s = malloc(sizeof *s);
+	s->b = b;
+	s->n = n;
+	s->res = (int)(0.5*sqrt(n)+1);
+	s->start = malloc((s->res*s->res+1) * sizeof *s->start);
+	s->fill = malloc(s->res*s->res * sizeof *s->fill);
+	s->items_max = 4*n;
+	s->items = malloc(s->items_max * sizeof *s->items);
+	return s;
+}
+static void grid_update(void* m, const double* b, int n) {
+	((GridState*)m)->b = b;
+}
+static void grid_prepare(void* m) {
+	// counting sort of all (box,cell) entries
+	GridState* s = m;
+	int ncells = s->res*s->res;
+	memset(s->start, 0, (ncells+1) * sizeof *s->start);
+	long total = 0;
+	for(int i=0;i<s->n;i++) {
+		const double* b = &s->b[4*i];
+		for(int y=grid_cell(s,b[1]);y<=grid_cell(s,b[3]);y++)
+			for(int x=grid_cell(s,b[0]);x<=grid_cell(s,b[2]);x++) {
+				s->start[y*s->res+x+1]++;
+				total++;
+			}
+	}
+	if(total > s->items_max) {
+		s->items_max = 2*total;
+		s->items = realloc(s->items, s->items_max * sizeof *s->items);
+	}
+	for(int c=0;c<ncells;c++)
+		s->start[c+1] += s->start[c];
+	int* fill = s->fill;
+	memcpy(fill, s->start, ncells * sizeof *fill);
+	for(int i=0;i<s->n;i++) {
+		const double* b = &s->b[4*i];
+		for(int y=grid_cell(s,b[1]);y<=grid_cell(s,b[3]);y++)
+			for(int x=grid_cell(s,b[0]);x<=grid_cell(s,b[2]);x++)
+				s->items[fill[y*s->res+x]++] = i;
+	}
+}
+static long grid_collide(void* m) {
+	GridState* s = m;
+	long pairs = 0;
+	for(int c=0;c<s->res*s->res;c++) {
+		int cx = c%s->res;
+		int cy = c/s->res;
+		for(int i=s->start[c];i<s->start[c+1];i++) {
+			const double* a = &s->b[4*s->items[i]];
+			for(int j=i+1;j<s->start[c+1];j++) {
+				const double* o = &s->b[4*s->items[j]];
+				if(!overlap(a,o))
+					continue;
+				double lx = a[0] > o[0] ? a[0] : o[0];
+				double ly = a[1] > o[1] ? a[1] : o[1];
+				pairs += grid_cell(s,lx)==cx && grid_cell(s,ly)==cy;
+			}
+		}
+	}
+	return pairs;
+}
+static void grid_free(void* m) {
+	GridState* s = m;
+	free(s->start);
+	free(s->fill);
+	free(s->items);
+	free(s);
+}
+
+
+static const Method methods[] = {
+	{ "boxnet", bn_init, bn_update, bn_prepare, bn_collide, bn_free, bn_counters },
+	{ "sort_and_sweep", sap_init, sap_update, sap_prepare, sap_collide, sap_free, NULL },
+	{ "uniform_grid", grid_init, grid_update, grid_prepare, grid_collide, grid_free, NULL },
+	{ "boxworld", bw_init, bw_update, bw_prepare, bw_collide, bw_free, NULL },
+	{ "brute_force", bf_init, bf_update, bf_prepare, bf_collide, bf_free, NULL },
+};
+#define NMETHODS ((int)(sizeof methods / sizeof methods[0]))
+
+
+typedef struct Result {
+	int			scenario;
+	int			method;
+	double		build;				// initial build, not part of the frames
+	double		time[PH_COUNT];		// summed over all frames
+	long		pairs;				// summed over all frames
+	int			mismatch;			// first frame with a wrong pair count, or -1
+	Boxnet_stats	counters;		// only for boxnet, and only if the
+									// library counts (BOXNET_STATS)
+} Result;
+
+/*
+	runs one method on one scenario. If ref!=NULL, the pair count of
+	every frame is stored in ref[] if store is set, and compared with
+	ref[] otherwise.
+*/
+static void run(Result* res, int scenario, int method, int n, int frames,
+				long* ref, int store) {
+	const Method* m = &methods[method];
+	Scene sc;
+	Scene_init(&sc, scenario, n);
+	res->scenario = scenario;
+	res->method = method;
+	res->pairs = 0;
+	res->mismatch = -1;
+	for(int p=0;p<PH_COUNT;p++)
+		res->time[p] = 0;
+	double t = now();
+	void* state = m->init(sc.bounds, n);
+	m->prepare(state);
+	res->build = now()-t;
+	memset(&res->counters, 0, sizeof res->counters);
+	if(m->counters!=NULL)
+		m->counters(state, NULL, 1);
+	for(int f=0;f<frames;f++) {
+		Scene_step(&sc);
+		double t0 = now();
+		m->update(state, sc.bounds, n);
+		double t1 = now();
+		m->prepare(state);
+		double t2 = now();
+		long pairs = m->collide(state);
+		double t3 = now();
+		res->time[PH_UPDATE] += t1-t0;
+		res->time[PH_PREPARE] += t2-t1;
+		res->time[PH_COLLIDE] += t3-t2;
+		res->pairs += pairs;
+		if(ref==NULL)
+			continue;
+		if(store)
+			ref[f] = pairs;
+		else if(ref[f]!=pairs && res->mismatch<0)
+			res->mismatch = f;
+	}
+	if(m->counters!=NULL)
+		m->counters(state, &res->counters, 0);
+	m->free(state);
+	Scene_free(&sc);
+}
+
+
+/*
+	times the repair of all n boxes with 1, 2, 4, ... threads, up
+	to -j (BOXNET_THREADS if not given), and prints the speedup
+	over one thread. Only the syncing and the scan for work are
+	split between the threads (see Boxnet_setthreads()), so the
+	speedup is bounded by the serial solving, and there is none
+	on a single core; nothing is judged.
+*/
+static void threadscaling(int scenario, int n, int frames) {
+	int saved = threads;
+	int most = threads>1 ? threads : BOXNET_THREADS;
+	double single = 0;
+	printf("%-10s %10s %10s %10s %10s\n", "scenario", "boxes",
+			"threads", "repair", "speedup");
+	for(threads=1;threads<=most;threads*=2) {
+		Result r;
+		run(&r, scenario, 0, n, frames, NULL, 0);
+		double perbox = 1./((double)n*frames);
+		if(threads==1)
+			single = r.time[PH_PREPARE];
+		printf("%-10s %10i %10i %10.1f %10.2f\n", scenario_names[scenario], n,
+				threads, 1e9*r.time[PH_PREPARE]*perbox,
+				r.time[PH_PREPARE]>0 ? single/r.time[PH_PREPARE] : 0);
+	}
+	threads = saved;
+}
+
+
+/*
+	checks that the repair takes linear time: the scene keeps its
+	density and motion at every size, so the work per box has to
+	stay the same. Times are printed, but too noisy to judge by;
+	the flips and slides decide, if the library counts them
+	(BOXNET_STATS). Returns 1 if the work per box at n boxes is
+	more than twice that at n/4, 77 (skipped, for ctest) if the
+	library doesn't count.
+*/
+static int scaling(int scenario, int n, int frames) {
+	printf("%-10s %10s %10s %10s %10s\n", "scenario", "boxes",
+			"repair", "flips", "slides");
+	double first = 0, last = 0;
+	for(int k=4;k>=1;k/=2) {
+		Result r;
+		int size = n/k>0 ? n/k : 1;
+		run(&r, scenario, 0, size, frames, NULL, 0);
+		double perbox = 1./((double)size*frames);
+		double work = (r.counters.flips + r.counters.slides)*perbox;
+		printf("%-10s %10i %10.1f %10.3f %10.3f\n", scenario_names[scenario], size,
+				1e9*r.time[PH_PREPARE]*perbox, r.counters.flips*perbox,
+				r.counters.slides*perbox);
+		if(k==4)
+			first = work;
+		last = work;
+	}
+	threadscaling(scenario, n, frames);
+	if(first==0) {
+		printf("skipped: the library doesn't count flips and slides (BOXNET_STATS)\n");
+		return 77;
+	}
+	if(last > 2*first) {
+		printf("ERROR: the repair work per box grows with the number of boxes\n");
+		return 1;
+	}
+	return 0;
+}
+
+
+int main(int argc, char** argv) {
+	int n = 10000;
+	int frames = 100;
+	int only = -1;
+	int brute = 1;
+	int scale = 0;
+	const char* json = NULL;
+	for(int i=1;i<argc;i++) {
+		if(!strcmp(argv[i],"-n") && i+1<argc)
+			n = atoi(argv[++i]);
+		else if(!strcmp(argv[i],"-f") && i+1<argc)
+			frames = atoi(argv[++i]);
+		else if(!strcmp(argv[i],"-s") && i+1<argc) {
+			i++;
+			for(int s=0;s<SC_COUNT;s++)
+				if(!strcmp(argv[i],scenario_names[s]))
+					only = s;
+			if(only<0) {
+				fprintf(stderr,"unknown scenario \"%s\"\n",argv[i]);
+				return 2;
+			}
+		} else if(!strcmp(argv[i],"-j") && i+1<argc)
+			threads = atoi(argv[++i]);
+		else if(!strcmp(argv[i],"-g") && i+1<argc)
+			giantsize = atof(argv[++i]);
+		else if(!strcmp(argv[i],"-w") && i+1<argc)
+			walks = atoi(argv[++i]);
+		else if(!strcmp(argv[i],"--no-brute"))
+			brute = 0;
+		else if(!strcmp(argv[i],"--json") && i+1<argc)
+			json = argv[++i];
+		else if(!strcmp(argv[i],"--trace") && i+1<argc)
+			trace = argv[++i];
+		else if(!strcmp(argv[i],"--scaling"))
+			scale = 1;
+		else if(!strcmp(argv[i],"--quick")) {
+			n = 1000;
+			frames = 10;
+		} else {
+			fprintf(stderr,"usage: %s [-n boxes] [-f frames] [-s scenario] "
+						"[-j threads] [-g size] [-w walks] [--no-brute] [--json file] [--quick] "
+						"[--trace file] [--scaling]\n", argv[0]);
+			return 2;
+		}
+	}
+	if(n<1 || frames<1) {
+		fprintf(stderr,"need at least one box and one frame\n");
+		return 2;
+	}
+	if(trace!=NULL && only<0) {
+		fprintf(stderr,"--trace needs a scenario (-s)\n");
+		return 2;
+	}
+	if(scale)
+		return scaling(only>=0 ? only : SC_DISCRETE, n, frames);
+
+	int nmethods = brute ? NMETHODS : NMETHODS-1;
+	// the reference for the pair counts
+	int reference = brute ? NMETHODS-1 : 1;
+	Result results[SC_COUNT*NMETHODS];
+	int nresults = 0;
+	int failed = 0;
+	long* ref = malloc(frames * sizeof *ref);
+
+	printf("%-10s %-15s %10s %10s %10s %10s %10s %12s\n", "scenario", "method",
+			"build", "update", "prepare", "collide", "ns/box", "pairs/s");
+	for(int s=0;s<SC_COUNT;s++) {
+		if(only>=0 && s!=only)
+			continue;
+		for(int k=0;k<nmethods;k++) {
+			int m = k==0 ? reference : k<=reference ? k-1 : k;
+			Result* r = &results[nresults++];
+			run(r, s, m, n, frames, ref, m==reference);
+			double total = r->time[PH_UPDATE]+r->time[PH_PREPARE]+r->time[PH_COLLIDE];
+			double perbox = 1e9/((double)n*frames);
+			printf("%-10s %-15s %10.1f %10.1f %10.1f %10.1f %10.1f %12.4g\n",
+					scenario_names[s], methods[m].name, r->build*1e9/n,
+					r->time[PH_UPDATE]*perbox, r->time[PH_PREPARE]*perbox,
+					r->time[PH_COLLIDE]*perbox, total*perbox,
+					r->pairs/total);
+			if(r->mismatch>=0) {
+				printf("ERROR: %s and %s disagree on the pair count in frame %i\n",
+						methods[m].name, methods[reference].name, r->mismatch);
+				failed = 1;
+			}
+		}
+	}
+	free(ref);
+
+	if(json!=NULL) {
+		FILE* f = fopen(json,"w");
+		if(f==NULL) {
+			fprintf(stderr,"can't open \"%s\"\n",json);
+			return 2;
+		}
+		fprintf(f,"{\n  \"boxes\": %i,\n  \"frames\": %i,\n  \"results\": [\n",n,frames);
+		for(int i=0;i<nresults;i++) {
+			Result* r = &results[i];
+			double total = r->time[PH_UPDATE]+r->time[PH_PREPARE]+r->time[PH_COLLIDE];
+			fprintf(f,"    {\"scenario\": \"%s\", \"method\": \"%s\", "
+					"\"build_ns_per_box\": %.3f, \"ns_per_box\": {",
+					scenario_names[r->scenario], methods[r->method].name, 1e9*r->build/n);
+			for(int p=0;p<PH_COUNT;p++)
+				fprintf(f,"\"%s\": %.3f, ",phase_names[p],
+						1e9*r->time[p]/((double)n*frames));
+			fprintf(f,"\"total\": %.3f}, \"pairs\": %li, \"pairs_per_s\": %.6g, "
+					"\"match\": %s",
+					1e9*total/((double)n*frames), r->pairs, r->pairs/total,
+					r->mismatch<0 ? "true" : "false");
+			if(methods[r->method].counters!=NULL) {
+				Boxnet_stats* c = &r->counters;
+				fprintf(f,", \"counters_per_frame\": {\"flips\": %.1f, \"slides\": %.1f, "
+						"\"solve_conn\": %.1f, \"synced\": %.1f, \"prep_flips\": %.1f, "
+						"\"junctions\": %.1f, \"candidates\": %.1f, \"repair_queue_peak\": %li, "
+						"\"rebuilds\": %.1f}",
+						(double)c->flips/frames, (double)c->slides/frames,
+						(double)c->solve_conn/frames, (double)c->synced/frames,
+						(double)c->prep_flips/frames,
+						(double)c->junctions/frames, (double)c->candidates/frames,
+						c->repair_queue_peak, (double)c->rebuilds/frames);
+			}
+			fprintf(f,"}%s\n", i+1<nresults ? "," : "");
+		}
+		fprintf(f,"  ]\n}\n");
+		fclose(f);
+	}
+	return failed;
+}
@@ -0,0 +1,303 @@
+/*
+	Copyright 2012 Samuel Moll
+	License: AGPLv3
+
+	Replays a trace recorded with Boxnet_trace_start() on a fresh
+	net and times every frame (everything up to and including a
+	Boxnet_collide() or Boxnet_collide_swept() call). The pair count of every frame is
+	compared with the recorded one; a mismatch makes the replay
+	fail. Traces of nets that optimize with a time budget
+	(Boxnet_setoptimizebudget()) don't replay the exact same net
+	structure, but still have to give the same pairs.
+
+	usage: boxnet_replay [-v] trace
+	       -v  print one line per frame
+*/
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "boxnet.h"
+
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+static int read_arg(FILE* f, void* arg, size_t size) {
+	return fread(arg, size, 1, f)==1;
+}
+
+static void count(void* obj1, void* obj2, void* data) {
+	(*(uint64_t*)data)++;
+}
+
+static void count_swept(void* obj1, void* obj2, double toi, void* data) {
+	(*(uint64_t*)data)++;
+}
+
+static int compare_d(const void* a, const void* b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return x<y ? -1 : x>y;
+}
+
+
+int main(int argc, char** argv) {
+	int verbose = 0;
+	const char* filename = NULL;
+	int usage = 0;
+	for(int i=1;i<argc;i++) {
+		if(!strcmp(argv[i],"-v"))
+			verbose = 1;
+		else if(filename==NULL && argv[i][0]!='-')
+			filename = argv[i];
+		else
+			usage = 1;
+	}
+	if(filename==NULL || usage) {
+		fprintf(stderr,"usage: %s [-v] trace\n", argv[0]);
+		return 2;
+	}
+	FILE* f = fopen(filename,"rb");
+	if(f==NULL) {
+		fprintf(stderr,"can't open \"%s\"\n",filename);
+		return 2;
+	}
+	char magic[8];
+	uint32_t header[2];
+	if(!read_arg(f, magic, sizeof magic) || !read_arg(f, header, sizeof header) ||
+			memcmp(magic, BOXNET_TRACE_MAGIC, sizeof magic)!=0 ||
+			header[0]!=BOXNET_TRACE_VERSION || header[1]!=0x01020304) {
+		fprintf(stderr,"\"%s\" is not a boxnet trace of this version and byte order\n",
+				filename);
+		return 2;
+	}
+
+	Boxnet* net = Boxnet_new();
+	Box** boxes = NULL;				// by id
+	uint32_t boxes_size_max = 0;
+	double* times = NULL;			// by frame
+	int frames = 0, frames_max = 0;
+	int moved = 0;
+	int mismatches = 0;
+	int error = 0;
+	double t = now();
+	Box* lookup(uint32_t id) {
+		return id<boxes_size_max ? boxes[id] : NULL;
+	}
+	// a frame ends with a collide that found pairs
+	void end_frame(uint64_t pairs, uint64_t recorded) {
+		double t1 = now();
+		if(frames==frames_max) {
+			frames_max = frames_max>0 ? 2*frames_max : 256;
+			times = realloc(times, frames_max * sizeof *times);
+		}
+		times[frames] = t1-t;
+		if(verbose)
+			printf("frame %6i  boxes %8i  moved %8i  pairs %10llu  %10.3f ms\n",
+					frames, net->boxes_size + net->giants_size, moved,
+					(unsigned long long)pairs, 1e3*times[frames]);
+		if(pairs!=recorded) {
+			printf("ERROR: frame %i gives %llu pairs, recorded were %llu\n",
+					frames, (unsigned long long)pairs, (unsigned long long)recorded);
+			mismatches++;
+		}
+		frames++;
+		moved = 0;
+		t = now();
+	}
+	int op;
+	while(!error && (op = fgetc(f))!=EOF) {
+		uint32_t id;
+		int32_t i[2];
+		double d[4];
+		uint64_t pairs, recorded;
+		Box* box;
+		switch(op) {
+		case BOXNET_TRACE_ADD:
+			if(!read_arg(f,&id,sizeof id) || !read_arg(f,i,sizeof i[0]) ||
+					!read_arg(f,d,sizeof d)) {
+				error = 1;
+				break;
+			}
+			if(id>=boxes_size_max) {
+				uint32_t size = boxes_size_max>0 ? 2*boxes_size_max : 1024;
+				while(id>=size)
+					size *= 2;
+				boxes = realloc(boxes, size * sizeof *boxes);
+				memset(boxes+boxes_size_max, 0, (size-boxes_size_max) * sizeof *boxes);
+				boxes_size_max = size;
+			}
+			if(boxes[id]!=NULL || (i[0]>=0 && lookup(i[0])==NULL)) {
+				error = 1;
+				break;
+			}
+			boxes[id] = Boxnet_addbox(net, d[0], d[1], d[2], d[3],
+									i[0]>=0 ? lookup(i[0]) : NULL, NULL);
+			break;
+		case BOXNET_TRACE_DEL:
+			if(!read_arg(f,&id,sizeof id) || (box = lookup(id))==NULL) {
+				error = 1;
+				break;
+			}
+			Boxnet_delbox(net, box);
+			boxes[id] = NULL;
+			break;
+		case BOXNET_TRACE_MOVE:
+			if(!read_arg(f,&id,sizeof id) || !read_arg(f,d,sizeof d) ||
+					(box = lookup(id))==NULL) {
+				error = 1;
+				break;
+			}
+			box->posx = d[0];	box->posy = d[1];
+			box->right = d[2];	box->top = d[3];
+			moved++;
+			break;
+		case BOXNET_TRACE_MOVEBOX:
+			if(!read_arg(f,&id,sizeof id) || !read_arg(f,d,sizeof d) ||
+					(box = lookup(id))==NULL) {
+				error = 1;
+				break;
+			}
+			Boxnet_movebox(net, box, d[0], d[1], d[2], d[3]);
+			moved++;
+			break;
+		case BOXNET_TRACE_REPAIR:
+			Boxnet_repair(net);
+			break;
+		case BOXNET_TRACE_REPAIRSOME:
+			if(!read_arg(f,i,sizeof i)) {
+				error = 1;
+				break;
+			}
+			if(i[1])
+				Boxnet_repairsome(net, i[0], 0);
+			else
+				Boxnet_repairresume(net, i[0], 0);
+			break;
+		case BOXNET_TRACE_COLLIDE:
+			if(!read_arg(f,&recorded,sizeof recorded)) {
+				error = 1;
+				break;
+			}
+			pairs = 0;
+			Boxnet_collide(net, count, &pairs);
+			end_frame(pairs, recorded);
+			break;
+		case BOXNET_TRACE_SWEEP:
+			if(!read_arg(f,&id,sizeof id) || !read_arg(f,d,sizeof d) ||
+					(box = lookup(id))==NULL) {
+				error = 1;
+				break;
+			}
+			Boxnet_sweep(net, box, d[0], d[1], d[2], d[3]);
+			moved++;
+			break;
+		case BOXNET_TRACE_COLLIDESWEPT:
+			if(!read_arg(f,&recorded,sizeof recorded)) {
+				error = 1;
+				break;
+			}
+			pairs = 0;
+			Boxnet_collide_swept(net, count_swept, &pairs);
+			end_frame(pairs, recorded);
+			break;
+		case BOXNET_TRACE_REBUILD:
+			Boxnet_rebuild(net);
+			break;
+		case BOXNET_TRACE_REORDER:
+			Boxnet_reorder(net);
+			break;
+		case BOXNET_TRACE_OPTIMIZE:
+		case BOXNET_TRACE_OPTIMIZEBUDGET:
+			if(!read_arg(f,i,sizeof i[0]) || !read_arg(f,d,sizeof d[0])) {
+				error = 1;
+				break;
+			}
+			if(op==BOXNET_TRACE_OPTIMIZE)
+				Boxnet_optimize(net, i[0], d[0]);
+			else
+				Boxnet_setoptimizebudget(net, i[0], d[0]);
+			break;
+		case BOXNET_TRACE_REORDERINTERVAL:
+			if(!read_arg(f,i,sizeof i[0])) {
+				error = 1;
+				break;
+			}
+			Boxnet_setreorderinterval(net, i[0]);
+			break;
+		case BOXNET_TRACE_AUTOREBUILD:
+			if(!read_arg(f,i,sizeof i[0])) {
+				error = 1;
+				break;
+			}
+			Boxnet_setautorebuild(net, i[0]);
+			break;
+		case BOXNET_TRACE_GIANTSIZE:
+			if(!read_arg(f,d,sizeof d[0])) {
+				error = 1;
+				break;
+			}
+			Boxnet_setgiantsize(net, d[0]);
+			break;
+		case BOXNET_TRACE_PERIODIC:
+			if(!read_arg(f,d,sizeof d)) {
+				error = 1;
+				break;
+			}
+			Boxnet_setperiodic(net, d[0], d[1], d[2], d[3]);
+			break;
+		case BOXNET_TRACE_QUALITYPOLICY:
+			if(!read_arg(f,i,sizeof i) || !read_arg(f,d,sizeof d[0])) {
+				error = 1;
+				break;
+			}
+			Boxnet_setqualitypolicy(net, i[0], d[0], i[1]);
+			break;
+		case BOXNET_TRACE_MARGIN:
+			if(!read_arg(f,&id,sizeof id) || !read_arg(f,d,sizeof d[0]) ||
+					(box = lookup(id))==NULL) {
+				error = 1;
+				break;
+			}
+			Boxnet_setmargin(net, box, d[0]);
+			break;
+		default:
+			error = 1;
+		}
+	}
+	fclose(f);
+	if(error) {
+		fprintf(stderr,"\"%s\" is corrupt after frame %i\n", filename, frames);
+		return 2;
+	}
+
+	if(frames>0) {
+		double total = 0;
+		int slowest = 0;
+		for(int k=0;k<frames;k++) {
+			total += times[k];
+			if(times[k]>times[slowest])
+				slowest = k;
+		}
+		double max = times[slowest];
+		qsort(times, frames, sizeof *times, compare_d);
+		printf("%i frames, %i boxes at the end\n", frames,
+				net->boxes_size + net->giants_size);
+		printf("total %.3f ms, mean %.3f ms, median %.3f ms, "
+				"max %.3f ms (frame %i)\n", 1e3*total, 1e3*total/frames,
+				1e3*times[frames/2], 1e3*max, slowest);
+	} else {
+		printf("no frames\n");
+	}
+	free(times);
+	free(boxes);
+	Boxnet_free(net);
+	return mismatches>0;
+}
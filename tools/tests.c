@@ -0,0 +1,1573 @@
+/*
+	Copyright 2012 Samuel Moll
+	License: AGPLv3
+
+	Correctness tests for the features around the net, run by
+	ctest (see tools/CMakeLists.txt). Every test moves random
+	boxes around, checks the pairs boxnet reports against brute
+	force and returns nonzero on a mismatch.
+
+	usage: boxnet_test name
+*/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "boxnet.h"
+
+
+/*
+	deterministic random numbers (xorshift64*), like in bench.c
+*/
+typedef struct Rng {
+	unsigned long long	s;
+} Rng;
+
+static double rng_d(Rng* r) {
+	r->s ^= r->s >> 12;
+	r->s ^= r->s << 25;
+	r->s ^= r->s >> 27;
+	return (double)((r->s * 2685821657736338717ULL) >> 11) / 9007199254740992.;
+}
+
+
+/*
+	the objects of a test: their boxes in the net and the bounds
+	they should have there, in the unit square.
+*/
+typedef struct Obj {
+	int			index;		// in World.objs
+	Box*		box;		// NULL if deleted
+	double		b[4];		// x, y, right, top
+	int			dying;		// deleted by a callback
+} Obj;
+
+typedef struct World {
+	Rng			rng;
+	Obj*		objs;
+	int			n;
+	double		size;		// typical box size
+} World;
+
+static void random_bounds(World* w, double* b) {
+	double hw = 0.5*w->size*(0.2+rng_d(&w->rng));
+	double hh = 0.5*w->size*(0.2+rng_d(&w->rng));
+	double cx = rng_d(&w->rng), cy = rng_d(&w->rng);
+	b[0] = cx-hw;	b[1] = cy-hh;
+	b[2] = cx+hw;	b[3] = cy+hh;
+}
+
+static void World_init(World* w, int n, unsigned long long seed) {
+	w->rng.s = 0x9e3779b97f4a7c15ULL ^ seed;
+	w->n = n;
+	w->size = sqrt(1./n);
+	w->objs = calloc(n, sizeof *w->objs);
+	for(int i=0;i<n;i++) {
+		w->objs[i].index = i;
+		random_bounds(w, w->objs[i].b);
+	}
+}
+
+// adds the boxes of all objects to net
+static void World_add(World* w, Boxnet* net) {
+	for(int i=0;i<w->n;i++) {
+		Obj* o = &w->objs[i];
+		o->box = Boxnet_addbox(net, o->b[0], o->b[1], o->b[2], o->b[3], NULL, o);
+	}
+}
+
+// moves bounds b by up to step box sizes
+static void move_bounds(World* w, double* b, double step) {
+	double dx = step*w->size*(rng_d(&w->rng)-0.5);
+	double dy = step*w->size*(rng_d(&w->rng)-0.5);
+	b[0] += dx;	b[2] += dx;
+	b[1] += dy;	b[3] += dy;
+}
+
+static void World_free(World* w) {
+	free(w->objs);
+}
+
+
+/*
+	pairs of objects, as index pairs packed into one number with
+	the smaller index first, so that they can be sorted.
+*/
+typedef struct Pairs {
+	long long*	pairs;
+	int			size;
+	int			size_max;
+	int			n;			// number of objects
+} Pairs;
+
+static void Pairs_add(Pairs* p, int i, int j) {
+	if(p->size==p->size_max) {
+		p->size_max = p->size_max>0 ? 2*p->size_max : 1024;
+		p->pairs = realloc(p->pairs, p->size_max * sizeof *p->pairs);
+	}
+	p->pairs[p->size++] = i<j ? (long long)i*p->n + j : (long long)j*p->n + i;
+}
+
+// collisionCallback for objects
+static void pair_cb(void* obj1, void* obj2, void* data) {
+	Pairs_add(data, ((Obj*)obj1)->index, ((Obj*)obj2)->index);
+}
+
+static int cmp_pair(const void* a, const void* b) {
+	long long x = *(const long long*)a, y = *(const long long*)b;
+	return x<y ? -1 : x>y;
+}
+
+static int overlap(const double* a, const double* b) {
+	return a[0] <= b[2] && a[2] >= b[0] && a[1] <= b[3] && a[3] >= b[1];
+}
+
+/*
+	compares two sets of pairs. Prints the first difference and
+	returns 1 if they differ. Empties both.
+*/
+static int compare_pairs(const char* what, Pairs* found, Pairs* expected) {
+	int n = found->n;
+	qsort(found->pairs, found->size, sizeof *found->pairs, cmp_pair);
+	qsort(expected->pairs, expected->size, sizeof *expected->pairs, cmp_pair);
+	int failed = 0;
+	for(int i=0;i<found->size || i<expected->size;i++) {
+		long long f = i<found->size ? found->pairs[i] : -1;
+		long long e = i<expected->size ? expected->pairs[i] : -1;
+		if(f!=e) {
+			printf("%s: %i pairs found, %i expected; first difference: "
+					"%lli-%lli found, %lli-%lli expected\n", what, found->size, expected->size,
+					f<0 ? -1 : f/n, f<0 ? -1 : f%n, e<0 ? -1 : e/n, e<0 ? -1 : e%n);
+			failed = 1;
+			break;
+		}
+	}
+	found->size = 0;
+	expected->size = 0;
+	return failed;
+}
+
+/*
+	compares the pairs found with those of brute force over the
+	objects with a box and, if include isn't NULL, for which it
+	returns 1. Empties found.
+*/
+static int check_pairs(const char* what, Pairs* found, World* w,
+						int (*include)(Obj* o)) {
+	Pairs brute = {NULL, 0, 0, w->n};
+	for(int i=0;i<w->n;i++) {
+		Obj* a = &w->objs[i];
+		if(a->box==NULL || (include!=NULL && !include(a)))
+			continue;
+		for(int j=i+1;j<w->n;j++) {
+			Obj* b = &w->objs[j];
+			if(b->box!=NULL && (include==NULL || include(b)) && overlap(a->b, b->b))
+				Pairs_add(&brute, i, j);
+		}
+	}
+	int failed = compare_pairs(what, found, &brute);
+	free(brute.pairs);
+	return failed;
+}
+
+// collides the whole net and checks it against brute force
+static int check_collide(const char* what, Boxnet* net, World* w) {
+	Pairs found = {NULL, 0, 0, w->n};
+	Boxnet_collide(net, pair_cb, &found);
+	int failed = check_pairs(what, &found, w, NULL);
+	free(found.pairs);
+	return failed;
+}
+
+/*
+	moves the objects with a box by up to step box sizes and
+	writes their new bounds directly into the boxes.
+*/
+static void World_move(World* w, double step) {
+	for(int i=0;i<w->n;i++) {
+		Obj* o = &w->objs[i];
+		if(o->box==NULL)
+			continue;
+		move_bounds(w, o->b, step);
+		o->box->posx = o->b[0];	o->box->posy = o->b[1];
+		o->box->right = o->b[2];	o->box->top = o->b[3];
+	}
+}
+
+// frames of World_move() and a checked Boxnet_collide()
+static int run_frames(const char* what, Boxnet* net, World* w, int frames, double step) {
+	int failed = 0;
+	for(int frame=0;frame<frames && !failed;frame++) {
+		World_move(w, step);
+		char where[128];
+		snprintf(where, sizeof where, "%s, frame %i", what, frame);
+		failed = check_collide(where, net, w);
+	}
+	return failed;
+}
+
+
+/*
+	Pipelined frames: the boxes are staged while the frame runs,
+	including those its callback deletes, and some are deleted
+	and added between the frames. The pairs of every frame are
+	checked, leaving out the boxes that were deleted during it,
+	and so is a Boxnet_collide() afterwards.
+*/
+
+typedef struct PipelineFrame {
+	Boxnet*		net;
+	Pairs		pairs;
+	int			frame;
+} PipelineFrame;
+
+// reports the pair and deletes a few of the boxes, deferred
+static void pipeline_cb(void* obj1, void* obj2, void* data) {
+	PipelineFrame* f = data;
+	pair_cb(obj1, obj2, &f->pairs);
+	Obj* objs[2] = {obj1, obj2};
+	for(int i=0;i<2;i++) {
+		Obj* o = objs[i];
+		if(!o->dying && (o->index*31 + f->frame) % 53 == 0) {
+			o->dying = 1;
+			if(Boxnet_delbox_deferred(f->net, o->box)!=0)
+				o->dying = 0;
+		}
+	}
+}
+
+static int not_dying(Obj* o) {
+	return !o->dying;
+}
+
+static int test_pipeline_deferred() {
+	World w;
+	World_init(&w, 2000, 47);
+	Boxnet* net = Boxnet_new();
+	World_add(&w, net);
+	double (*next)[4] = malloc(w.n * sizeof *next);
+	for(int i=0;i<w.n;i++)
+		memcpy(next[i], w.objs[i].b, sizeof next[i]);
+	PipelineFrame f = {net, {NULL, 0, 0, w.n}, 0};
+	int failed = 0;
+	for(f.frame=0;f.frame<40 && !failed;f.frame++) {
+		// what was staged is committed (the bounds of the boxes
+		// deleted since have been dropped)
+		for(int i=0;i<w.n;i++)
+			memcpy(w.objs[i].b, next[i], sizeof next[i]);
+		Boxnet_commit(net, pipeline_cb, &f);
+		// stage while the frame runs, also the boxes it deletes; a
+		// second time after a pause, when it has probably finished
+		for(int pass=0;pass<2;pass++) {
+			for(int i=0;i<w.n;i++) {
+				if(pass==0)
+					move_bounds(&w, next[i], 0.5);
+				if(Boxnet_stage(net, w.objs[i].box, next[i][0], next[i][1],
+									next[i][2], next[i][3])!=0) {
+					printf("frame %i: Boxnet_stage() failed\n", f.frame);
+					failed = 1;
+				}
+			}
+			if(pass==0) {
+				struct timespec pause = {0, 10000000};
+				nanosleep(&pause, NULL);
+			}
+		}
+		Boxnet_wait(net);
+		// the pairs of the boxes deleted during the frame depend on
+		// when that happened
+		int j = 0;
+		for(int i=0;i<f.pairs.size;i++) {
+			long long pair = f.pairs.pairs[i];
+			if(!w.objs[pair/w.n].dying && !w.objs[pair%w.n].dying)
+				f.pairs.pairs[j++] = pair;
+		}
+		f.pairs.size = j;
+		char what[64];
+		snprintf(what, sizeof what, "frame %i", f.frame);
+		failed |= check_pairs(what, &f.pairs, &w, not_dying);
+		// the deleted boxes come back elsewhere, and a few more are
+		// deleted right away, with their bounds staged
+		for(int i=0;i<w.n;i++) {
+			Obj* o = &w.objs[i];
+			if((i*7 + f.frame) % 211 == 0 && !o->dying)
+				Boxnet_delbox(net, o->box);
+			else if(!o->dying)
+				continue;
+			o->dying = 0;
+			random_bounds(&w, o->b);
+			memcpy(next[i], o->b, sizeof next[i]);
+			o->box = Boxnet_addbox(net, o->b[0], o->b[1], o->b[2], o->b[3], NULL, o);
+		}
+		if(f.frame%10==9) {
+			snprintf(what, sizeof what, "Boxnet_collide() after frame %i", f.frame);
+			failed |= check_collide(what, net, &w);
+		}
+	}
+	Boxnet_free(net);
+	free(f.pairs.pairs);
+	free(next);
+	World_free(&w);
+	return failed;
+}
+
+
+/*
+	Pipelined frames of a net with worker threads, while the main
+	thread stages the next bounds and collides a second net with
+	the same boxes. Both have to find the same pairs every frame.
+	Between the frames, boxes are deleted and added in both.
+*/
+static int test_pipeline_concurrent() {
+	World w;
+	World_init(&w, 3000, 44);
+	Boxnet* net = Boxnet_new();
+	Boxnet* ref = Boxnet_new();
+	Boxnet_setthreads(net, 3);
+	World_add(&w, net);
+	Box** refboxes = malloc(w.n * sizeof *refboxes);
+	double (*next)[4] = malloc(w.n * sizeof *next);
+	for(int i=0;i<w.n;i++) {
+		Obj* o = &w.objs[i];
+		refboxes[i] = Boxnet_addbox(ref, o->b[0], o->b[1], o->b[2], o->b[3], NULL, o);
+		memcpy(next[i], o->b, sizeof next[i]);
+	}
+	Pairs found = {NULL, 0, 0, w.n}, expected = {NULL, 0, 0, w.n};
+	int failed = 0;
+	for(int frame=0;frame<30 && !failed;frame++) {
+		for(int i=0;i<w.n;i++) {
+			memcpy(w.objs[i].b, next[i], sizeof next[i]);
+			Boxnet_movebox(ref, refboxes[i], next[i][0], next[i][1], next[i][2], next[i][3]);
+		}
+		Boxnet_commit(net, pair_cb, &found);
+		Boxnet_collide(ref, pair_cb, &expected);
+		for(int i=0;i<w.n;i++) {
+			move_bounds(&w, next[i], 0.5);
+			Boxnet_stage(net, w.objs[i].box, next[i][0], next[i][1], next[i][2], next[i][3]);
+		}
+		Boxnet_wait(net);
+		char what[64];
+		snprintf(what, sizeof what, "frame %i", frame);
+		if(frame%10==0) {
+			Pairs copy = {malloc(found.size * sizeof *copy.pairs), found.size, found.size, w.n};
+			memcpy(copy.pairs, found.pairs, found.size * sizeof *copy.pairs);
+			failed |= check_pairs(what, &copy, &w, NULL);
+			free(copy.pairs);
+		}
+		failed |= compare_pairs(what, &found, &expected);
+		for(int i=frame%37;i<w.n;i+=37) {
+			Obj* o = &w.objs[i];
+			Boxnet_delbox(net, o->box);
+			Boxnet_delbox(ref, refboxes[i]);
+			random_bounds(&w, next[i]);
+			o->box = Boxnet_addbox(net, next[i][0], next[i][1], next[i][2], next[i][3], NULL, o);
+			refboxes[i] = Boxnet_addbox(ref, next[i][0], next[i][1], next[i][2], next[i][3], NULL, o);
+		}
+	}
+	Boxnet_free(net);
+	Boxnet_free(ref);
+	free(found.pairs);
+	free(expected.pairs);
+	free(refboxes);
+	free(next);
+	World_free(&w);
+	return failed;
+}
+
+
+/*
+	the objects of net in snapshot order: net->boxes, then
+	net->giants. Only valid right after Boxnet_snapshot().
+*/
+static Obj** snapshot_objs(Boxnet* net) {
+	int n = net->boxes_size + net->giants_size;
+	Obj** objs = malloc(n * sizeof *objs);
+	for(int i=0;i<n;i++) {
+		Box* box = i<net->boxes_size ? net->boxes[i] : net->giants[i-net->boxes_size];
+		objs[i] = box->usrdata;
+	}
+	return objs;
+}
+
+// connects the boxes of a net restored from a snapshot with objs
+static void reconnect(Boxnet* restored, Obj** objs) {
+	for(int i=0;i<restored->boxes_size+restored->giants_size;i++) {
+		Box* box = i<restored->boxes_size ? restored->boxes[i] :
+						restored->giants[i-restored->boxes_size];
+		box->usrdata = objs[i];
+		objs[i]->box = box;
+	}
+}
+
+/*
+	Snapshots: a net restored from memory and one loaded from a
+	file have to go on like the original.
+*/
+static int test_snapshot() {
+	World w;
+	World_init(&w, 3000, 32);
+	Boxnet* net = Boxnet_new();
+	World_add(&w, net);
+	int failed = run_frames("before the snapshot", net, &w, 3, 1);
+	size_t size = Boxnet_snapshotsize(net);
+	void* buffer = malloc(size);
+	Boxnet_snapshot(net, buffer);
+	Obj** objs = snapshot_objs(net);
+	Boxnet* restored = Boxnet_restore(buffer, size);
+	if(restored==NULL) {
+		printf("Boxnet_restore() failed\n");
+		return 1;
+	}
+	reconnect(restored, objs);
+	failed |= check_collide("after Boxnet_restore()", restored, &w);
+	failed |= run_frames("restored", restored, &w, 3, 1);
+	if(Boxnet_save(restored, "snapshot.boxnet")!=0) {
+		printf("Boxnet_save() failed\n");
+		return 1;
+	}
+	free(objs);
+	objs = snapshot_objs(restored);
+	Boxnet* loaded = Boxnet_load("snapshot.boxnet");
+	if(loaded==NULL) {
+		printf("Boxnet_load() failed\n");
+		return 1;
+	}
+	reconnect(loaded, objs);
+	failed |= check_collide("after Boxnet_load()", loaded, &w);
+	failed |= run_frames("loaded", loaded, &w, 3, 1);
+	// a truncated snapshot isn't restored
+	if(Boxnet_restore(buffer, size-1)!=NULL) {
+		printf("a truncated snapshot was restored\n");
+		failed = 1;
+	}
+	Boxnet_free(loaded);
+	Boxnet_free(restored);
+	Boxnet_free(net);
+	free(objs);
+	free(buffer);
+	World_free(&w);
+	return failed;
+}
+
+
+/*
+	Giants in snapshots: a restored net has its giants in the
+	saved order, so that they can be matched with their objects.
+*/
+static int test_snapshot_giants() {
+	World w;
+	World_init(&w, 1005, 45);
+	for(int k=0;k<5;k++) {
+		double* b = w.objs[1000+k].b;
+		b[0] = 0.02*k;	b[1] = 0.1;
+		b[2] = b[0] + 0.5 + 0.1*k;	b[3] = 0.3;
+	}
+	Boxnet* net = Boxnet_new();
+	Boxnet_setgiantsize(net, 0.4);
+	World_add(&w, net);
+	int failed = check_collide("before the snapshot", net, &w);
+	if(net->giants_size!=5) {
+		printf("%i giants instead of 5\n", net->giants_size);
+		failed = 1;
+	}
+	size_t size = Boxnet_snapshotsize(net);
+	void* buffer = malloc(size);
+	Boxnet_snapshot(net, buffer);
+	Boxnet* restored = Boxnet_restore(buffer, size);
+	if(restored==NULL || restored->boxes_size!=net->boxes_size ||
+			restored->giants_size!=net->giants_size) {
+		printf("Boxnet_restore() failed\n");
+		return 1;
+	}
+	for(int i=0;i<net->giants_size;i++) {
+		Box* giant = restored->giants[i];
+		Obj* o = net->giants[i]->usrdata;
+		if(giant->posx!=o->b[0] || giant->right!=o->b[2]) {
+			printf("giant %i restored as [%g,%g], saved as [%g,%g]\n", i,
+					giant->posx, giant->right, o->b[0], o->b[2]);
+			failed = 1;
+		}
+	}
+	Obj** objs = snapshot_objs(net);
+	reconnect(restored, objs);
+	free(objs);
+	Boxnet_setgiantsize(restored, 0.4);
+	failed |= check_collide("after Boxnet_restore()", restored, &w);
+	Boxnet_free(restored);
+	Boxnet_free(net);
+	free(buffer);
+	World_free(&w);
+	return failed;
+}
+
+
+/*
+	Swept collisions: a third of the boxes is swept far, a third
+	a little, the rest stays. The pairs and their times of impact
+	have to match those of brute force. The run is traced to
+	sweep.trace, for boxnet_replay.
+*/
+typedef struct SweptPairs {
+	Pairs		pairs;
+	double*		toi;		// by the index of the pair in pairs
+	int			toi_size_max;
+} SweptPairs;
+
+static void swept_cb(void* obj1, void* obj2, double toi, void* data) {
+	SweptPairs* p = data;
+	if(p->pairs.size==p->toi_size_max) {
+		p->toi_size_max = p->toi_size_max>0 ? 2*p->toi_size_max : 1024;
+		p->toi = realloc(p->toi, p->toi_size_max * sizeof *p->toi);
+	}
+	p->toi[p->pairs.size] = toi;
+	pair_cb(obj1, obj2, &p->pairs);
+}
+
+// narrows [*first,*last] to the times in it at which f(t) = f0 + (f1-f0)*t <= 0
+static void while_not_positive(double f0, double f1, double* first, double* last) {
+	if(f0>0 && f1>0)
+		*first = 2;
+	else if(f0>0 && f0/(f0-f1) > *first)
+		*first = f0/(f0-f1);
+	else if(f1>0 && f0/(f0-f1) < *last)
+		*last = f0/(f0-f1);
+}
+
+// brute force time of impact of a and b moving from start to end, -1 if none
+static double brute_toi(const double* a0, const double* a1,
+						const double* b0, const double* b1) {
+	double first = 0, last = 1;
+	for(int k=0;k<2;k++) {
+		while_not_positive(a0[k]-b0[k+2], a1[k]-b1[k+2], &first, &last);
+		while_not_positive(b0[k]-a0[k+2], b1[k]-a1[k+2], &first, &last);
+	}
+	return first<=last ? first : -1;
+}
+
+static int test_sweep_toi() {
+	World w;
+	World_init(&w, 1500, 46);
+	Boxnet* net = Boxnet_new();
+	World_add(&w, net);
+	if(Boxnet_trace_start(net, "sweep.trace")!=0) {
+		printf("can't record sweep.trace\n");
+		return 1;
+	}
+	double (*start)[4] = malloc(w.n * sizeof *start);
+	SweptPairs found = {{NULL, 0, 0, w.n}, NULL, 0};
+	int failed = 0;
+	for(int frame=0;frame<10 && !failed;frame++) {
+		for(int i=0;i<w.n;i++) {
+			Obj* o = &w.objs[i];
+			memcpy(start[i], o->b, sizeof start[i]);
+			int kind = (i+frame)%3;
+			if(kind==2)
+				continue;
+			move_bounds(&w, o->b, kind==0 ? 12 : 0.5);
+			Boxnet_sweep(net, o->box, o->b[0], o->b[1], o->b[2], o->b[3]);
+		}
+		if(Boxnet_collide_swept(net, swept_cb, &found)!=0) {
+			printf("frame %i: Boxnet_collide_swept() failed\n", frame);
+			failed = 1;
+			break;
+		}
+		// every pair once, with its time
+		Pairs brute = {NULL, 0, 0, w.n};
+		double* toi = malloc((long)w.n*w.n * sizeof *toi);
+		for(int i=0;i<w.n;i++)
+			for(int j=i+1;j<w.n;j++) {
+				toi[(long)i*w.n+j] = brute_toi(start[i], w.objs[i].b, start[j], w.objs[j].b);
+				if(toi[(long)i*w.n+j]>=0)
+					Pairs_add(&brute, i, j);
+			}
+		for(int k=0;k<found.pairs.size && !failed;k++) {
+			long long pair = found.pairs.pairs[k];
+			double expected = toi[pair];
+			if(expected>=0 && fabs(found.toi[k]-expected) > 1e-9) {
+				printf("frame %i: pair %lli-%lli at %.12f, brute force %.12f\n", frame,
+						pair/w.n, pair%w.n, found.toi[k], expected);
+				failed = 1;
+			}
+		}
+		free(toi);
+		char what[64];
+		snprintf(what, sizeof what, "frame %i", frame);
+		failed |= compare_pairs(what, &found.pairs, &brute);
+		free(brute.pairs);
+	}
+	if(Boxnet_trace_stop(net)!=0) {
+		printf("writing sweep.trace failed\n");
+		failed = 1;
+	}
+	failed |= check_collide("Boxnet_collide() afterwards", net, &w);
+	Boxnet_free(net);
+	free(found.pairs.pairs);
+	free(found.toi);
+	free(start);
+	World_free(&w);
+	return failed;
+}
+
+
+/*
+	Net quality: collides under both quality policies and the
+	automatic rebuild while the boxes move far, and checks the
+	quality measured after an explicit rebuild.
+*/
+static int test_quality_rebuild() {
+	World w;
+	World_init(&w, 3000, 29);
+	Boxnet* net = Boxnet_new();
+	World_add(&w, net);
+	Boxnet_setqualitypolicy(net, BOXNET_QUALITY_REBUILD, 1.0, 2);
+	int failed = run_frames("rebuild policy", net, &w, 8, 3);
+	Boxnet_setqualitypolicy(net, BOXNET_QUALITY_OPTIMIZE, 1.0, 1);
+	failed |= run_frames("optimize policy", net, &w, 8, 3);
+	Boxnet_setqualitypolicy(net, BOXNET_QUALITY_IGNORE, 0, 0);
+	Boxnet_setautorebuild(net, 1);
+	failed |= run_frames("automatic rebuild", net, &w, 4, 20);
+	Boxnet_setautorebuild(net, 0);
+	World_move(&w, 20);
+	Boxnet_rebuild(net);
+	failed |= check_collide("after Boxnet_rebuild()", net, &w);
+	Boxnet_quality q;
+	Boxnet_getquality(net, &q);
+	if(q.rays!=4*net->boxes_size || q.rays_infinite>q.rays || q.junctions_max<1 ||
+			!(q.length_mean>0) || q.length_max<q.length_mean) {
+		printf("implausible quality: %i rays, %i infinite, junctions max %i, "
+				"length mean %g max %g\n", q.rays, q.rays_infinite, q.junctions_max,
+				q.length_mean, q.length_max);
+		failed = 1;
+	}
+	Boxnet_free(net);
+	World_free(&w);
+	return failed;
+}
+
+
+/*
+	Budgeted optimization: runs with a box budget and with a time
+	budget after every repair, and explicit passes in between.
+*/
+static int test_optimize_budget() {
+	World w;
+	World_init(&w, 3000, 30);
+	Boxnet* net = Boxnet_new();
+	World_add(&w, net);
+	Boxnet_setoptimizebudget(net, 200, 0);
+	int failed = run_frames("box budget", net, &w, 8, 2);
+	Boxnet_setoptimizebudget(net, 0, 50);
+	failed |= run_frames("time budget", net, &w, 8, 2);
+	Boxnet_setoptimizebudget(net, 0, 0);
+	for(int k=0;k<4 && !failed;k++) {
+		World_move(&w, 2);
+		Boxnet_repair(net);
+		Boxnet_optimize(net, 500, 0);
+		failed |= check_collide("after Boxnet_optimize()", net, &w);
+	}
+	Boxnet_free(net);
+	World_free(&w);
+	return failed;
+}
+
+
+/*
+	Reordering along the hilbert curve: every few frames and
+	explicitly; the boxes have to keep their positions in
+	net->boxes up to date.
+*/
+static int test_reorder() {
+	World w;
+	World_init(&w, 3000, 31);
+	Boxnet* net = Boxnet_new();
+	World_add(&w, net);
+	Boxnet_setreorderinterval(net, 3);
+	int failed = run_frames("reorder interval", net, &w, 9, 1);
+	Boxnet_setreorderinterval(net, 0);
+	World_move(&w, 1);
+	Boxnet_reorder(net);
+	failed |= check_collide("after Boxnet_reorder()", net, &w);
+	for(int i=0;i<net->boxes_size;i++)
+		if(net->boxes[i]->index!=i) {
+			printf("box %i has index %i\n", i, net->boxes[i]->index);
+			failed = 1;
+			break;
+		}
+	Boxnet_free(net);
+	World_free(&w);
+	return failed;
+}
+
+
+typedef struct ViewPairs {
+	Pairs		pairs;
+	Obj**		objs;		// by box number
+} ViewPairs;
+
+// viewCallback for objects
+static void view_cb(int box1, int box2, void* data) {
+	ViewPairs* p = data;
+	Pairs_add(&p->pairs, p->objs[box1]->index, p->objs[box2]->index);
+}
+
+// checks the pairs and bounds of view against the objects
+static int check_view(const char* what, Boxnet_view* view, Obj** objs, World* w) {
+	int failed = 0;
+	if(Boxnet_view_size(view)!=w->n) {
+		printf("%s: %i boxes instead of %i\n", what, Boxnet_view_size(view), w->n);
+		return 1;
+	}
+	for(int i=0;i<w->n && !failed;i++) {
+		double b[4];
+		Boxnet_view_getbox(view, i, &b[0], &b[1], &b[2], &b[3]);
+		if(memcmp(b, objs[i]->b, sizeof b)!=0) {
+			printf("%s: box %i has other bounds\n", what, i);
+			failed = 1;
+		}
+	}
+	ViewPairs found = {{NULL, 0, 0, w->n}, objs};
+	Boxnet_view_collide(view, view_cb, &found);
+	failed |= check_pairs(what, &found.pairs, w, NULL);
+	free(found.pairs.pairs);
+	return failed;
+}
+
+/*
+	Read-only views on a snapshot in memory and on a mapped file.
+*/
+static int test_view() {
+	World w;
+	World_init(&w, 3000, 33);
+	Boxnet* net = Boxnet_new();
+	World_add(&w, net);
+	int failed = run_frames("before the snapshot", net, &w, 3, 1);
+	size_t size = Boxnet_snapshotsize(net);
+	void* buffer = malloc(size);
+	Boxnet_snapshot(net, buffer);
+	Obj** objs = snapshot_objs(net);
+	Boxnet_view* view = Boxnet_view_new(buffer, size);
+	if(view==NULL) {
+		printf("Boxnet_view_new() failed\n");
+		return 1;
+	}
+	failed |= check_view("Boxnet_view_new()", view, objs, &w);
+	Boxnet_view_free(view);
+	free(objs);
+	World_move(&w, 1);
+	if(Boxnet_save(net, "view.boxnet")!=0) {
+		printf("Boxnet_save() failed\n");
+		return 1;
+	}
+	objs = snapshot_objs(net);
+	view = Boxnet_view_open("view.boxnet");
+	if(view==NULL) {
+		printf("Boxnet_view_open() failed\n");
+		return 1;
+	}
+	failed |= check_view("Boxnet_view_open()", view, objs, &w);
+	Boxnet_view_free(view);
+	Boxnet_free(net);
+	free(objs);
+	free(buffer);
+	World_free(&w);
+	return failed;
+}
+
+
+/*
+	the snapshot format of boxnet.c (version 3), to corrupt it
+*/
+typedef struct SnapJunction {
+	int32_t			nb[4];
+	int32_t			pos[2];
+	unsigned char	dir;
+	unsigned char	beamdir;
+	unsigned char	padding[2];
+} SnapJunction;
+
+typedef struct SnapBox {
+	double			bounds[9];
+	SnapJunction	jnc[5];
+} SnapBox;
+
+#define SNAP_HEADER		(8 + 4*4 + 4*8)
+
+static SnapJunction* snap_junction(void* buffer, int32_t j) {
+	SnapBox* boxes = (SnapBox*)((char*)buffer + SNAP_HEADER);
+	return &boxes[j/5].jnc[j%5];
+}
+
+// counts the pairs of a corrupt view, they are meaningless
+static void count_cb(int box1, int box2, void* data) {
+	(*(long*)data)++;
+}
+
+/*
+	Corrupt snapshots: views on them are refused or at least
+	terminate. Random links are caught by the checks of
+	Boxnet_view_new(); links rewired into a ring in both
+	directions pass them and have to be stopped by the walks.
+*/
+static int test_view_corrupt() {
+	World w;
+	World_init(&w, 500, 34);
+	Boxnet* net = Boxnet_new();
+	World_add(&w, net);
+	int failed = run_frames("before the snapshot", net, &w, 2, 1);
+	size_t size = Boxnet_snapshotsize(net);
+	void* buffer = malloc(size);
+	void* corrupt = malloc(size);
+	Boxnet_snapshot(net, buffer);
+	int n = w.n;
+	int accepted = 0;
+	for(int k=0;k<2000;k++) {
+		memcpy(corrupt, buffer, size);
+		for(int m=0;m<1+k%3;m++) {
+			SnapJunction* sj = snap_junction(corrupt, (int32_t)(rng_d(&w.rng)*5*n));
+			int32_t value = (int32_t)(rng_d(&w.rng)*(5*n+2)) - 2;
+			int field = (int)(rng_d(&w.rng)*8);
+			if(field<4)
+				sj->nb[field] = value;
+			else if(field<6)
+				sj->pos[field-4] = value/5;
+			else if(field==6)
+				sj->dir = value%7;
+			else
+				sj->beamdir = value%5;
+		}
+		Boxnet_view* view = Boxnet_view_new(corrupt, size);
+		if(view==NULL)
+			continue;
+		long pairs = 0;
+		Boxnet_view_collide(view, count_cb, &pairs);
+		Boxnet_view_free(view);
+		accepted++;
+	}
+	int rings = 0;
+	for(int i=0;i<n;i++) {
+		memcpy(corrupt, buffer, size);
+		// junction i*5 and its left neighbor k point at each
+		// other both ways; their old neighbors c and d are joined
+		SnapJunction* j = snap_junction(corrupt, 5*i);
+		int32_t k = j->nb[1];
+		if(k<0 || snap_junction(corrupt, k)->dir==3)
+			continue;		// k ends the ray and has no left link
+		SnapJunction* sk = snap_junction(corrupt, k);
+		int32_t c = j->nb[3], d = sk->nb[1];
+		j->nb[3] = k;
+		sk->nb[1] = 5*i;
+		if(c>=0)
+			snap_junction(corrupt, c)->nb[1] = d;
+		if(d>=0)
+			snap_junction(corrupt, d)->nb[3] = c;
+		Boxnet_view* view = Boxnet_view_new(corrupt, size);
+		if(view==NULL) {
+			printf("ring at box %i refused, its links are consistent\n", i);
+			failed = 1;
+			break;
+		}
+		long pairs = 0;
+		Boxnet_view_collide(view, count_cb, &pairs);
+		Boxnet_view_free(view);
+		if(++rings==20)
+			break;
+	}
+	printf("%i of 2000 corrupt snapshots accepted, %i rings walked\n", accepted, rings);
+	Boxnet_free(net);
+	free(corrupt);
+	free(buffer);
+	World_free(&w);
+	return failed;
+}
+
+
+/*
+	an allocator that counts blocks and bytes, checks the sizes it
+	gets back against those it handed out, and fails on request.
+*/
+typedef struct Counting {
+	long		blocks;
+	long		bytes;
+	int			wrong_sizes;
+	int			fail;		// all allocations fail
+} Counting;
+
+// every block starts with its size, 16 bytes to keep the alignment
+static void* counting_alloc(size_t size, void* ctx) {
+	Counting* c = ctx;
+	size_t* block = c->fail ? NULL : malloc(16 + size);
+	if(block==NULL)
+		return NULL;
+	*block = size;
+	c->blocks++;
+	c->bytes += size;
+	return (char*)block + 16;
+}
+
+static void* counting_realloc(void* ptr, size_t old_size, size_t size, void* ctx) {
+	Counting* c = ctx;
+	size_t* block = (size_t*)((char*)ptr - 16);
+	if(*block!=old_size)
+		c->wrong_sizes++;
+	if(c->fail)
+		return NULL;
+	block = realloc(block, 16 + size);
+	if(block==NULL)
+		return NULL;
+	c->bytes += size - *block;
+	*block = size;
+	return (char*)block + 16;
+}
+
+static void counting_free(void* ptr, size_t size, void* ctx) {
+	Counting* c = ctx;
+	size_t* block = (size_t*)((char*)ptr - 16);
+	if(*block!=size)
+		c->wrong_sizes++;
+	c->blocks--;
+	c->bytes -= *block;
+	free(block);
+}
+
+/*
+	Allocator hooks: a net with all its extras (threads, giants,
+	sweeps, the pipeline, a trace, a publication and a restored
+	copy) has to give back every block with the size it got, and
+	survive running out of memory when adding boxes.
+*/
+static int test_allocator() {
+	Counting c = {0, 0, 0, 0};
+	Boxnet_allocator allocator = {counting_alloc, counting_realloc, counting_free, &c};
+	World w;
+	World_init(&w, 2000, 35);
+	for(int k=0;k<3;k++) {
+		double* b = w.objs[k].b;
+		b[0] = 0.1*k;	b[1] = 0.2*k;
+		b[2] = b[0] + 0.6;	b[3] = b[1] + 0.1;
+	}
+	Boxnet* net = Boxnet_newalloc(&allocator);
+	Boxnet_setthreads(net, 3);
+	Boxnet_setgiantsize(net, 0.4);
+	World_add(&w, net);
+	if(Boxnet_trace_start(net, "allocator.trace")!=0) {
+		printf("can't record allocator.trace\n");
+		return 1;
+	}
+	int failed = run_frames("threads", net, &w, 3, 1);
+	SweptPairs swept = {{NULL, 0, 0, w.n}, NULL, 0};
+	for(int i=0;i<w.n;i+=10) {
+		Obj* o = &w.objs[i];
+		move_bounds(&w, o->b, 1);
+		Boxnet_sweep(net, o->box, o->b[0], o->b[1], o->b[2], o->b[3]);
+	}
+	Boxnet_collide_swept(net, swept_cb, &swept);
+	free(swept.pairs.pairs);
+	free(swept.toi);
+	Pairs found = {NULL, 0, 0, w.n};
+	for(int frame=0;frame<3;frame++) {
+		Boxnet_commit(net, pair_cb, &found);
+		Boxnet_wait(net);
+		failed |= check_pairs("pipelined", &found, &w, NULL);
+	}
+	free(found.pairs);
+	if(Boxnet_trace_stop(net)!=0) {
+		printf("writing allocator.trace failed\n");
+		failed = 1;
+	}
+	Boxnet_publish(net);
+	Boxnet_view_free(Boxnet_view_acquire(net));
+	c.fail = 1;
+	if(Boxnet_addbox(net, 0, 0, 1, 1, NULL, NULL)!=NULL) {
+		printf("Boxnet_addbox() succeeded without memory\n");
+		failed = 1;
+	}
+	c.fail = 0;
+	failed |= check_collide("after running out of memory", net, &w);
+	Boxnet_shrink(net);
+	failed |= check_collide("after Boxnet_shrink()", net, &w);
+	size_t size = Boxnet_snapshotsize(net);
+	void* buffer = malloc(size);
+	Boxnet_snapshot(net, buffer);
+	Obj** objs = snapshot_objs(net);
+	Boxnet* restored = Boxnet_restorealloc(buffer, size, &allocator);
+	if(restored==NULL) {
+		printf("Boxnet_restorealloc() failed\n");
+		return 1;
+	}
+	reconnect(restored, objs);
+	Boxnet_setgiantsize(restored, 0.4);
+	failed |= check_collide("restored", restored, &w);
+	Boxnet_free(restored);
+	Boxnet_free(net);
+	if(c.blocks!=0 || c.bytes!=0 || c.wrong_sizes!=0) {
+		printf("%li blocks with %li bytes left, %i blocks given back with the wrong size\n",
+				c.blocks, c.bytes, c.wrong_sizes);
+		failed = 1;
+	}
+	free(objs);
+	free(buffer);
+	World_free(&w);
+	return failed;
+}
+
+
+// deletes every 50th object reported, deferred
+static void delete_cb(void* obj1, void* obj2, void* data) {
+	Obj* o = obj1;
+	if(o->index%50==0 && !o->dying) {
+		o->dying = 1;
+		Boxnet_delbox_deferred(data, o->box);
+	}
+}
+
+// the objects delete_cb() deleted have no box anymore
+static void World_reap(World* w) {
+	for(int i=0;i<w->n;i++)
+		if(w->objs[i].dying) {
+			w->objs[i].dying = 0;
+			w->objs[i].box = NULL;
+		}
+}
+
+/*
+	checks that Boxnet_memory_usage() accounts for every byte the
+	net got from its allocator
+*/
+static int check_memory(const char* what, Boxnet* net, Counting* c, Boxnet_memory* m) {
+	Boxnet_memory_usage(net, m);
+	size_t parts = sizeof *net + m->boxes + m->junctions + m->ghosts + m->queues +
+					m->deferred + m->pipeline + m->sweep + m->threads + m->trace +
+					m->published;
+	if(m->total - m->published != (size_t)c->bytes || parts!=m->total || m->slack > m->total) {
+		printf("%s: %zu bytes reported (%zu published, %zu in the parts, %zu slack), "
+				"%li allocated\n", what, m->total, m->published, parts, m->slack, c->bytes);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+	Memory accounting: with all the extras of a net in use, the
+	usage reported has to match the allocator byte for byte, and
+	Boxnet_shrink() has to leave no slack.
+*/
+static int test_memory() {
+	Counting c = {0, 0, 0, 0};
+	Boxnet_allocator allocator = {counting_alloc, counting_realloc, counting_free, &c};
+	World w;
+	World_init(&w, 3000, 36);
+	for(int k=0;k<3;k++) {
+		double* b = w.objs[k].b;
+		b[0] = 0.1*k;	b[1] = 0.2*k;
+		b[2] = b[0] + 0.6;	b[3] = b[1] + 0.1;
+	}
+	Boxnet* net = Boxnet_newalloc(&allocator);
+	Boxnet_setthreads(net, 3);
+	Boxnet_setgiantsize(net, 0.4);
+	World_add(&w, net);
+	Boxnet_memory m, shrunk;
+	int failed = check_memory("new", net, &c, &m);
+	failed |= run_frames("threads", net, &w, 2, 1);
+	if(Boxnet_trace_start(net, "memory.trace")!=0) {
+		printf("can't record memory.trace\n");
+		return 1;
+	}
+	Boxnet_collide(net, delete_cb, net);
+	World_reap(&w);
+	for(int i=1;i<w.n;i+=3) {
+		Obj* o = &w.objs[i];
+		if(o->box==NULL)
+			continue;
+		move_bounds(&w, o->b, 1);
+		Boxnet_sweep(net, o->box, o->b[0], o->b[1], o->b[2], o->b[3]);
+	}
+	failed |= check_memory("swept", net, &c, &m);
+	SweptPairs swept = {{NULL, 0, 0, w.n}, NULL, 0};
+	Boxnet_collide_swept(net, swept_cb, &swept);
+	free(swept.pairs.pairs);
+	free(swept.toi);
+	for(int i=2;i<w.n;i+=3) {
+		Obj* o = &w.objs[i];
+		if(o->box!=NULL)
+			Boxnet_stage(net, o->box, o->b[0], o->b[1], o->b[2], o->b[3]);
+	}
+	failed |= check_memory("staged", net, &c, &m);
+	Pairs found = {NULL, 0, 0, w.n};
+	Boxnet_commit(net, pair_cb, &found);
+	Boxnet_wait(net);
+	free(found.pairs);
+	Boxnet_publish(net);
+	failed |= check_memory("published", net, &c, &m);
+	if(m.ghosts!=0 || m.deferred==0 || m.pipeline==0 || m.sweep==0 || m.threads==0 ||
+			m.trace==0 || m.published==0) {
+		printf("a part is missing from the report\n");
+		failed = 1;
+	}
+	// deleting most boxes leaves room to give back
+	for(int i=0;i<w.n;i++)
+		if(i%4!=0 && w.objs[i].box!=NULL) {
+			Boxnet_delbox(net, w.objs[i].box);
+			w.objs[i].box = NULL;
+		}
+	failed |= check_collide("after deleting", net, &w);
+	Boxnet_memory_usage(net, &m);
+	Boxnet_shrink(net);
+	failed |= check_memory("shrunk", net, &c, &shrunk);
+	if(shrunk.slack!=0 || shrunk.total>=m.total) {
+		printf("Boxnet_shrink() left %zu of %zu bytes of slack, %zu of %zu bytes\n",
+				shrunk.slack, m.slack, shrunk.total, m.total);
+		failed = 1;
+	}
+	failed |= run_frames("after Boxnet_shrink()", net, &w, 2, 1);
+	Boxnet_trace_stop(net);
+	Boxnet_free(net);
+	World_free(&w);
+	return failed;
+}
+
+
+/*
+	Margins: boxes that jitter within their margin leave the net
+	alone, but the pairs have to be those of the exact bounds,
+	also when some move out of the margin or shrink inside it.
+*/
+static int test_margin() {
+	World w;
+	World_init(&w, 3000, 37);
+	Boxnet* net = Boxnet_new();
+	World_add(&w, net);
+	for(int i=0;i<w.n;i++)
+		Boxnet_setmargin(net, w.objs[i].box, i%5==0 ? 0 : 0.2*w.size);
+	int failed = run_frames("jitter", net, &w, 6, 0.2);
+	failed |= run_frames("larger moves", net, &w, 4, 1.5);
+	for(int frame=0;frame<4 && !failed;frame++) {
+		for(int i=frame;i<w.n;i+=4) {
+			Obj* o = &w.objs[i];
+			double cx = (o->b[0]+o->b[2])/2, cy = (o->b[1]+o->b[3])/2;
+			double f = frame%2 ? 0.5 : 2;	// shrink, then grow back
+			o->b[0] = cx - f*(cx-o->b[0]);	o->b[2] = cx + f*(o->b[2]-cx);
+			o->b[1] = cy - f*(cy-o->b[1]);	o->b[3] = cy + f*(o->b[3]-cy);
+			o->box->posx = o->b[0];	o->box->posy = o->b[1];
+			o->box->right = o->b[2];	o->box->top = o->b[3];
+		}
+		failed |= check_collide("resized", net, &w);
+	}
+	Boxnet_free(net);
+	World_free(&w);
+	return failed;
+}
+
+
+/*
+	Teleports: Boxnet_movebox() relocates boxes that jump far and
+	leaves small moves to the repair, and moves boxes that cross
+	the giant size between net and giants right away; either way
+	the pairs have to be those of brute force.
+*/
+static int test_movebox() {
+	World w;
+	World_init(&w, 3000, 38);
+	Boxnet* net = Boxnet_new();
+	World_add(&w, net);
+	int failed = 0;
+	for(int frame=0;frame<8 && !failed;frame++) {
+		for(int i=0;i<w.n;i++) {
+			Obj* o = &w.objs[i];
+			if((i+frame)%7==0)
+				random_bounds(&w, o->b);
+			else
+				move_bounds(&w, o->b, 0.5);
+			Boxnet_movebox(net, o->box, o->b[0], o->b[1], o->b[2], o->b[3]);
+		}
+		char what[64];
+		snprintf(what, sizeof what, "frame %i", frame);
+		failed = check_collide(what, net, &w);
+	}
+	// boxes that cross the giant size move between net and giants
+	Boxnet_setgiantsize(net, 0.3);
+	for(int frame=0;frame<8 && !failed;frame++) {
+		int giants = 0;
+		for(int i=0;i<w.n;i++) {
+			Obj* o = &w.objs[i];
+			if((i+frame)%50==0) {
+				// grow into a giant or shrink back to normal size
+				double* b = o->b;
+				double cx = 0.5*(b[0]+b[2]), cy = 0.5*(b[1]+b[3]);
+				double h = b[2]-b[0] > 0.3 ? 0.5*w.size : 0.2+0.1*rng_d(&w.rng);
+				b[0] = cx-h;	b[2] = cx+h;
+				b[1] = cy-0.5*w.size;	b[3] = cy+0.5*w.size;
+			} else
+				move_bounds(&w, o->b, 0.5);
+			Boxnet_movebox(net, o->box, o->b[0], o->b[1], o->b[2], o->b[3]);
+			giants += o->b[2]-o->b[0] > 0.3;
+		}
+		if(net->giants_size!=giants) {
+			printf("frame %i: %i giants instead of %i\n", frame, net->giants_size, giants);
+			failed = 1;
+		}
+		char what[64];
+		snprintf(what, sizeof what, "giants, frame %i", frame);
+		failed |= check_collide(what, net, &w);
+	}
+	Boxnet_free(net);
+	World_free(&w);
+	return failed;
+}
+
+
+/*
+	Budgeted repair: teleports are repaired in slices of a few
+	steps, with more motion while a slice is pending.
+	Boxnet_trycollide() has to refuse until the repair is done,
+	then find the pairs of brute force.
+*/
+static int test_repairsome() {
+	World w;
+	World_init(&w, 3000, 39);
+	Boxnet* net = Boxnet_new();
+	World_add(&w, net);
+	int failed = run_frames("before", net, &w, 2, 1);
+	for(int frame=0;frame<8 && !failed;frame++) {
+		for(int i=0;i<w.n;i++)
+			if((i+frame)%10==0)
+				random_bounds(&w, w.objs[i].b);
+		World_move(&w, 0.5);
+		int slices = 0;
+		for(int done=0;!done;slices++) {
+			if(slices==1) {
+				// moves while the repair is pending, directly and
+				// with Boxnet_movebox(), are left to the next one
+				World_move(&w, 0.5);
+				Obj* o = &w.objs[frame];
+				random_bounds(&w, o->b);
+				Boxnet_movebox(net, o->box, o->b[0], o->b[1], o->b[2], o->b[3]);
+			}
+			done = slices==0 ? Boxnet_repairsome(net, 300, 0) :
+								Boxnet_repairresume(net, 300, 0);
+			if(done != Boxnet_repaired(net)) {
+				printf("frame %i: Boxnet_repaired() disagrees\n", frame);
+				failed = 1;
+			}
+			if(!done) {
+				Pairs found = {NULL, 0, 0, w.n};
+				if(Boxnet_trycollide(net, pair_cb, &found) || found.size>0) {
+					printf("frame %i: Boxnet_trycollide() during a repair\n", frame);
+					failed = 1;
+				}
+				free(found.pairs);
+			}
+		}
+		if(slices<2) {
+			printf("frame %i: repaired in one slice of 300 steps\n", frame);
+			failed = 1;
+		}
+		Pairs found = {NULL, 0, 0, w.n};
+		if(!Boxnet_trycollide(net, pair_cb, &found)) {
+			printf("frame %i: Boxnet_trycollide() refused a repaired net\n", frame);
+			failed = 1;
+		}
+		char what[64];
+		snprintf(what, sizeof what, "frame %i, %i slices", frame, slices);
+		failed |= check_pairs(what, &found, &w, NULL);
+		free(found.pairs);
+	}
+	Boxnet_free(net);
+	World_free(&w);
+	return failed;
+}
+
+
+/*
+	a thread reading the publications of a net: every view it
+	gets has to have the pairs of brute force over its own bounds.
+*/
+typedef struct Reader {
+	Boxnet*			net;
+	int				done;		// set by the writer
+	int				views;		// publications checked
+	int				failed;
+} Reader;
+
+// viewCallback for box numbers
+static void number_cb(int box1, int box2, void* data) {
+	Pairs_add(data, box1, box2);
+}
+
+static int check_view_brute(Boxnet_view* view) {
+	int n = Boxnet_view_size(view);
+	double* b = malloc(4 * n * sizeof *b);
+	Pairs brute = {NULL, 0, 0, n};
+	for(int i=0;i<n;i++)
+		Boxnet_view_getbox(view, i, &b[4*i], &b[4*i+1], &b[4*i+2], &b[4*i+3]);
+	for(int i=0;i<n;i++)
+		for(int j=i+1;j<n;j++)
+			if(overlap(&b[4*i], &b[4*j]))
+				Pairs_add(&brute, i, j);
+	Pairs found = {NULL, 0, 0, n};
+	Boxnet_view_collide(view, number_cb, &found);
+	char what[64];
+	snprintf(what, sizeof what, "publication %lu", Boxnet_view_version(view));
+	int failed = compare_pairs(what, &found, &brute);
+	free(found.pairs);
+	free(brute.pairs);
+	free(b);
+	return failed;
+}
+
+static void* reader_run(void* arg) {
+	Reader* r = arg;
+	Boxnet_view* view = NULL;
+	while(view==NULL)
+		view = Boxnet_view_acquire(r->net);
+	unsigned long version = 0;
+	for(;;) {
+		int done = __atomic_load_n(&r->done, __ATOMIC_ACQUIRE);
+		if(Boxnet_view_version(view) < version) {
+			printf("publication %lu after %lu\n", Boxnet_view_version(view), version);
+			r->failed = 1;
+		}
+		if(Boxnet_view_version(view) > version) {
+			version = Boxnet_view_version(view);
+			r->failed |= check_view_brute(view);
+			r->views++;
+		}
+		if(done || r->failed)
+			break;
+		Boxnet_view_refresh(view, r->net);
+	}
+	Boxnet_view_free(view);
+	return NULL;
+}
+
+/*
+	Publications: the main thread moves, repairs, collides and
+	publishes the net while a reader thread checks the views it
+	gets. Pairs are found by box number, so the reader doesn't
+	need the objects.
+*/
+static int test_publish() {
+	World w;
+	World_init(&w, 1000, 43);
+	Boxnet* net = Boxnet_new();
+	World_add(&w, net);
+	Reader reader = {net, 0, 0, 0};
+	Boxnet_publish(net);
+	pthread_t thread;
+	if(pthread_create(&thread, NULL, reader_run, &reader)!=0) {
+		printf("no reader thread\n");
+		return 1;
+	}
+	int failed = 0;
+	for(int frame=0;frame<40 && !failed;frame++) {
+		World_move(&w, 1);
+		char what[64];
+		snprintf(what, sizeof what, "frame %i", frame);
+		failed = check_collide(what, net, &w);
+		if(Boxnet_publish(net)!=0) {
+			printf("Boxnet_publish() failed\n");
+			failed = 1;
+		}
+		// give the reader a chance on a single core
+		struct timespec pause = {0, 2000000};
+		nanosleep(&pause, NULL);
+	}
+	__atomic_store_n(&reader.done, 1, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+	if(reader.views<2) {
+		printf("the reader checked %i publications\n", reader.views);
+		failed = 1;
+	}
+	// the views keep their publication alive, the net doesn't
+	Boxnet_view* view = Boxnet_view_acquire(net);
+	Boxnet_free(net);
+	failed |= reader.failed || check_view_brute(view);
+	Boxnet_view_free(view);
+	World_free(&w);
+	return failed;
+}
+
+
+/*
+	brute force in the periodic unit square: pairs whose bounds,
+	taken modulo 1, overlap across a seam or not
+*/
+static int check_periodic(const char* what, Pairs* found, World* w) {
+	Pairs brute = {NULL, 0, 0, w->n};
+	double* home = malloc(4 * w->n * sizeof *home);
+	for(int i=0;i<w->n;i++) {
+		const double* b = w->objs[i].b;
+		double dx = floor(b[0]), dy = floor(b[1]);
+		home[4*i] = b[0]-dx;	home[4*i+1] = b[1]-dy;
+		home[4*i+2] = b[2]-dx;	home[4*i+3] = b[3]-dy;
+	}
+	for(int i=0;i<w->n;i++) {
+		if(w->objs[i].box==NULL)
+			continue;
+		for(int j=i+1;j<w->n;j++) {
+			if(w->objs[j].box==NULL)
+				continue;
+			int hit = 0;
+			for(int k=0;k<9 && !hit;k++) {
+				double dx = k%3-1, dy = k/3-1;
+				double b[4] = {home[4*j]+dx, home[4*j+1]+dy, home[4*j+2]+dx, home[4*j+3]+dy};
+				hit = overlap(&home[4*i], b);
+			}
+			if(hit)
+				Pairs_add(&brute, i, j);
+		}
+	}
+	int failed = compare_pairs(what, found, &brute);
+	free(brute.pairs);
+	free(home);
+	return failed;
+}
+
+/*
+	Periodic worlds: boxes drift over the seams and are teleported
+	whole periods away, deleted and added, also while a budgeted
+	repair is pending, with interleaved walks, after a rebuild and
+	with threads. Every frame, the pairs have to be those of
+	brute force, the bounds of the boxes have to stay as they were
+	set, and the ghosts mustn't show up in net->boxes, take ids or
+	be missing from the memory usage.
+*/
+static int test_periodic() {
+	Counting c = {0, 0, 0, 0};
+	Boxnet_allocator allocator = {counting_alloc, counting_realloc, counting_free, &c};
+	World w;
+	World_init(&w, 2000, 49);
+	// boxes that are together wider than the domain
+	for(int k=0;k<3;k++) {
+		double* b = w.objs[k].b;
+		b[0] = 0.3*k;	b[1] = 0.25*k;
+		b[2] = b[0] + 0.6;	b[3] = b[1] + 0.05;
+	}
+	Boxnet* net = Boxnet_newalloc(&allocator);
+	Boxnet_setperiodic(net, 0, 0, 1, 1);
+	World_add(&w, net);
+	unsigned int ids = w.n;
+	int failed = 0;
+	for(int frame=0;frame<12 && !failed;frame++) {
+		for(int i=0;i<w.n;i++) {
+			Obj* o = &w.objs[i];
+			if(o->box==NULL) {
+				o->box = Boxnet_addbox(net, o->b[0], o->b[1], o->b[2], o->b[3], NULL, o);
+				ids++;
+			} else if((i+frame)%97==0) {
+				Boxnet_delbox(net, o->box);
+				o->box = NULL;
+			} else if((i+frame)%13==0) {
+				// a whole number of periods away
+				double dx = (i%5)-2, dy = (i%3)-1;
+				o->b[0] += dx;	o->b[2] += dx;
+				o->b[1] += dy;	o->b[3] += dy;
+				Boxnet_movebox(net, o->box, o->b[0], o->b[1], o->b[2], o->b[3]);
+			} else {
+				move_bounds(&w, o->b, 2);
+				o->box->posx = o->b[0];	o->box->posy = o->b[1];
+				o->box->right = o->b[2];	o->box->top = o->b[3];
+			}
+		}
+		// the loops over the net have to cover the ghosts
+		if(frame==4) {
+			Boxnet_setwalks(net, 4);
+			Boxnet_rebuild(net);
+		} else if(frame==7) {
+			Boxnet_setthreads(net, 2);
+		}
+		if(frame%3==2) {
+			// boxes come and go while the repair is pending
+			for(int done=0,k=0;!done;k++) {
+				done = Boxnet_repairsome(net, 200, 0);
+				Obj* o = &w.objs[(frame*31+k)%w.n];
+				if(o->box!=NULL) {
+					Boxnet_delbox(net, o->box);
+					o->box = NULL;
+				} else {
+					o->box = Boxnet_addbox(net, o->b[0], o->b[1], o->b[2], o->b[3], NULL, o);
+					ids++;
+				}
+			}
+		}
+		Pairs found = {NULL, 0, 0, w.n};
+		Boxnet_collide(net, pair_cb, &found);
+		char what[64];
+		snprintf(what, sizeof what, "frame %i", frame);
+		failed |= check_periodic(what, &found, &w);
+		free(found.pairs);
+		for(int i=0;i<net->boxes_size && !failed;i++) {
+			Box* box = net->boxes[i];
+			Obj* o = box->usrdata;
+			if(box->ghost || o<w.objs || o>=w.objs+w.n || o->box!=box) {
+				printf("%s: net->boxes[%i] isn't a box of the user\n", what, i);
+				failed = 1;
+			} else if(box->posx!=o->b[0] || box->posy!=o->b[1] ||
+					box->right!=o->b[2] || box->top!=o->b[3]) {
+				printf("%s: the bounds of box %i changed\n", what, o->index);
+				failed = 1;
+			}
+		}
+		if(net->next_id!=ids || net->ghosts_size==0) {
+			printf("%s: %u ids taken for %u boxes, %i ghosts\n", what,
+					net->next_id, ids, net->ghosts_size);
+			failed = 1;
+		}
+		Boxnet_memory m;
+		failed |= check_memory(what, net, &c, &m);
+		if(m.ghosts != net->ghosts_size * sizeof(Box)) {
+			printf("%s: %zu bytes of ghosts reported\n", what, m.ghosts);
+			failed = 1;
+		}
+	}
+	Boxnet_free(net);
+	if(c.blocks!=0 || c.bytes!=0) {
+		printf("%li blocks of %li bytes left\n", c.blocks, c.bytes);
+		failed = 1;
+	}
+	World_free(&w);
+	return failed;
+}
+
+
+typedef struct Test {
+	const char*	name;
+	int			(*run)();
+} Test;
+
+static const Test tests[] = {
+	{"allocator", test_allocator},
+	{"pipeline_concurrent", test_pipeline_concurrent},
+	{"margin", test_margin},
+	{"memory", test_memory},
+	{"movebox", test_movebox},
+	{"optimize_budget", test_optimize_budget},
+	{"periodic", test_periodic},
+	{"pipeline_deferred", test_pipeline_deferred},
+	{"publish", test_publish},
+	{"quality_rebuild", test_quality_rebuild},
+	{"reorder", test_reorder},
+	{"repairsome", test_repairsome},
+	{"snapshot", test_snapshot},
+	{"snapshot_giants", test_snapshot_giants},
+	{"sweep_toi", test_sweep_toi},
+	{"view", test_view},
+	{"view_corrupt", test_view_corrupt},
+};
+
+int main(int argc, char** argv) {
+	int ntests = sizeof tests / sizeof *tests;
+	for(int i=0;i<ntests;i++)
+		if(argc==2 && !strcmp(argv[1], tests[i].name))
+			return tests[i].run();
+	fprintf(stderr,"usage: %s test\ntests:", argv[0]);
+	for(int i=0;i<ntests;i++)
+		fprintf(stderr," %s", tests[i].name);
+	fprintf(stderr,"\n");
+	return 2;
+}